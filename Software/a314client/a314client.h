@@ -0,0 +1,369 @@
+/*
+ * a314client.h - client library for native a314 services.
+ *
+ * Implements the MessageHeader framing and the register/connect/data
+ * lifecycle spoken over the a314d client socket, so a service written in
+ * C++ does not have to re-implement the protocol. The library is header
+ * only and is included from the service's single translation unit:
+ *
+ *     #include "../a314client/a314client.h"
+ *
+ *     static void process_drv_msg(uint32_t stream_id, uint8_t type,
+ *         const uint8_t *payload, size_t len)
+ *     {
+ *         if (type == MSG_CONNECT)
+ *             a314_connect_response(stream_id, CONNECT_RES_OK);
+ *         else if (type == MSG_DATA)
+ *             ...
+ *     }
+ *
+ *     int main(int argc, char **argv)
+ *     {
+ *         if (!a314_init("myservice", argc, argv, process_drv_msg))
+ *             return -1;
+ *         return a314_run();
+ *     }
+ *
+ * The API is asynchronous: a314_append()/a314_send_data() queue messages
+ * in a reused output buffer and a314_flush() writes as much as the
+ * non-blocking socket accepts. Services that only react to driver
+ * messages call a314_run(), which polls the driver socket until the
+ * connection goes away. Services with their own descriptors or timers
+ * run their own poll loop and use a314_fd(), a314_handle_readable(),
+ * a314_want_write() and a314_flush() directly; see the loop in
+ * a314_run() for how they fit together.
+ *
+ * a314_init() handles both standalone startup (unix socket with TCP
+ * fallback plus MSG_REGISTER_REQ) and on-demand spawning by a314d (the
+ * -ondemand argument), so services behave the same however they are
+ * started.
+ */
+
+#ifndef A314CLIENT_H
+#define A314CLIENT_H
+
+#include <arpa/inet.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+// Messages that are communicated between driver and client.
+#define MSG_REGISTER_REQ        1
+#define MSG_REGISTER_RES        2
+#define MSG_DEREGISTER_REQ      3
+#define MSG_DEREGISTER_RES      4
+#define MSG_READ_MEM_REQ        5
+#define MSG_READ_MEM_RES        6
+#define MSG_WRITE_MEM_REQ       7
+#define MSG_WRITE_MEM_RES       8
+#define MSG_CONNECT             9
+#define MSG_CONNECT_RESPONSE    10
+#define MSG_DATA                11
+#define MSG_EOS                 12
+#define MSG_RESET               13
+#define MSG_SHM_SETUP_REQ       14
+#define MSG_SHM_SETUP_RES       15
+#define MSG_DATA_SHM            16
+#define MSG_READ_MEM_STREAM     17
+#define MSG_WRITE_MEM_STREAM    18
+#define MSG_READ_MEM_SG         19
+#define MSG_WRITE_MEM_SG        20
+
+// Results for MSG_CONNECT_RESPONSE payloads.
+#define CONNECT_RES_OK          0
+#define CONNECT_RES_UNKNOWN     3
+
+#define A314_UNIX_SOCKET_PATH   "/run/a314/a314d.sock"
+
+// The largest payload of a single PKT_DATA on the link; what one MSG_DATA
+// towards the Amiga may carry at most.
+#define A314_MAX_DATA_LENGTH    252
+
+// Handler for messages from the driver; payload is only valid during the
+// call.
+typedef void (*a314_msg_handler)(uint32_t stream_id, uint8_t type,
+    const uint8_t *payload, size_t len);
+
+static int a314_drv_fd = -1;
+static a314_msg_handler a314_handler = nullptr;
+
+// Output and input buffers are reused across wakeups; they keep their
+// capacity so the steady state performs no allocations.
+static std::vector<uint8_t> a314_out_buf;
+static size_t a314_out_pos = 0;
+static std::vector<uint8_t> a314_rbuf;
+
+// Appends a message header to the output buffer and returns a pointer to
+// its payload area of the given length for the caller to fill in.
+static inline uint8_t *a314_append(uint8_t type, uint32_t stream_id, uint32_t length)
+{
+    size_t pos = a314_out_buf.size();
+    a314_out_buf.resize(pos + 9 + length);
+
+    uint8_t *p = &a314_out_buf[pos];
+    memcpy(&p[0], &length, 4);
+    memcpy(&p[4], &stream_id, 4);
+    p[8] = type;
+    return &p[9];
+}
+
+static inline void a314_send_data(uint32_t stream_id, const uint8_t *data, uint32_t length)
+{
+    uint8_t *p = a314_append(MSG_DATA, stream_id, length);
+    memcpy(p, data, length);
+}
+
+static inline void a314_connect_response(uint32_t stream_id, uint8_t result)
+{
+    uint8_t *p = a314_append(MSG_CONNECT_RESPONSE, stream_id, 1);
+    p[0] = result;
+}
+
+static inline void a314_send_eos(uint32_t stream_id)
+{
+    a314_append(MSG_EOS, stream_id, 0);
+}
+
+static inline void a314_send_reset(uint32_t stream_id)
+{
+    a314_append(MSG_RESET, stream_id, 0);
+}
+
+static inline void a314_read_mem(uint32_t address, uint32_t length)
+{
+    uint8_t *p = a314_append(MSG_READ_MEM_REQ, 0, 8);
+    memcpy(&p[0], &address, 4);
+    memcpy(&p[4], &length, 4);
+}
+
+static inline void a314_write_mem(uint32_t address, const uint8_t *data, uint32_t length)
+{
+    uint8_t *p = a314_append(MSG_WRITE_MEM_REQ, 0, 4 + length);
+    memcpy(&p[0], &address, 4);
+    memcpy(&p[4], data, length);
+}
+
+// Writes as much of the queued output as the socket accepts; the rest is
+// flushed when the socket becomes writable. Returns false if the
+// connection to the driver was closed.
+static inline bool a314_flush()
+{
+    while (a314_out_pos < a314_out_buf.size())
+    {
+        ssize_t w = send(a314_drv_fd, &a314_out_buf[a314_out_pos],
+            a314_out_buf.size() - a314_out_pos, 0);
+        if (w > 0)
+            a314_out_pos += w;
+        else if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        else
+            return false;
+    }
+
+    a314_out_buf.clear();
+    a314_out_pos = 0;
+    return true;
+}
+
+static inline int a314_fd()
+{
+    return a314_drv_fd;
+}
+
+// True when queued output remains, so the caller's poll should include
+// POLLOUT for the driver socket.
+static inline bool a314_want_write()
+{
+    return a314_out_pos < a314_out_buf.size();
+}
+
+// Drains the driver socket and dispatches every complete message to the
+// handler. Returns false if the connection to the driver was closed.
+static inline bool a314_handle_readable()
+{
+    uint8_t chunk[8192];
+    while (true)
+    {
+        ssize_t r = recv(a314_drv_fd, chunk, sizeof(chunk), 0);
+        if (r > 0)
+            a314_rbuf.insert(a314_rbuf.end(), chunk, chunk + r);
+        else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+            return false;
+    }
+
+    size_t pos = 0;
+    while (a314_rbuf.size() - pos >= 9)
+    {
+        uint32_t plen, stream_id;
+        memcpy(&plen, &a314_rbuf[pos], 4);
+        memcpy(&stream_id, &a314_rbuf[pos + 4], 4);
+        uint8_t type = a314_rbuf[pos + 8];
+
+        if (a314_rbuf.size() - pos < 9 + plen)
+            break;
+
+        a314_handler(stream_id, type, &a314_rbuf[pos + 9], plen);
+        pos += 9 + plen;
+    }
+    a314_rbuf.erase(a314_rbuf.begin(), a314_rbuf.begin() + pos);
+
+    return true;
+}
+
+static inline bool a314_connect_driver()
+{
+    a314_drv_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (a314_drv_fd >= 0)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, A314_UNIX_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+        if (connect(a314_drv_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return true;
+
+        close(a314_drv_fd);
+    }
+
+    a314_drv_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (a314_drv_fd < 0)
+        return false;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(7110);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(a314_drv_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(a314_drv_fd);
+        return false;
+    }
+
+    int flag = 1;
+    setsockopt(a314_drv_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    return true;
+}
+
+// Blocking registration; runs before the socket is put in non-blocking
+// mode.
+static inline bool a314_register_service(const char *service_name)
+{
+    uint32_t length = strlen(service_name);
+    uint8_t header[9];
+    memcpy(&header[0], &length, 4);
+    memset(&header[4], 0, 4);
+    header[8] = MSG_REGISTER_REQ;
+
+    if (send(a314_drv_fd, header, sizeof(header), 0) != sizeof(header) ||
+        send(a314_drv_fd, service_name, length, 0) != (ssize_t)length)
+        return false;
+
+    uint8_t res_header[9];
+    size_t got = 0;
+    while (got < sizeof(res_header))
+    {
+        ssize_t r = recv(a314_drv_fd, &res_header[got], sizeof(res_header) - got, 0);
+        if (r <= 0)
+            return false;
+        got += r;
+    }
+
+    uint32_t plen;
+    memcpy(&plen, &res_header[0], 4);
+    if (res_header[8] != MSG_REGISTER_RES || plen != 1)
+        return false;
+
+    uint8_t result;
+    if (recv(a314_drv_fd, &result, 1, 0) != 1)
+        return false;
+
+    return result == 1;
+}
+
+// Connects to the driver and registers the service, or adopts the
+// socketpair descriptor when spawned on demand by a314d (-ondemand <fd>).
+// The descriptor ends up in non-blocking mode either way.
+static inline bool a314_init(const char *service_name, int argc, char **argv,
+    a314_msg_handler handler)
+{
+    a314_handler = handler;
+
+    int ondemand_fd = -1;
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], "-ondemand") == 0)
+            ondemand_fd = atoi(argv[i + 1]);
+    }
+
+    if (ondemand_fd != -1)
+        a314_drv_fd = ondemand_fd;
+    else
+    {
+        if (!a314_connect_driver())
+        {
+            fprintf(stderr, "Unable to connect to a314d\n");
+            return false;
+        }
+
+        if (!a314_register_service(service_name))
+        {
+            fprintf(stderr, "Unable to register %s with driver\n", service_name);
+            return false;
+        }
+    }
+
+    fcntl(a314_drv_fd, F_SETFL, fcntl(a314_drv_fd, F_GETFL, 0) | O_NONBLOCK);
+    return true;
+}
+
+// Poll loop for services that only react to driver messages. Returns when
+// the connection to the driver goes away or on SIGINT/SIGTERM (EINTR).
+static inline int a314_run()
+{
+    while (true)
+    {
+        struct pollfd pfd;
+        pfd.fd = a314_drv_fd;
+        pfd.events = POLLIN | (a314_want_write() ? POLLOUT : 0);
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, -1) < 0)
+        {
+            if (errno == EINTR)
+                return 0;
+            fprintf(stderr, "poll failed with unexpected errno = %d\n", errno);
+            return -1;
+        }
+
+        if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+        {
+            if (!a314_handle_readable())
+                return 0;
+        }
+
+        if (!a314_flush())
+            return 0;
+    }
+}
+
+#endif /* A314CLIENT_H */
@@ -2,8 +2,14 @@
  * Copyright (c) 2018 Niklas Ekström
  */
 
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
 #include <arpa/inet.h>
 
+#include <linux/gpio.h>
+#include <linux/io_uring.h>
 #include <linux/spi/spidev.h>
 #include <linux/types.h>
 
@@ -11,10 +17,16 @@
 #include <netinet/tcp.h>
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #include <ctype.h>
 #include <errno.h>
@@ -28,8 +40,13 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <list>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #define LOGGER_TRACE 0
@@ -52,12 +69,26 @@
 #define WRITE_SRAM_CMD          1
 #define READ_CMEM_CMD           2
 #define WRITE_CMEM_CMD          3
+#define READ_SRAM_CRC_CMD       4
+#define WRITE_SRAM_CRC_CMD      5
 #define SPI_PROTO_VER_CMD       255
 
 #define READ_SRAM_HDR_LEN       4
 
+// SRAM transfers carry a CRC32 trailer when the gateware reports protocol
+// version 2 or later.
+#define SPI_CRC_PROTO_VER       2
+#define CRC_TRAILER_LEN         4
+#define CRC_WRITE_OK            0xa3
+#define CRC_RETRIES             3
+
+// Bits in the base address that is published through CMEM.
+#define BASE_ADDRESS_VALID      1
+#define BASE_ADDRESS_CA_V2      2
+
 // Addresses to variables in CMEM.
 #define BASE_ADDRESS_LEN        6
+#define FRAME_FORMAT_ADDRESS    9
 #define R_EVENTS_ADDRESS        12
 #define R_ENABLE_ADDRESS        13
 #define A_EVENTS_ADDRESS        14
@@ -79,6 +110,7 @@
 #define A2R_HEAD_OFFSET         3
 
 // Packets that are communicated across physical channels (A2R and R2A).
+#define PKT_SETTINGS            3
 #define PKT_CONNECT             4
 #define PKT_CONNECT_RESPONSE    5
 #define PKT_DATA                6
@@ -89,6 +121,17 @@
 #define CONNECT_OK              0
 #define CONNECT_UNKNOWN_SERVICE 3
 
+// Frame formats negotiated through PKT_SETTINGS. The legacy format has a
+// 1-byte packet length; FRAME_FORMAT_EXT16 uses a 2-byte big-endian length
+// so bulk streams can move in larger packets. The Amiga driver offers the
+// format in the first a2r packet; each ring direction switches right after
+// the PKT_SETTINGS packet that acknowledges (r2a) or confirms (a2r) it.
+#define FRAME_FORMAT_EXT16      1
+
+// Largest PKT_DATA payload in the extended frame format; also bounded per
+// link by the ring sizes.
+#define EXT_FRAME_MAX_DATA      4096
+
 // Messages that are communicated between driver and client.
 #define MSG_REGISTER_REQ        1
 #define MSG_REGISTER_RES        2
@@ -103,40 +146,162 @@
 #define MSG_DATA                11
 #define MSG_EOS                 12
 #define MSG_RESET               13
+#define MSG_SHM_SETUP_REQ       14
+#define MSG_SHM_SETUP_RES       15
+#define MSG_DATA_SHM            16
+#define MSG_READ_MEM_STREAM     17
+#define MSG_WRITE_MEM_STREAM    18
+#define MSG_READ_MEM_SG         19
+#define MSG_WRITE_MEM_SG        20
 
 #define MSG_SUCCESS             1
 #define MSG_FAIL                0
 
-#define IRQ_GPIO                "25"
+#define GPIO_CHIP_DEVICE        "/dev/gpiochip0"
+#define IRQ_GPIO                25
 
 static sigset_t original_sigset;
 
 static uint8_t mode = SPI_CS_HIGH;
 static uint8_t bits = 8;
+
+// Defaults applied to every link; overridden by "speed" configuration lines.
 static uint32_t speed = 67000000;
+static bool speed_auto = false;
+
+// Large enough for a full 64 kB ring plus the SRAM command header. Scratch
+// for synchronous transfers; the main thread services one link at a time,
+// so the buffers are shared between links.
+static unsigned char tx_buf[65536 + 8];
+static unsigned char rx_buf[65536 + 8];
+
+// SPI transfers are executed on a dedicated worker thread so that the epoll
+// loop can keep servicing client sockets while a transfer is in flight.
+// Jobs are passed through single-producer/single-consumer lock-free queues;
+// eventfds are used to wake up the consuming side.
+
+#define SPI_JOB_SYNC            0
+#define SPI_JOB_READ_MEM        1
+#define SPI_JOB_WRITE_MEM       2
+#define SPI_JOB_SYNC_MULTI      3
+#define SPI_JOB_READ_MEM_SG     4
+#define SPI_JOB_WRITE_MEM_SG    5
+
+// A chained transaction of up to SPI_MAX_SEGMENTS commands that are sent as
+// one SPI_IOC_MESSAGE(N) ioctl, with the chip select toggled between the
+// segments. This saves the fixed per-ioctl overhead for each round trip.
+#define SPI_MAX_SEGMENTS        4
+
+struct SpiTransaction
+{
+    int count;
+    std::vector<uint8_t> tx[SPI_MAX_SEGMENTS];
+    std::vector<uint8_t> rx[SPI_MAX_SEGMENTS];
+
+    SpiTransaction() : count(0) {}
+
+    void reset() { count = 0; }
+
+    uint8_t *add_segment(int len)
+    {
+        tx[count].assign(len, 0);
+        rx[count].assign(len, 0);
+        return &tx[count++][0];
+    }
+};
+
+struct AmigaLink;
+
+// One region of a scatter-gather memory job.
+struct SgSegment
+{
+    unsigned int address;
+    unsigned int length;
+};
+
+struct SpiJob
+{
+    int type;
+    AmigaLink *link;
+    unsigned int address;
+    unsigned int length;
+    std::vector<SgSegment> segments;
+    std::vector<uint8_t> buf;
+    SpiTransaction *txn;
+
+    // The connection the result goes to, identified by fd plus the
+    // connection's generation number; the fd alone is not enough since the
+    // kernel may reuse it for a new connection while the job is in flight.
+    int client_fd;
+    uint64_t client_gen;
+
+    bool notify;
+    std::atomic<bool> done;
+
+    SpiJob() : type(0), link(nullptr), address(0), length(0), txn(nullptr), client_fd(-1), client_gen(0), notify(true), done(false) {}
+};
+
+#define SPI_QUEUE_SIZE          256
+
+struct SpiJobQueue
+{
+    SpiJob *jobs[SPI_QUEUE_SIZE];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+
+    SpiJobQueue() : head(0), tail(0) {}
+
+    bool push(SpiJob *job)
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == SPI_QUEUE_SIZE)
+            return false;
+        jobs[t % SPI_QUEUE_SIZE] = job;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    SpiJob *pop()
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return nullptr;
+        SpiJob *job = jobs[h % SPI_QUEUE_SIZE];
+        head.store(h + 1, std::memory_order_release);
+        return job;
+    }
+};
 
-static int spi_fd = -1;
-static int spi_proto_ver = 0;
+static SpiJobQueue spi_submit_queue;
+static SpiJobQueue spi_complete_queue;
 
-static unsigned char tx_buf[65536];
-static unsigned char rx_buf[65536];
+static int spi_submit_efd = -1;
+static int spi_complete_efd = -1;
 
-static bool gpio_exported = false;
-static bool gpio_edge_set = false;
-static int gpio_fd = -1;
+static std::thread spi_thread;
+static bool spi_thread_started = false;
+static std::atomic<bool> spi_thread_stop(false);
+
+static std::mutex spi_sync_mutex;
+static std::condition_variable spi_sync_cv;
+
+// Buffers owned by the SPI worker thread, used for asynchronous jobs so that
+// they don't clash with tx_buf/rx_buf which the main thread prepares for
+// synchronous transfers.
+static unsigned char worker_tx_buf[65536 + 8];
+static unsigned char worker_rx_buf[65536 + 8];
 
 static int server_socket = -1;
 
-static int epfd = -1;
+#define UNIX_SOCKET_DIR         "/run/a314"
+#define UNIX_SOCKET_PATH        UNIX_SOCKET_DIR "/a314d.sock"
 
-static bool have_base_address = false;
-static unsigned int base_address = 0;
+static int unix_socket = -1;
 
-static uint8_t channel_status[4];
-static uint8_t channel_status_updated = 0;
+static int epfd = -1;
 
-static uint8_t recv_buf[256];
-static uint8_t send_buf[256];
+static uint8_t recv_buf[65536];
+static uint8_t send_buf[65536];
 
 struct LogicalChannel;
 struct ClientConnection;
@@ -156,11 +321,6 @@ struct MessageBuffer
     std::vector<uint8_t> data;
 };
 
-struct RegisteredService
-{
-    std::string name;
-    ClientConnection *cc;
-};
 
 struct PacketBuffer
 {
@@ -168,42 +328,460 @@ struct PacketBuffer
     std::vector<uint8_t> data;
 };
 
+// Message and packet buffers are recycled through free lists instead of
+// being allocated and freed for every message. The list nodes are moved with
+// splice() so the steady-state hot path performs no heap allocations; the
+// vectors keep their capacity across reuse. The pools are bounded, and
+// oversized buffers (from large read_mem responses) are dropped on release
+// rather than pinned in the pool.
+#define BUFFER_POOL_MAX_NODES   256
+#define BUFFER_POOL_MAX_CAPACITY 16384
+
+// Bounds on queued data, so that a stalled peer cannot grow the daemon
+// without limit. A connection whose client stops reading is closed once its
+// message queue passes the limit; a connection that floods a channel faster
+// than the Amiga drains it is paused (its socket is not read) until the
+// packet queue falls below the low water mark, which propagates the
+// backpressure into the client's socket buffer.
+#define MSG_QUEUE_LIMIT_BYTES   (16 * 1024 * 1024)
+#define PKT_QUEUE_HIGH_WATER    (256 * 1024)
+#define PKT_QUEUE_LOW_WATER     (64 * 1024)
+
+static std::list<MessageBuffer> free_message_buffers;
+static std::list<PacketBuffer> free_packet_buffers;
+
+static MessageBuffer &acquire_message_buffer(std::list<MessageBuffer> &queue, int size)
+{
+    if (free_message_buffers.empty())
+        queue.emplace_back();
+    else
+        queue.splice(queue.end(), free_message_buffers, free_message_buffers.begin());
+
+    MessageBuffer &mb = queue.back();
+    mb.pos = 0;
+    mb.data.resize(size);
+    return mb;
+}
+
+static void release_message_buffer(std::list<MessageBuffer> &queue, std::list<MessageBuffer>::iterator it)
+{
+    if (free_message_buffers.size() >= BUFFER_POOL_MAX_NODES || it->data.capacity() > BUFFER_POOL_MAX_CAPACITY)
+        queue.erase(it);
+    else
+        free_message_buffers.splice(free_message_buffers.end(), queue, it);
+}
+
+static void release_all_message_buffers(std::list<MessageBuffer> &queue)
+{
+    while (!queue.empty())
+        release_message_buffer(queue, queue.begin());
+}
+
+static PacketBuffer &acquire_packet_buffer(std::list<PacketBuffer> &queue, int size)
+{
+    if (free_packet_buffers.empty())
+        queue.emplace_back();
+    else
+        queue.splice(queue.end(), free_packet_buffers, free_packet_buffers.begin());
+
+    PacketBuffer &pb = queue.back();
+    pb.data.resize(size);
+    return pb;
+}
+
+static void release_packet_buffer(std::list<PacketBuffer> &queue, std::list<PacketBuffer>::iterator it)
+{
+    if (free_packet_buffers.size() >= BUFFER_POOL_MAX_NODES || it->data.capacity() > BUFFER_POOL_MAX_CAPACITY)
+        queue.erase(it);
+    else
+        free_packet_buffers.splice(free_packet_buffers.end(), queue, it);
+}
+
+static void release_all_packet_buffers(std::list<PacketBuffer> &queue)
+{
+    while (!queue.empty())
+        release_packet_buffer(queue, queue.begin());
+}
+
 struct ClientConnection
 {
     int fd;
 
+    // Monotonically increasing per-connection number, used to tell whether
+    // the connection an in-flight SPI job was submitted for is still the
+    // connection behind the fd when the result comes back.
+    uint64_t generation;
+
+    // Set for connections over the UNIX domain socket (and socketpairs to
+    // on-demand services), which may pass file descriptors with SCM_RIGHTS.
+    bool is_unix;
+
+    // Shared-memory ring handed over by the client through MSG_SHM_SETUP_REQ.
+    // The first 8 bytes hold two little-endian uint32 positions: the client's
+    // produce position and the daemon's consume position; payload bytes
+    // follow. The daemon advances the consume position once the bytes of a
+    // MSG_DATA_SHM message have been copied out of the ring.
+    int pending_shm_fd;
+    int shm_fd;
+    uint8_t *shm_map;
+    uint32_t shm_size;
+
     int next_stream_id;
 
-    int bytes_read;
+    // Buffered input: bytes are read in large chunks into rbuf and parsed
+    // into as many complete messages as arrived. While a message is being
+    // dispatched, header holds its header and payload points at its payload
+    // bytes inside rbuf.
+    std::vector<uint8_t> rbuf;
     MessageHeader header;
-    std::vector<uint8_t> payload;
+    uint8_t *payload;
 
     std::list<MessageBuffer> message_queue;
 
+    // Bytes held in message_queue, and whether the limit has been passed;
+    // an overflowed connection is closed at the end of the wakeup unless
+    // the flush brought it back under the limit.
+    size_t queued_bytes;
+    bool overflowed;
+
+    // Set when an associated channel's packet queue passed the high water
+    // mark; the socket is not read again until the queue has drained.
+    bool recv_paused;
+
+    // Set while the connection is waiting on the flush list; the queued
+    // messages are gathered into one writev() at the end of the wakeup.
+    bool flush_pending;
+
     std::list<LogicalChannel*> associations;
+
+    // Statistics, exported through the stats socket.
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t messages_in;
+    uint64_t messages_out;
 };
 
+// QoS classes for logical channels. Lower number means higher priority;
+// latency-sensitive channels preempt bulk channels when packing send_buf.
+#define PRIO_HIGH               0
+#define PRIO_NORMAL             1
+#define PRIO_BULK               2
+#define PRIO_CLASS_COUNT        3
+
+struct ChannelStats;
+
 struct LogicalChannel
 {
     int channel_id;
 
+    // The link the channel was opened on; channel ids are per link.
+    AmigaLink *link;
+
     ClientConnection *association;
     int stream_id;
 
+    int priority;
+
     bool got_eos_from_ami;
     bool got_eos_from_client;
 
     std::list<PacketBuffer> packet_queue;
+
+    // Frame-paced channels (marked with a "paced" configuration line) stage
+    // their packets here and release them to packet_queue at the frame tick,
+    // so a whole frame is handed to the link back-to-back instead of landing
+    // mid-refresh interleaved with other traffic.
+    bool paced;
+    std::list<PacketBuffer> frame_queue;
+
+    // Bytes held in packet_queue and frame_queue. When this passes the high
+    // water mark the associated client connection is paused until the queue
+    // has drained to the low water mark.
+    size_t queued_bytes;
+
+    // Per-service statistics record; shared between all channels opened
+    // towards the same service, and kept after the channel is closed.
+    ChannelStats *stats;
+};
+
+// Per-link transport state: one Amiga wired to one SPI chip select with its
+// own IRQ line. Configured with "link <spidev> <irq-gpio>" lines; without
+// any link line a single default link on /dev/spidev0.0 is used. Client
+// connections and registered services are global and shared by all links;
+// SPI transfers from all links are serialized through the one worker
+// thread, which schedules them fairly in submit order.
+struct AmigaLink
+{
+    int index;
+    std::string spidev_path;
+    int irq_gpio;
+
+    int spi_fd;
+    int spi_proto_ver;
+    bool spi_crc_enabled;
+    uint32_t speed;
+    bool speed_auto;
+
+    int gpio_fd;
+
+    bool have_base_address;
+    unsigned int base_address;
+
+    // Layout of the communication area. Revision 2 of the com area
+    // (signaled by BASE_ADDRESS_CA_V2 in the base address handshake) uses
+    // 16-bit queue pointers and ring sizes chosen by the Amiga driver;
+    // revision 1 uses the original fixed 256-byte rings with 8-bit
+    // pointers.
+    bool com_area_v2;
+    unsigned int a2r_ring_size;
+    unsigned int r2a_ring_size;
+    unsigned int a2r_ring_offset;
+    unsigned int r2a_ring_offset;
+
+    // 16-bit packet framing negotiated through PKT_SETTINGS; the two ring
+    // directions switch independently at their negotiation packet, so a2r
+    // packets may still arrive in the legacy format after r2a has switched.
+    bool a2r_ext_frames;
+    bool r2a_ext_frames;
+    unsigned int max_pkt_data;
+
+    unsigned int channel_status[4];
+    uint8_t channel_status_updated;
+
+    std::list<LogicalChannel> channels;
+
+    // Direct-mapped index over channels; channel_id is a single byte.
+    LogicalChannel *channel_index[256];
+
+    std::list<LogicalChannel*> send_queues[PRIO_CLASS_COUNT];
 };
 
+static std::list<AmigaLink> links;
+
 static void remove_association(LogicalChannel *ch);
 static void clear_packet_queue(LogicalChannel *ch);
-static void create_and_enqueue_packet(LogicalChannel *ch, uint8_t type, uint8_t *data, uint8_t length);
+static void create_and_enqueue_packet(LogicalChannel *ch, uint8_t type, uint8_t *data, int length);
+static void close_and_remove_connection(ClientConnection *cc);
+static void init_io_uring();
 
 static std::list<ClientConnection> connections;
-static std::list<RegisteredService> services;
-static std::list<LogicalChannel> channels;
-static std::list<LogicalChannel*> send_queue;
+static std::unordered_map<int, ClientConnection*> connections_by_fd;
+static std::unordered_map<std::string, ClientConnection*> services;
+
+// Always-on statistics. The counters on the hot paths are plain increments;
+// only the SPI transfer counters are atomic since they are updated from both
+// the main thread and the SPI worker thread. The aggregated state is dumped
+// as JSON to anyone connecting to the stats socket.
+#define STATS_SOCKET_PATH       UNIX_SOCKET_DIR "/a314d-stats.sock"
+
+static int stats_socket = -1;
+
+// Per-service counters, found by name when a channel connects and kept for
+// the lifetime of the daemon so closed streams remain visible.
+struct ChannelStats
+{
+    std::string service_name;
+    uint64_t streams_opened;
+    uint64_t packets_to_ami;
+    uint64_t bytes_to_ami;
+    uint64_t packets_from_ami;
+    uint64_t bytes_from_ami;
+};
+
+static std::list<ChannelStats> service_stats;
+
+static ChannelStats *get_service_stats(const std::string &service_name)
+{
+    for (auto &cs : service_stats)
+    {
+        if (cs.service_name == service_name)
+            return &cs;
+    }
+
+    service_stats.emplace_back();
+    ChannelStats &cs = service_stats.back();
+    cs.service_name = service_name;
+    cs.streams_opened = 0;
+    cs.packets_to_ami = 0;
+    cs.bytes_to_ami = 0;
+    cs.packets_from_ami = 0;
+    cs.bytes_from_ami = 0;
+    return &cs;
+}
+
+// Histogram of IRQ-to-flush latency: bucket i counts wakeups where the time
+// from the GPIO edge timestamp until the interrupt was fully serviced (rings
+// drained and the send queue flushed) was at most 1 us << i.
+#define IRQ_LATENCY_BUCKETS     24
+
+static struct
+{
+    uint64_t start_time_ns;
+    uint64_t irq_count;
+    uint64_t a2r_ring_bytes;
+    uint64_t r2a_ring_bytes;
+    std::atomic<uint64_t> spi_transfers;
+    std::atomic<uint64_t> spi_bytes;
+    std::atomic<uint64_t> crc_errors;
+    uint64_t irq_latency[IRQ_LATENCY_BUCKETS];
+} link_stats;
+
+static void record_irq_latency(uint64_t latency_ns)
+{
+    int bucket = 0;
+    while (bucket < IRQ_LATENCY_BUCKETS - 1 && latency_ns > 1000ULL << bucket)
+        bucket++;
+    link_stats.irq_latency[bucket]++;
+}
+
+// Protocol tracing, enabled with a "trace <filename>" configuration line.
+// Every packet crossing the A2R and R2A rings becomes one fixed-size binary
+// record in a lock-free single-producer/single-consumer ring; a background
+// thread flushes filled records to the trace file, so the hot path does no
+// I/O and its timing stays representative. If the flusher cannot keep up,
+// records are dropped and counted rather than blocking the main loop.
+// Decoded offline with a314trace.py.
+
+#define TRACE_DIR_A2R           0
+#define TRACE_DIR_R2A           1
+
+#define TRACE_PREFIX_LEN        20
+#define TRACE_RING_RECORDS      16384 // Power of two.
+
+#define TRACE_FILE_MAGIC        "A314TRC1"
+
+struct TraceRecord
+{
+    uint64_t timestamp_ns;
+    uint8_t direction;
+    uint8_t ptype;
+    uint8_t channel_id;
+    uint16_t length; // 16 bits since extended frames carry up to 4096 bytes.
+    uint8_t payload[TRACE_PREFIX_LEN];
+};
+
+static bool trace_enabled = false;
+static std::string trace_filename;
+static FILE *trace_file = nullptr;
+
+static TraceRecord trace_ring[TRACE_RING_RECORDS];
+static std::atomic<uint32_t> trace_head(0);
+static std::atomic<uint32_t> trace_tail(0);
+static std::atomic<uint64_t> trace_dropped(0);
+
+static std::thread trace_thread;
+static std::atomic<bool> trace_thread_stop(false);
+static bool trace_thread_started = false;
+
+static void trace_pkt(uint8_t direction, uint8_t ptype, uint8_t channel_id,
+    const uint8_t *data, uint16_t length)
+{
+    uint32_t tail = trace_tail.load(std::memory_order_relaxed);
+    uint32_t head = trace_head.load(std::memory_order_acquire);
+
+    if (tail - head >= TRACE_RING_RECORDS)
+    {
+        trace_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    TraceRecord &tr = trace_ring[tail & (TRACE_RING_RECORDS - 1)];
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    tr.timestamp_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+    tr.direction = direction;
+    tr.ptype = ptype;
+    tr.channel_id = channel_id;
+    tr.length = length;
+
+    int prefix = length < TRACE_PREFIX_LEN ? length : TRACE_PREFIX_LEN;
+    if (prefix != 0)
+        memcpy(tr.payload, data, prefix);
+    if (prefix < TRACE_PREFIX_LEN)
+        memset(&tr.payload[prefix], 0, TRACE_PREFIX_LEN - prefix);
+
+    trace_tail.store(tail + 1, std::memory_order_release);
+}
+
+static void flush_trace_records()
+{
+    uint32_t head = trace_head.load(std::memory_order_relaxed);
+    uint32_t tail = trace_tail.load(std::memory_order_acquire);
+
+    while (head != tail)
+    {
+        // Write the contiguous run up to the end of the ring in one go.
+        uint32_t index = head & (TRACE_RING_RECORDS - 1);
+        uint32_t run = tail - head;
+        if (run > TRACE_RING_RECORDS - index)
+            run = TRACE_RING_RECORDS - index;
+
+        fwrite(&trace_ring[index], sizeof(TraceRecord), run, trace_file);
+
+        head += run;
+        trace_head.store(head, std::memory_order_release);
+    }
+}
+
+static void trace_thread_main()
+{
+    while (!trace_thread_stop.load(std::memory_order_acquire))
+    {
+        flush_trace_records();
+        usleep(100000);
+    }
+
+    flush_trace_records();
+    fflush(trace_file);
+}
+
+static int init_trace()
+{
+    if (trace_filename.empty())
+        return 0;
+
+    trace_file = fopen(trace_filename.c_str(), "wb");
+    if (trace_file == nullptr)
+    {
+        logger_error("Unable to open trace file %s\n", trace_filename.c_str());
+        return -1;
+    }
+
+    uint8_t header[16];
+    memcpy(&header[0], TRACE_FILE_MAGIC, 8);
+    uint32_t record_size = sizeof(TraceRecord);
+    memcpy(&header[8], &record_size, 4);
+    memset(&header[12], 0, 4);
+    fwrite(header, sizeof(header), 1, trace_file);
+
+    trace_thread = std::thread(trace_thread_main);
+    trace_thread_started = true;
+    trace_enabled = true;
+
+    logger_info("Tracing packets to %s\n", trace_filename.c_str());
+    return 0;
+}
+
+static void shutdown_trace()
+{
+    if (trace_thread_started)
+    {
+        trace_thread_stop.store(true, std::memory_order_release);
+        trace_thread.join();
+        trace_thread_started = false;
+
+        uint64_t dropped = trace_dropped.load(std::memory_order_relaxed);
+        if (dropped != 0)
+            logger_warn("Dropped %llu trace records\n", (unsigned long long)dropped);
+    }
+
+    if (trace_file != nullptr)
+        fclose(trace_file);
+    trace_file = nullptr;
+    trace_enabled = false;
+}
 
 struct OnDemandStart
 {
@@ -214,6 +792,63 @@ struct OnDemandStart
 
 std::vector<OnDemandStart> on_demand_services;
 
+// Services listed on "warm" configuration lines are spawned ahead of time
+// and respawned when their connection goes away, so the first Amiga connect
+// does not pay for interpreter startup before CONNECT_RESPONSE can flow.
+static std::vector<std::string> warm_services;
+
+// Cleared while shutting down so closed warm services are not respawned.
+static bool respawn_warm_services = true;
+
+static bool is_warm_service(const std::string &service_name)
+{
+    for (auto &name : warm_services)
+    {
+        if (name == service_name)
+            return true;
+    }
+    return false;
+}
+
+static ClientConnection *start_on_demand_service(OnDemandStart &on_demand);
+
+struct ServicePriority
+{
+    std::string service_name;
+    int priority;
+};
+
+static std::vector<ServicePriority> service_priorities;
+
+static int get_service_priority(const std::string &service_name)
+{
+    for (auto &sp : service_priorities)
+    {
+        if (sp.service_name == service_name)
+            return sp.priority;
+    }
+    return PRIO_NORMAL;
+}
+
+// Services whose channels are frame-synchronized, and the shared tick rate
+// their frames are released at. The Raspberry cannot observe the Amiga
+// vblank, so the tick is a free-running monotonic timer at the display
+// refresh rate; what pacing guarantees is that each frame crosses the link
+// contiguously once per period, not that it lands in the blanking interval.
+static std::vector<std::string> paced_services;
+static unsigned int pace_hz = 50;
+static int pace_timer_fd = -1;
+
+static bool is_service_paced(const std::string &service_name)
+{
+    for (auto &name : paced_services)
+    {
+        if (name == service_name)
+            return true;
+    }
+    return false;
+}
+
 static void load_config_file(const char *filename)
 {
     FILE *f = fopen(filename, "rt");
@@ -256,7 +891,67 @@ static void load_config_file(const char *filename)
             }
         }
 
-        if (parts.size() >= 2)
+        if (parts.size() == 3 && strcmp(parts[0], "priority") == 0)
+        {
+            int priority = PRIO_NORMAL;
+            if (strcmp(parts[2], "high") == 0)
+                priority = PRIO_HIGH;
+            else if (strcmp(parts[2], "normal") == 0)
+                priority = PRIO_NORMAL;
+            else if (strcmp(parts[2], "bulk") == 0)
+                priority = PRIO_BULK;
+            else
+                logger_warn("Unknown priority class in configuration file line: %s\n", org_line);
+
+            service_priorities.emplace_back();
+            auto &sp = service_priorities.back();
+            sp.service_name = parts[1];
+            sp.priority = priority;
+        }
+        else if ((parts.size() == 2 || parts.size() == 3) && strcmp(parts[0], "paced") == 0)
+        {
+            paced_services.push_back(parts[1]);
+
+            // The optional rate is shared by all paced services; the last
+            // line that specifies one wins.
+            if (parts.size() == 3)
+            {
+                unsigned int hz = strtoul(parts[2], nullptr, 10);
+                if (hz >= 10 && hz <= 120)
+                    pace_hz = hz;
+                else
+                    logger_warn("Invalid pace rate in configuration file line: %s\n", org_line);
+            }
+        }
+        else if (parts.size() == 2 && strcmp(parts[0], "trace") == 0)
+        {
+            trace_filename = parts[1];
+        }
+        else if (parts.size() == 2 && strcmp(parts[0], "warm") == 0)
+        {
+            warm_services.push_back(parts[1]);
+        }
+        else if (parts.size() == 2 && strcmp(parts[0], "speed") == 0)
+        {
+            if (strcmp(parts[1], "auto") == 0)
+                speed_auto = true;
+            else
+            {
+                unsigned int hz = strtoul(parts[1], nullptr, 10);
+                if (hz >= 1000000 && hz <= 200000000)
+                    speed = hz;
+                else
+                    logger_warn("Invalid SPI speed in configuration file line: %s\n", org_line);
+            }
+        }
+        else if (parts.size() == 3 && strcmp(parts[0], "link") == 0)
+        {
+            links.emplace_back();
+            auto &l = links.back();
+            l.spidev_path = parts[1];
+            l.irq_gpio = atoi(parts[2]);
+        }
+        else if (parts.size() >= 2)
         {
             on_demand_services.emplace_back();
             auto &e = on_demand_services.back();
@@ -277,15 +972,15 @@ static void load_config_file(const char *filename)
         logger_warn("No registered services\n");
 }
 
-static int init_spi()
+static int init_spi(AmigaLink *l)
 {
-    spi_fd = open("/dev/spidev0.0", O_RDWR | O_CLOEXEC);
-    if (spi_fd < 0)
+    l->spi_fd = open(l->spidev_path.c_str(), O_RDWR | O_CLOEXEC);
+    if (l->spi_fd < 0)
         return -1;
 
-    int ret = ioctl(spi_fd, SPI_IOC_WR_MODE, &mode);
-    ret |= ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
-    ret |= ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
+    int ret = ioctl(l->spi_fd, SPI_IOC_WR_MODE, &mode);
+    ret |= ioctl(l->spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
+    ret |= ioctl(l->spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &l->speed);
     if (ret != 0)
         return ret;
 
@@ -294,166 +989,633 @@ static int init_spi()
 
 static void shutdown_spi()
 {
-    if (spi_fd != -1)
-        close(spi_fd);
+    for (auto &l : links)
+    {
+        if (l.spi_fd != -1)
+            close(l.spi_fd);
+        l.spi_fd = -1;
+    }
 }
 
-static int transfer(int len)
+static int transfer_buffers(AmigaLink *l, unsigned char *tx, unsigned char *rx, int len)
 {
     struct spi_ioc_transfer tr =
     {
-        .tx_buf = (uintptr_t)tx_buf,
-        .rx_buf = (uintptr_t)rx_buf,
+        .tx_buf = (uintptr_t)tx,
+        .rx_buf = (uintptr_t)rx,
         .len = (uint32_t)len,
-        .speed_hz = speed,
+        .speed_hz = l->speed,
         .delay_usecs = 0,
         .bits_per_word = bits,
         .cs_change = 0,
     };
 
-    return ioctl(spi_fd, SPI_IOC_MESSAGE(1), &tr);
-}
+    link_stats.spi_transfers.fetch_add(1, std::memory_order_relaxed);
+    link_stats.spi_bytes.fetch_add(len, std::memory_order_relaxed);
 
-static int spi_protocol_version()
-{
-    tx_buf[0] = (uint8_t)SPI_PROTO_VER_CMD;
-    tx_buf[1] = 0;
-    transfer(2);
-    logger_trace("SPI protocol version = %d\n", rx_buf[1]);
-    return (int)rx_buf[1];
+    return ioctl(l->spi_fd, SPI_IOC_MESSAGE(1), &tr);
 }
 
-static void spi_read_mem(unsigned int address, unsigned int length)
+static int transfer_multi(AmigaLink *l, SpiTransaction *txn)
 {
-    logger_trace("SPI read mem address = %d length = %d\n", address, length);
+    struct spi_ioc_transfer trs[SPI_MAX_SEGMENTS];
+    memset(trs, 0, sizeof(trs));
 
-    unsigned int header;
-    if (spi_proto_ver == 1)
-        header = (READ_SRAM_CMD << 21) | (address & 0x1fffff);
-    else
-        header = (READ_SRAM_CMD << 20) | (address & 0xfffff);
+    for (int i = 0; i < txn->count; i++)
+    {
+        trs[i].tx_buf = (uintptr_t)&txn->tx[i][0];
+        trs[i].rx_buf = (uintptr_t)&txn->rx[i][0];
+        trs[i].len = (uint32_t)txn->tx[i].size();
+        trs[i].speed_hz = l->speed;
+        trs[i].bits_per_word = bits;
+        trs[i].cs_change = i != txn->count - 1 ? 1 : 0;
+
+        link_stats.spi_bytes.fetch_add(trs[i].len, std::memory_order_relaxed);
+    }
 
-    tx_buf[0] = (uint8_t)((header >> 16) & 0xff);
-    tx_buf[1] = (uint8_t)((header >> 8) & 0xff);
-    tx_buf[2] = (uint8_t)(header & 0xff);
-	tx_buf[3] = 0;
+    link_stats.spi_transfers.fetch_add(1, std::memory_order_relaxed);
 
-    transfer(length + 4);
+    return ioctl(l->spi_fd, SPI_IOC_MESSAGE(txn->count), trs);
 }
 
-static void spi_write_mem(unsigned int address, uint8_t *buf, unsigned int length)
+// CRC32 trailers on SRAM transfers, negotiated through SPI_PROTO_VER_CMD.
+// Gateware reporting protocol version 2 or later implements the
+// READ_SRAM_CRC_CMD and WRITE_SRAM_CRC_CMD commands: reads shift out a
+// CRC32 of the payload after the data, and writes carry a CRC32 trailer
+// that the gateware verifies before committing the write, answering a
+// status byte in the clock cycles after the trailer. Mismatches are
+// counted and retried transparently. The small CMEM transfers and the
+// chained channel status reads keep the plain commands; the trailers
+// protect the bulk memory transfers, which are the ones run closest to
+// the SPI timing limit. On earlier gateware this stays dormant. The CRC
+// uses the ARMv8 CRC32 instructions when the compiler targets them, with
+// a table fallback otherwise.
+
+static void put_sram_cmd_header(AmigaLink *l, uint8_t *p, int cmd, unsigned int address);
+
+#if defined(__ARM_FEATURE_CRC32)
+
+static uint32_t crc32_buf(const uint8_t *buf, unsigned int length)
 {
-    logger_trace("SPI write mem address = %d length = %d\n", address, length);
+    uint32_t crc = 0xffffffff;
 
-    unsigned int header;
-    if (spi_proto_ver == 1)
-        header = (WRITE_SRAM_CMD << 21) | (address & 0x1fffff);
-    else
-        header = (WRITE_SRAM_CMD << 20) | (address & 0xfffff);
+    while (length >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, buf, 8);
+        crc = __crc32d(crc, v);
+        buf += 8;
+        length -= 8;
+    }
 
-    tx_buf[0] = (uint8_t)((header >> 16) & 0xff);
-    tx_buf[1] = (uint8_t)((header >> 8) & 0xff);
-    tx_buf[2] = (uint8_t)(header & 0xff);
+    while (length--)
+        crc = __crc32b(crc, *buf++);
 
-    memcpy(&tx_buf[3], buf, length);
-    transfer(length + 3);
+    return ~crc;
 }
 
-static uint8_t spi_read_cmem(unsigned int address)
-{
-    if (spi_proto_ver == 1)
-        tx_buf[0] = (uint8_t)((READ_CMEM_CMD << 5) | (address & 0xf));
-    else
-        tx_buf[0] = (uint8_t)((READ_CMEM_CMD << 4) | (address & 0xf));
-    tx_buf[1] = 0;
-    transfer(2);
-    logger_trace("SPI read cmem, address = %d, returned = %d\n", address, rx_buf[1]);
-    return rx_buf[1];
-}
+#else
 
-static void spi_write_cmem(unsigned int address, unsigned int data)
+static uint32_t crc32_buf(const uint8_t *buf, unsigned int length)
 {
-    logger_trace("SPI write cmem, address = %d, data = %d\n", address, data);
+    static uint32_t table[256];
 
-    if (spi_proto_ver == 1)
-        tx_buf[0] = (uint8_t)((WRITE_CMEM_CMD << 5) | (address & 0xf));
-    else
-        tx_buf[0] = (uint8_t)((WRITE_CMEM_CMD << 4) | (address & 0xf));
-    tx_buf[1] = (uint8_t)(data & 0xf);
-    transfer(2);
-}
+    if (table[1] == 0)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
 
-static uint8_t spi_ack_irq()
-{
-    logger_trace("SPI ack_irq\n");
-    return spi_read_cmem(R_EVENTS_ADDRESS);
+    uint32_t crc = 0xffffffff;
+    while (length--)
+        crc = table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    return ~crc;
 }
 
-static int open_write_close(const char *filename, const char *text)
-{
-    int fd = open(filename, O_WRONLY);
-    if (fd == -1)
-        return -1;
+#endif
 
-    write(fd, text, strlen(text));
-    close(fd);
-    return 0;
+static void put_crc_trailer(uint8_t *p, const uint8_t *payload, unsigned int length)
+{
+    uint32_t crc = crc32_buf(payload, length);
+    p[0] = (uint8_t)(crc >> 24);
+    p[1] = (uint8_t)(crc >> 16);
+    p[2] = (uint8_t)(crc >> 8);
+    p[3] = (uint8_t)crc;
 }
 
-static void sleep_100ms()
+static bool verify_read_crc(const uint8_t *rxb, unsigned int length)
 {
-    struct timespec delay;
-    delay.tv_sec = 0;
-    delay.tv_nsec = 100000000L;
-    nanosleep(&delay, NULL);
+    const uint8_t *p = &rxb[READ_SRAM_HDR_LEN + length];
+    uint32_t received = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    return crc32_buf(&rxb[READ_SRAM_HDR_LEN], length) == received;
 }
 
-static void set_direction()
+// Reads one contiguous SRAM region into dst using the worker buffers, with
+// CRC verification and retries when the link supports it.
+static void worker_read_region(AmigaLink *l, unsigned int address, unsigned int length, uint8_t *dst)
 {
-    for (int retry = 0; retry < 100; retry++)
+    int cmd = l->spi_crc_enabled ? READ_SRAM_CRC_CMD : READ_SRAM_CMD;
+    unsigned int trailer = l->spi_crc_enabled ? CRC_TRAILER_LEN : 0;
+
+    for (int attempt = 0; ; attempt++)
     {
-        int fd = open("/sys/class/gpio/gpio" IRQ_GPIO "/direction", O_WRONLY);
-        if (fd != -1)
+        put_sram_cmd_header(l, worker_tx_buf, cmd, address);
+        worker_tx_buf[3] = 0;
+
+        transfer_buffers(l, worker_tx_buf, worker_rx_buf, length + READ_SRAM_HDR_LEN + trailer);
+
+        if (!l->spi_crc_enabled || verify_read_crc(worker_rx_buf, length))
+            break;
+
+        link_stats.crc_errors.fetch_add(1, std::memory_order_relaxed);
+
+        if (attempt == CRC_RETRIES)
         {
-            write(fd, "in", 2);
-            close(fd);
+            logger_error("SPI read CRC mismatch persisted after %d retries\n", CRC_RETRIES);
             break;
         }
-        sleep_100ms();
     }
+
+    memcpy(dst, &worker_rx_buf[READ_SRAM_HDR_LEN], length);
 }
 
-static int init_gpio()
+// Writes one contiguous SRAM region from src using the worker buffers, with
+// CRC verification and retries when the link supports it.
+static void worker_write_region(AmigaLink *l, unsigned int address, const uint8_t *src, unsigned int length)
 {
-    if (open_write_close("/sys/class/gpio/export", IRQ_GPIO) != 0)
-        return -1;
+    int cmd = l->spi_crc_enabled ? WRITE_SRAM_CRC_CMD : WRITE_SRAM_CMD;
+    unsigned int trailer = l->spi_crc_enabled ? CRC_TRAILER_LEN + 1 : 0;
 
-    gpio_exported = true;
+    for (int attempt = 0; ; attempt++)
+    {
+        put_sram_cmd_header(l, worker_tx_buf, cmd, address);
+        memcpy(&worker_tx_buf[3], src, length);
 
-    set_direction();
+        if (l->spi_crc_enabled)
+        {
+            put_crc_trailer(&worker_tx_buf[3 + length], src, length);
+            worker_tx_buf[3 + length + CRC_TRAILER_LEN] = 0;
+        }
 
-    if (open_write_close("/sys/class/gpio/gpio" IRQ_GPIO "/edge", "both") == -1)
-        return -1;
+        transfer_buffers(l, worker_tx_buf, worker_rx_buf, length + 3 + trailer);
 
-    gpio_edge_set = true;
+        if (!l->spi_crc_enabled || worker_rx_buf[3 + length + CRC_TRAILER_LEN] == CRC_WRITE_OK)
+            break;
 
-    gpio_fd = open("/sys/class/gpio/gpio" IRQ_GPIO "/value", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
-    if (gpio_fd == -1)
-        return -1;
+        link_stats.crc_errors.fetch_add(1, std::memory_order_relaxed);
 
-    return 0;
+        if (attempt == CRC_RETRIES)
+        {
+            logger_error("SPI write CRC mismatch persisted after %d retries\n", CRC_RETRIES);
+            break;
+        }
+    }
 }
 
-static void shutdown_gpio()
+static void execute_spi_job(SpiJob *job)
+{
+    AmigaLink *l = job->link;
+
+    switch (job->type)
+    {
+    case SPI_JOB_SYNC:
+        transfer_buffers(l, tx_buf, rx_buf, job->length);
+        break;
+    case SPI_JOB_SYNC_MULTI:
+        transfer_multi(l, job->txn);
+        break;
+    case SPI_JOB_READ_MEM:
+        job->buf.resize(job->length);
+        worker_read_region(l, job->address, job->length, &job->buf[0]);
+        break;
+    case SPI_JOB_WRITE_MEM:
+        worker_write_region(l, job->address, &job->buf[0], job->length);
+        break;
+    case SPI_JOB_READ_MEM_SG:
+    {
+        // All segments are resolved back-to-back on the bus; the results are
+        // concatenated in segment order into the job buffer.
+        size_t total = 0;
+        for (auto &seg : job->segments)
+            total += seg.length;
+
+        job->buf.resize(total);
+
+        size_t offset = 0;
+        for (auto &seg : job->segments)
+        {
+            worker_read_region(l, seg.address, seg.length, &job->buf[offset]);
+            offset += seg.length;
+        }
+        break;
+    }
+    case SPI_JOB_WRITE_MEM_SG:
+    {
+        // The job buffer holds the segment payloads concatenated in segment
+        // order.
+        size_t offset = 0;
+        for (auto &seg : job->segments)
+        {
+            worker_write_region(l, seg.address, &job->buf[offset], seg.length);
+            offset += seg.length;
+        }
+        break;
+    }
+    }
+}
+
+static void spi_thread_main()
 {
-    if (gpio_fd != -1)
-        close(gpio_fd);
+    while (!spi_thread_stop.load(std::memory_order_acquire))
+    {
+        uint64_t v;
+        if (read(spi_submit_efd, &v, sizeof(v)) != sizeof(v))
+            continue;
 
-    if (gpio_edge_set)
-        open_write_close("/sys/class/gpio/gpio" IRQ_GPIO "/edge", "none");
+        SpiJob *job;
+        while ((job = spi_submit_queue.pop()) != nullptr)
+        {
+            execute_spi_job(job);
 
-    if (gpio_exported)
-        open_write_close("/sys/class/gpio/unexport", IRQ_GPIO);
+            if (job->type == SPI_JOB_SYNC)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(spi_sync_mutex);
+                    job->done.store(true, std::memory_order_release);
+                }
+                spi_sync_cv.notify_one();
+            }
+            else
+            {
+                while (!spi_complete_queue.push(job))
+                    std::this_thread::yield();
+
+                uint64_t one = 1;
+                write(spi_complete_efd, &one, sizeof(one));
+            }
+        }
+    }
+}
+
+static void kick_spi_thread()
+{
+    uint64_t one = 1;
+    write(spi_submit_efd, &one, sizeof(one));
+}
+
+static void submit_spi_job(SpiJob *job)
+{
+    while (!spi_submit_queue.push(job))
+        std::this_thread::yield();
+
+    kick_spi_thread();
+}
+
+// Executes a transfer using tx_buf/rx_buf and waits for it to finish.
+// Serialized through the worker thread so that it cannot collide with an
+// asynchronous job that is in flight on the SPI bus.
+static int transfer(AmigaLink *l, int len)
+{
+    if (!spi_thread_started)
+        return transfer_buffers(l, tx_buf, rx_buf, len);
+
+    SpiJob job;
+    job.type = SPI_JOB_SYNC;
+    job.link = l;
+    job.length = len;
+
+    submit_spi_job(&job);
+
+    std::unique_lock<std::mutex> lock(spi_sync_mutex);
+    spi_sync_cv.wait(lock, [&job] { return job.done.load(std::memory_order_acquire); });
+    return len;
+}
+
+// Executes a chained multi-segment transaction and waits for it to finish.
+static int spi_execute_transaction(AmigaLink *l, SpiTransaction *txn)
+{
+    if (!spi_thread_started)
+        return transfer_multi(l, txn);
+
+    SpiJob job;
+    job.type = SPI_JOB_SYNC_MULTI;
+    job.link = l;
+    job.txn = txn;
+
+    submit_spi_job(&job);
+
+    std::unique_lock<std::mutex> lock(spi_sync_mutex);
+    spi_sync_cv.wait(lock, [&job] { return job.done.load(std::memory_order_acquire); });
+    return 0;
+}
+
+static void put_sram_cmd_header(AmigaLink *l, uint8_t *p, int cmd, unsigned int address)
+{
+    unsigned int header;
+    if (l->spi_proto_ver >= 1)
+        header = (cmd << 21) | (address & 0x1fffff);
+    else
+        header = (cmd << 20) | (address & 0xfffff);
+
+    p[0] = (uint8_t)((header >> 16) & 0xff);
+    p[1] = (uint8_t)((header >> 8) & 0xff);
+    p[2] = (uint8_t)(header & 0xff);
+}
+
+static int spi_protocol_version(AmigaLink *l)
+{
+    tx_buf[0] = (uint8_t)SPI_PROTO_VER_CMD;
+    tx_buf[1] = 0;
+    transfer(l, 2);
+    logger_trace("SPI protocol version = %d\n", rx_buf[1]);
+    return (int)rx_buf[1];
+}
+
+static void spi_read_mem(AmigaLink *l, unsigned int address, unsigned int length)
+{
+    logger_trace("SPI read mem address = %d length = %d\n", address, length);
+
+    int cmd = l->spi_crc_enabled ? READ_SRAM_CRC_CMD : READ_SRAM_CMD;
+    unsigned int trailer = l->spi_crc_enabled ? CRC_TRAILER_LEN : 0;
+
+    for (int attempt = 0; ; attempt++)
+    {
+        put_sram_cmd_header(l, tx_buf, cmd, address);
+        tx_buf[3] = 0;
+
+        transfer(l, length + READ_SRAM_HDR_LEN + trailer);
+
+        if (!l->spi_crc_enabled || verify_read_crc(rx_buf, length))
+            break;
+
+        link_stats.crc_errors.fetch_add(1, std::memory_order_relaxed);
+
+        if (attempt == CRC_RETRIES)
+        {
+            logger_error("SPI read CRC mismatch persisted after %d retries\n", CRC_RETRIES);
+            break;
+        }
+    }
+}
+
+static void spi_write_mem(AmigaLink *l, unsigned int address, uint8_t *buf, unsigned int length)
+{
+    logger_trace("SPI write mem address = %d length = %d\n", address, length);
+
+    int cmd = l->spi_crc_enabled ? WRITE_SRAM_CRC_CMD : WRITE_SRAM_CMD;
+    unsigned int trailer = l->spi_crc_enabled ? CRC_TRAILER_LEN + 1 : 0;
+
+    for (int attempt = 0; ; attempt++)
+    {
+        put_sram_cmd_header(l, tx_buf, cmd, address);
+        memcpy(&tx_buf[3], buf, length);
+
+        if (l->spi_crc_enabled)
+        {
+            put_crc_trailer(&tx_buf[3 + length], buf, length);
+            tx_buf[3 + length + CRC_TRAILER_LEN] = 0;
+        }
+
+        transfer(l, length + 3 + trailer);
+
+        if (!l->spi_crc_enabled || rx_buf[3 + length + CRC_TRAILER_LEN] == CRC_WRITE_OK)
+            break;
+
+        link_stats.crc_errors.fetch_add(1, std::memory_order_relaxed);
+
+        if (attempt == CRC_RETRIES)
+        {
+            logger_error("SPI write CRC mismatch persisted after %d retries\n", CRC_RETRIES);
+            break;
+        }
+    }
+}
+
+// Link speed training, enabled with a "speed auto" configuration line (a
+// "speed <hz>" line sets a fixed rate instead of the built-in default).
+// The clock is ramped while a pattern is written to and read back from a
+// scratch region of SRAM; the highest rate where every pass verifies
+// cleanly is selected and persisted per board, so training runs once and
+// later starts just read the persisted rate. The scratch region's original
+// contents are saved and restored at a conservative clock, and training
+// happens before the com area handshake is serviced.
+
+#define SPEED_FILE              "/etc/opt/a314/spi-speed"
+#define TRAIN_SAFE_SPEED        8000000
+#define TRAIN_ADDRESS           0
+#define TRAIN_LEN               2048
+#define TRAIN_PASSES            4
+
+static const uint32_t train_speeds[] =
+{
+    16000000, 24000000, 32000000, 40000000, 48000000,
+    56000000, 64000000, 67000000, 72000000, 80000000,
+};
+#define TRAIN_SPEED_COUNT ((int)(sizeof(train_speeds) / sizeof(train_speeds[0])))
+
+static void fill_train_pattern(uint8_t *pattern, int pass)
+{
+    uint32_t lcg = 0x314a314a + pass;
+
+    for (int i = 0; i < TRAIN_LEN; i++)
+    {
+        switch (pass & 3)
+        {
+        case 0: pattern[i] = (uint8_t)i; break;
+        case 1: pattern[i] = (uint8_t)~i; break;
+        case 2:
+            lcg = lcg * 1103515245 + 12345;
+            pattern[i] = (uint8_t)(lcg >> 16);
+            break;
+        case 3: pattern[i] = (i & 1) ? 0x55 : 0xaa; break;
+        }
+    }
+}
+
+static bool test_link_speed(AmigaLink *l, uint32_t candidate)
+{
+    static uint8_t pattern[TRAIN_LEN];
+
+    l->speed = candidate;
+
+    for (int pass = 0; pass < TRAIN_PASSES; pass++)
+    {
+        fill_train_pattern(pattern, pass);
+
+        spi_write_mem(l, TRAIN_ADDRESS, pattern, TRAIN_LEN);
+
+        memset(&rx_buf[READ_SRAM_HDR_LEN], 0, TRAIN_LEN);
+        spi_read_mem(l, TRAIN_ADDRESS, TRAIN_LEN);
+
+        if (memcmp(&rx_buf[READ_SRAM_HDR_LEN], pattern, TRAIN_LEN) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static void train_link_speed(AmigaLink *l)
+{
+    if (!l->speed_auto)
+        return;
+
+    // Each link has its own persisted speed; the first link keeps the
+    // original file name.
+    char speed_path[64];
+    if (l->index == 0)
+        snprintf(speed_path, sizeof(speed_path), SPEED_FILE);
+    else
+        snprintf(speed_path, sizeof(speed_path), SPEED_FILE "-%d", l->index);
+
+    FILE *f = fopen(speed_path, "rt");
+    if (f != nullptr)
+    {
+        unsigned int persisted = 0;
+        int n = fscanf(f, "%u", &persisted);
+        fclose(f);
+
+        if (n == 1 && persisted >= 1000000 && persisted <= 200000000)
+        {
+            l->speed = persisted;
+            logger_info("Using persisted SPI speed %u Hz on %s\n", persisted, l->spidev_path.c_str());
+            return;
+        }
+    }
+
+    static uint8_t original[TRAIN_LEN];
+
+    l->speed = TRAIN_SAFE_SPEED;
+    spi_read_mem(l, TRAIN_ADDRESS, TRAIN_LEN);
+    memcpy(original, &rx_buf[READ_SRAM_HDR_LEN], TRAIN_LEN);
+
+    uint32_t best = TRAIN_SAFE_SPEED;
+    for (int i = 0; i < TRAIN_SPEED_COUNT; i++)
+    {
+        if (!test_link_speed(l, train_speeds[i]))
+            break;
+        best = train_speeds[i];
+    }
+
+    l->speed = TRAIN_SAFE_SPEED;
+    spi_write_mem(l, TRAIN_ADDRESS, original, TRAIN_LEN);
+
+    l->speed = best;
+    logger_info("Trained SPI speed %u Hz on %s\n", best, l->spidev_path.c_str());
+
+    f = fopen(speed_path, "wt");
+    if (f != nullptr)
+    {
+        fprintf(f, "%u\n", best);
+        fclose(f);
+    }
+    else
+        logger_warn("Unable to persist SPI speed to %s\n", speed_path);
+}
+
+static uint8_t spi_read_cmem(AmigaLink *l, unsigned int address)
+{
+    if (l->spi_proto_ver >= 1)
+        tx_buf[0] = (uint8_t)((READ_CMEM_CMD << 5) | (address & 0xf));
+    else
+        tx_buf[0] = (uint8_t)((READ_CMEM_CMD << 4) | (address & 0xf));
+    tx_buf[1] = 0;
+    transfer(l, 2);
+    logger_trace("SPI read cmem, address = %d, returned = %d\n", address, rx_buf[1]);
+    return rx_buf[1];
+}
+
+static void spi_write_cmem(AmigaLink *l, unsigned int address, unsigned int data)
+{
+    logger_trace("SPI write cmem, address = %d, data = %d\n", address, data);
+
+    if (l->spi_proto_ver >= 1)
+        tx_buf[0] = (uint8_t)((WRITE_CMEM_CMD << 5) | (address & 0xf));
+    else
+        tx_buf[0] = (uint8_t)((WRITE_CMEM_CMD << 4) | (address & 0xf));
+    tx_buf[1] = (uint8_t)(data & 0xf);
+    transfer(l, 2);
+}
+
+static uint8_t spi_ack_irq(AmigaLink *l)
+{
+    logger_trace("SPI ack_irq\n");
+    return spi_read_cmem(l, R_EVENTS_ADDRESS);
+}
+
+static int init_spi_thread()
+{
+    spi_submit_efd = eventfd(0, EFD_CLOEXEC);
+    spi_complete_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (spi_submit_efd == -1 || spi_complete_efd == -1)
+        return -1;
+
+    spi_thread = std::thread(spi_thread_main);
+    spi_thread_started = true;
+    return 0;
+}
+
+static void shutdown_spi_thread()
+{
+    if (spi_thread_started)
+    {
+        spi_thread_stop.store(true, std::memory_order_release);
+        kick_spi_thread();
+        spi_thread.join();
+        spi_thread_started = false;
+    }
+
+    if (spi_submit_efd != -1)
+        close(spi_submit_efd);
+    if (spi_complete_efd != -1)
+        close(spi_complete_efd);
+}
+
+// Requests the IRQ line through the gpiochip character device, with edge
+// detection done in the kernel. Unlike the deprecated sysfs interface this
+// needs no export/direction dance with retry sleeps, and each event carries
+// a kernel timestamp so the IRQ-to-service latency can be measured.
+static int init_gpio(AmigaLink *l)
+{
+    int chip_fd = open(GPIO_CHIP_DEVICE, O_RDONLY | O_CLOEXEC);
+    if (chip_fd == -1)
+    {
+        logger_error("Failed to open " GPIO_CHIP_DEVICE "\n");
+        return -1;
+    }
+
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof(req));
+    req.offsets[0] = l->irq_gpio;
+    req.num_lines = 1;
+    strncpy(req.consumer, "a314d", sizeof(req.consumer) - 1);
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+
+    int res = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req);
+    close(chip_fd);
+
+    if (res == -1 || req.fd < 0)
+    {
+        logger_error("Failed to request GPIO line %d events; errno = %d\n", l->irq_gpio, errno);
+        return -1;
+    }
+
+    l->gpio_fd = req.fd;
+    return 0;
+}
+
+static void shutdown_gpio()
+{
+    for (auto &l : links)
+    {
+        if (l.gpio_fd != -1)
+            close(l.gpio_fd);
+        l.gpio_fd = -1;
+    }
 }
 
 static int init_server_socket()
@@ -489,6 +1651,92 @@ static void shutdown_server_socket()
     server_socket = -1;
 }
 
+static int init_unix_socket()
+{
+    mkdir(UNIX_SOCKET_DIR, 0755);
+
+    unix_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (unix_socket == -1)
+    {
+        logger_error("Failed to create unix domain socket\n");
+        return -1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, UNIX_SOCKET_PATH, sizeof(address.sun_path) - 1);
+
+    unlink(UNIX_SOCKET_PATH);
+
+    int res = bind(unix_socket, (struct sockaddr *)&address, sizeof(address));
+    if (res < 0)
+    {
+        // Not fatal; local services fall back to TCP.
+        logger_warn("Bind to " UNIX_SOCKET_PATH " failed\n");
+        close(unix_socket);
+        unix_socket = -1;
+        return 0;
+    }
+
+    listen(unix_socket, 16);
+
+    return 0;
+}
+
+static void shutdown_unix_socket()
+{
+    if (unix_socket != -1)
+    {
+        close(unix_socket);
+        unlink(UNIX_SOCKET_PATH);
+    }
+    unix_socket = -1;
+}
+
+static int init_stats_socket()
+{
+    mkdir(UNIX_SOCKET_DIR, 0755);
+
+    stats_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (stats_socket == -1)
+    {
+        logger_error("Failed to create stats socket\n");
+        return -1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, STATS_SOCKET_PATH, sizeof(address.sun_path) - 1);
+
+    unlink(STATS_SOCKET_PATH);
+
+    int res = bind(stats_socket, (struct sockaddr *)&address, sizeof(address));
+    if (res < 0)
+    {
+        // Not fatal; the daemon runs without the stats surface.
+        logger_warn("Bind to " STATS_SOCKET_PATH " failed\n");
+        close(stats_socket);
+        stats_socket = -1;
+        return 0;
+    }
+
+    listen(stats_socket, 4);
+
+    return 0;
+}
+
+static void shutdown_stats_socket()
+{
+    if (stats_socket != -1)
+    {
+        close(stats_socket);
+        unlink(STATS_SOCKET_PATH);
+    }
+    stats_socket = -1;
+}
+
 static void sigterm_handler(int signo)
 {
 }
@@ -514,29 +1762,137 @@ static int init_driver()
     if (init_server_socket() != 0)
         return -1;
 
-    if (init_spi() != 0)
+    if (init_unix_socket() != 0)
         return -1;
 
-    spi_proto_ver = spi_protocol_version();
+    if (init_stats_socket() != 0)
+        return -1;
+
+    // Without any "link" configuration line a single default link is used,
+    // matching the original single-Amiga setup.
+    if (links.empty())
+    {
+        links.emplace_back();
+        auto &l = links.back();
+        l.spidev_path = "/dev/spidev0.0";
+        l.irq_gpio = IRQ_GPIO;
+    }
+
+    int index = 0;
+    for (auto &l : links)
+    {
+        l.index = index++;
+        l.spi_fd = -1;
+        l.gpio_fd = -1;
+        l.speed = speed;
+        l.speed_auto = speed_auto;
+        l.have_base_address = false;
+        l.base_address = 0;
+        l.com_area_v2 = false;
+        l.a2r_ring_size = 256;
+        l.r2a_ring_size = 256;
+        l.a2r_ring_offset = 4;
+        l.r2a_ring_offset = 260;
+        l.a2r_ext_frames = false;
+        l.r2a_ext_frames = false;
+        l.max_pkt_data = 255;
+        memset(l.channel_status, 0, sizeof(l.channel_status));
+        l.channel_status_updated = 0;
+        memset(l.channel_index, 0, sizeof(l.channel_index));
+
+        if (init_spi(&l) != 0)
+        {
+            logger_error("Failed to open %s\n", l.spidev_path.c_str());
+            return -1;
+        }
+
+        l.spi_proto_ver = spi_protocol_version(&l);
+
+        l.spi_crc_enabled = l.spi_proto_ver >= SPI_CRC_PROTO_VER;
+        if (l.spi_crc_enabled)
+            logger_info("SPI CRC trailers enabled on %s\n", l.spidev_path.c_str());
 
-    if (init_gpio() != 0)
+        train_link_speed(&l);
+
+        if (init_gpio(&l) != 0)
+            return -1;
+    }
+
+    if (init_spi_thread() != 0)
+        return -1;
+
+    if (init_trace() != 0)
         return -1;
 
+    init_io_uring();
+
     epfd = epoll_create1(EPOLL_CLOEXEC);
     if (epfd == -1)
         return -1;
 
+    // Client connections put their ClientConnection pointer in data.ptr, a
+    // GPIO event fd is tagged with its AmigaLink pointer, and the static
+    // descriptors are tagged with the address of the variable that holds
+    // them, so dispatch is a pointer compare either way.
     struct epoll_event ev;
-    ev.events = EPOLLPRI | EPOLLERR;
-    ev.data.fd = gpio_fd;
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, gpio_fd, &ev) != 0)
-        return -1;
+    for (auto &l : links)
+    {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &l;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, l.gpio_fd, &ev) != 0)
+            return -1;
+    }
 
     ev.events = EPOLLIN;
-    ev.data.fd = server_socket;
+    ev.data.ptr = &server_socket;
     if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_socket, &ev) != 0)
         return -1;
 
+    if (unix_socket != -1)
+    {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &unix_socket;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, unix_socket, &ev) != 0)
+            return -1;
+    }
+
+    if (stats_socket != -1)
+    {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &stats_socket;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, stats_socket, &ev) != 0)
+            return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &spi_complete_efd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, spi_complete_efd, &ev) != 0)
+        return -1;
+
+    // The frame tick only exists when some service is configured as paced;
+    // otherwise the daemon stays purely event driven.
+    if (!paced_services.empty())
+    {
+        pace_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (pace_timer_fd == -1)
+            return -1;
+
+        struct itimerspec its;
+        its.it_interval.tv_sec = 0;
+        its.it_interval.tv_nsec = 1000000000L / pace_hz;
+        its.it_value = its.it_interval;
+        if (timerfd_settime(pace_timer_fd, 0, &its, nullptr) != 0)
+            return -1;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &pace_timer_fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, pace_timer_fd, &ev) != 0)
+            return -1;
+
+        logger_info("Frame pacing at %d Hz enabled for %d service(s)\n",
+            pace_hz, (int)paced_services.size());
+    }
+
     return 0;
 }
 
@@ -545,16 +1901,23 @@ static void shutdown_driver()
     if (epfd != -1)
         close(epfd);
 
+    if (pace_timer_fd != -1)
+        close(pace_timer_fd);
+
+    shutdown_trace();
     shutdown_gpio();
+    shutdown_spi_thread();
     shutdown_spi();
     shutdown_server_socket();
+    shutdown_unix_socket();
+    shutdown_stats_socket();
 }
 
+static std::vector<ClientConnection*> flush_list;
+
 void create_and_send_msg(ClientConnection *cc, int type, int stream_id, uint8_t *data, int length)
 {
-    MessageBuffer mb;
-    mb.pos = 0;
-    mb.data.resize(sizeof(MessageHeader) + length);
+    MessageBuffer &mb = acquire_message_buffer(cc->message_queue, sizeof(MessageHeader) + length);
 
     MessageHeader *mh = (MessageHeader *)&mb.data[0];
     mh->length = length;
@@ -563,28 +1926,91 @@ void create_and_send_msg(ClientConnection *cc, int type, int stream_id, uint8_t
     if (length && data)
         memcpy(&mb.data[sizeof(MessageHeader)], data, length);
 
-    if (!cc->message_queue.empty())
+    cc->messages_out++;
+    cc->bytes_out += sizeof(MessageHeader) + length;
+
+    // A client that stops reading would otherwise grow the queue without
+    // limit. The connection is not closed here -- this function is called
+    // while iterating channel lists -- but at the end of the wakeup, unless
+    // the flush manages to bring the queue back under the limit.
+    cc->queued_bytes += sizeof(MessageHeader) + length;
+    if (cc->queued_bytes > MSG_QUEUE_LIMIT_BYTES)
+        cc->overflowed = true;
+
+    // Messages created during one wakeup are flushed together with a single
+    // writev() at the end of the wakeup instead of one write() each.
+    if (!cc->flush_pending)
     {
-        cc->message_queue.push_back(std::move(mb));
-        return;
+        cc->flush_pending = true;
+        flush_list.push_back(cc);
     }
+}
 
-    while (1)
+#define DRAIN_MAX_IOVCNT        64
+
+// Gathers up to DRAIN_MAX_IOVCNT queued messages into iov and returns the
+// iovec count. Shared between the writev() and the io_uring flush paths.
+static int fill_message_queue_iov(ClientConnection *cc, struct iovec *iov)
+{
+    int iovcnt = 0;
+
+    for (auto &mb : cc->message_queue)
     {
+        if (iovcnt == DRAIN_MAX_IOVCNT)
+            break;
+
+        iov[iovcnt].iov_base = &mb.data[mb.pos];
+        iov[iovcnt].iov_len = mb.data.size() - mb.pos;
+        iovcnt++;
+    }
+
+    return iovcnt;
+}
+
+// Releases the messages at the front of the queue that a write of r bytes
+// has fully sent, and records the partial progress into the first one it
+// has not.
+static void consume_sent_bytes(ClientConnection *cc, ssize_t r)
+{
+    while (r > 0)
+    {
+        MessageBuffer &mb = cc->message_queue.front();
         int left = mb.data.size() - mb.pos;
-        uint8_t *src = &mb.data[mb.pos];
-        ssize_t r = write(cc->fd, src, left);
+        if (r >= left)
+        {
+            cc->queued_bytes -= mb.data.size();
+            release_message_buffer(cc->message_queue, cc->message_queue.begin());
+            r -= left;
+        }
+        else
+        {
+            mb.pos += r;
+            r = 0;
+        }
+    }
+}
+
+// Gathers the whole message queue into an iovec and flushes it with
+// writev(). Returns -1 if the connection was reset and should be closed by
+// the caller, otherwise 0.
+static int drain_message_queue(ClientConnection *cc)
+{
+    while (!cc->message_queue.empty())
+    {
+        struct iovec iov[DRAIN_MAX_IOVCNT];
+        int iovcnt = fill_message_queue_iov(cc, iov);
+
+        ssize_t r = writev(cc->fd, iov, iovcnt);
         if (r == -1)
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                cc->message_queue.push_back(std::move(mb));
-                return;
+                // Leave the remaining messages queued; they are flushed on EPOLLOUT.
+                return 0;
             }
             else if (errno == ECONNRESET)
             {
-                // Do not close connection here; it will get done at some other place.
-                return;
+                return -1;
             }
             else
             {
@@ -593,86 +2019,560 @@ void create_and_send_msg(ClientConnection *cc, int type, int stream_id, uint8_t
             }
         }
 
-        mb.pos += r;
-        if (r == left)
+        consume_sent_bytes(cc, r);
+    }
+
+    return 0;
+}
+
+static void close_connection_if_overflowed(ClientConnection *cc)
+{
+    if (!cc->overflowed)
+        return;
+
+    if (cc->queued_bytes > MSG_QUEUE_LIMIT_BYTES)
+    {
+        logger_warn("Client connection is not reading its messages and has more than %d bytes queued; closing the connection\n", MSG_QUEUE_LIMIT_BYTES);
+        close_and_remove_connection(cc);
+    }
+    else
+        cc->overflowed = false;
+}
+
+// Batched client writes through io_uring. When several connections have
+// messages queued at the end of a wakeup, their flushes are submitted as a
+// batch of non-blocking sendmsg operations and completed with a single
+// io_uring_enter() instead of one writev() each. Set up with raw syscalls
+// since the daemon links no libraries; if the kernel lacks io_uring the
+// writev() path is used throughout.
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif
+
+#define URING_ENTRIES           64
+
+#ifdef HAVE_IO_URING
+
+static int uring_fd = -1;
+static unsigned *uring_sq_tail;
+static unsigned *uring_sq_mask;
+static unsigned *uring_sq_array;
+static struct io_uring_sqe *uring_sqes;
+static unsigned *uring_cq_head;
+static unsigned *uring_cq_tail;
+static unsigned *uring_cq_mask;
+static struct io_uring_cqe *uring_cqes;
+
+static void init_io_uring()
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0)
+    {
+        logger_info("io_uring is not available; client messages are flushed with writev\n");
+        return;
+    }
+
+    // Mapping the rings with one mmap() requires kernel 5.4; anything older
+    // is not worth a second code path here.
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        logger_info("io_uring lacks single-mmap rings; client messages are flushed with writev\n");
+        close(fd);
+        return;
+    }
+
+    size_t sring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sring_size > cring_size ? sring_size : cring_size;
+
+    void *ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *sqes = mmap(nullptr, p.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (ring == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        logger_warn("Unable to map io_uring rings; client messages are flushed with writev\n");
+        if (ring != MAP_FAILED)
+            munmap(ring, ring_size);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+        close(fd);
+        return;
+    }
+
+    uring_sq_tail = (unsigned *)((char *)ring + p.sq_off.tail);
+    uring_sq_mask = (unsigned *)((char *)ring + p.sq_off.ring_mask);
+    uring_sq_array = (unsigned *)((char *)ring + p.sq_off.array);
+    uring_sqes = (struct io_uring_sqe *)sqes;
+    uring_cq_head = (unsigned *)((char *)ring + p.cq_off.head);
+    uring_cq_tail = (unsigned *)((char *)ring + p.cq_off.tail);
+    uring_cq_mask = (unsigned *)((char *)ring + p.cq_off.ring_mask);
+    uring_cqes = (struct io_uring_cqe *)((char *)ring + p.cq_off.cqes);
+
+    uring_fd = fd;
+    logger_info("Client messages are flushed through io_uring\n");
+}
+
+// Pops up to URING_ENTRIES connections off the flush list, submits one
+// non-blocking sendmsg for each and reaps all the completions with a single
+// io_uring_enter(). Partial writes and would-block results are left queued
+// for EPOLLOUT, the same as in the writev path.
+static void flush_client_queues_uring_round()
+{
+    static struct msghdr msgs[URING_ENTRIES];
+    static struct iovec iovs[URING_ENTRIES][DRAIN_MAX_IOVCNT];
+    static ClientConnection *batch[URING_ENTRIES];
+
+    unsigned n = 0;
+
+    while (!flush_list.empty() && n < URING_ENTRIES)
+    {
+        ClientConnection *cc = flush_list.back();
+        flush_list.pop_back();
+        cc->flush_pending = false;
+
+        if (cc->message_queue.empty())
+        {
+            close_connection_if_overflowed(cc);
+            continue;
+        }
+
+        int iovcnt = fill_message_queue_iov(cc, iovs[n]);
+
+        memset(&msgs[n], 0, sizeof(struct msghdr));
+        msgs[n].msg_iov = iovs[n];
+        msgs[n].msg_iovlen = iovcnt;
+
+        unsigned idx = *uring_sq_tail & *uring_sq_mask;
+        struct io_uring_sqe *sqe = &uring_sqes[idx];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = cc->fd;
+        sqe->addr = (unsigned long)&msgs[n];
+        sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+        sqe->user_data = n;
+        uring_sq_array[idx] = idx;
+        __atomic_store_n(uring_sq_tail, *uring_sq_tail + 1, __ATOMIC_RELEASE);
+
+        batch[n] = cc;
+        n++;
+    }
+
+    if (n == 0)
+        return;
+
+    int ret = syscall(__NR_io_uring_enter, uring_fd, n, n, IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (ret < 0)
+    {
+        logger_error("io_uring_enter failed unexpectedly with errno = %d\n", errno);
+        exit(-1);
+    }
+
+    // Record the results first; the completions do not arrive in submission
+    // order.
+    static ssize_t results[URING_ENTRIES];
+
+    unsigned head = *uring_cq_head;
+    unsigned tail = __atomic_load_n(uring_cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &uring_cqes[head & *uring_cq_mask];
+        results[cqe->user_data] = cqe->res;
+        head++;
+    }
+    __atomic_store_n(uring_cq_head, head, __ATOMIC_RELEASE);
+
+    for (unsigned i = 0; i < n; i++)
+    {
+        ClientConnection *cc = batch[i];
+        ssize_t res = results[i];
+
+        if (res > 0)
+        {
+            consume_sent_bytes(cc, res);
+
+            // More than DRAIN_MAX_IOVCNT messages were queued, or the send
+            // was partial; let the writev loop finish the queue off.
+            if (!cc->message_queue.empty() && drain_message_queue(cc) != 0)
+            {
+                close_and_remove_connection(cc);
+                continue;
+            }
+        }
+        else if (res == -EAGAIN || res == -EWOULDBLOCK)
+        {
+            // Flushed on EPOLLOUT.
+        }
+        else if (res == -ECONNRESET || res == -EPIPE)
+        {
+            close_and_remove_connection(cc);
+            continue;
+        }
+        else
+        {
+            logger_error("io_uring sendmsg failed unexpectedly with res = %d\n", (int)res);
+            exit(-1);
+        }
+
+        close_connection_if_overflowed(cc);
+    }
+}
+
+#else
+
+static void init_io_uring()
+{
+    logger_info("io_uring is not available; client messages are flushed with writev\n");
+}
+
+#endif
+
+static void flush_client_queues()
+{
+    while (!flush_list.empty())
+    {
+#ifdef HAVE_IO_URING
+        if (uring_fd != -1 && flush_list.size() > 1)
+        {
+            flush_client_queues_uring_round();
+            continue;
+        }
+#endif
+
+        ClientConnection *cc = flush_list.back();
+        flush_list.pop_back();
+        cc->flush_pending = false;
+
+        if (drain_message_queue(cc) != 0)
+        {
+            close_and_remove_connection(cc);
+            continue;
+        }
+
+        close_connection_if_overflowed(cc);
+    }
+}
+
+static void handle_msg_register_req(ClientConnection *cc)
+{
+    uint8_t result = MSG_FAIL;
+
+    std::string service_name((char *)&cc->payload[0], cc->header.length);
+
+    if (services.find(service_name) == services.end())
+    {
+        services[std::move(service_name)] = cc;
+        result = MSG_SUCCESS;
+    }
+
+    create_and_send_msg(cc, MSG_REGISTER_RES, 0, &result, 1);
+}
+
+static void handle_msg_deregister_req(ClientConnection *cc)
+{
+    uint8_t result = MSG_FAIL;
+
+    std::string service_name((char *)&cc->payload[0], cc->header.length);
+
+    auto it = services.find(service_name);
+    if (it != services.end() && it->second == cc)
+    {
+        services.erase(it);
+        result = MSG_SUCCESS;
+    }
+
+    create_and_send_msg(cc, MSG_DEREGISTER_RES, 0, &result, 1);
+}
+
+static void handle_msg_read_mem_req(ClientConnection *cc)
+{
+    uint32_t address = *(uint32_t *)&(cc->payload[0]);
+    uint32_t length = *(uint32_t *)&(cc->payload[4]);
+
+    // Memory messages carry no link selector, so they act on the first
+    // configured link; per-link addressing would need a protocol extension.
+    SpiJob *job = new SpiJob();
+    job->type = SPI_JOB_READ_MEM;
+    job->link = &links.front();
+    job->address = address;
+    job->length = length;
+    job->client_fd = cc->fd;
+    job->client_gen = cc->generation;
+
+    submit_spi_job(job);
+}
+
+static void handle_msg_write_mem_req(ClientConnection *cc)
+{
+    uint32_t address = *(uint32_t *)&(cc->payload[0]);
+    uint32_t length = cc->header.length - 4;
+
+    SpiJob *job = new SpiJob();
+    job->type = SPI_JOB_WRITE_MEM;
+    job->link = &links.front();
+    job->address = address;
+    job->length = length;
+    job->client_fd = cc->fd;
+    job->client_gen = cc->generation;
+    job->buf.resize(length);
+    memcpy(&job->buf[0], &(cc->payload[4]), length);
+
+    submit_spi_job(job);
+}
+
+// A streamed transfer is split into chunks bounded by the worker buffers, and
+// all chunks are queued on the SPI worker at once so that they go out on the
+// bus back-to-back. This keeps the link busy for the whole transfer, instead
+// of pausing for a client round trip between every chunk.
+#define MEM_STREAM_CHUNK_SIZE   65536
+
+static void handle_msg_read_mem_stream(ClientConnection *cc)
+{
+    uint32_t address = *(uint32_t *)&(cc->payload[0]);
+    uint32_t length = *(uint32_t *)&(cc->payload[4]);
+
+    // Each chunk is streamed back to the client as a MSG_READ_MEM_RES
+    // message as soon as it has been read; the client knows the total
+    // length and concatenates the responses.
+    while (length != 0)
+    {
+        uint32_t chunk = length < MEM_STREAM_CHUNK_SIZE ? length : MEM_STREAM_CHUNK_SIZE;
+
+        SpiJob *job = new SpiJob();
+        job->type = SPI_JOB_READ_MEM;
+        job->link = &links.front();
+        job->address = address;
+        job->length = chunk;
+        job->client_fd = cc->fd;
+        job->client_gen = cc->generation;
+
+        submit_spi_job(job);
+
+        address += chunk;
+        length -= chunk;
+    }
+}
+
+static void handle_msg_write_mem_stream(ClientConnection *cc)
+{
+    uint32_t address = *(uint32_t *)&(cc->payload[0]);
+    uint32_t length = cc->header.length - 4;
+    uint32_t offset = 4;
+
+    if (length == 0)
+    {
+        create_and_send_msg(cc, MSG_WRITE_MEM_RES, 0, nullptr, 0);
+        return;
+    }
+
+    // Only the last chunk acks the stream with a MSG_WRITE_MEM_RES.
+    while (length != 0)
+    {
+        uint32_t chunk = length < MEM_STREAM_CHUNK_SIZE ? length : MEM_STREAM_CHUNK_SIZE;
+
+        SpiJob *job = new SpiJob();
+        job->type = SPI_JOB_WRITE_MEM;
+        job->link = &links.front();
+        job->address = address;
+        job->length = chunk;
+        job->client_fd = cc->fd;
+        job->client_gen = cc->generation;
+        job->notify = chunk == length;
+        job->buf.resize(chunk);
+        memcpy(&job->buf[0], &(cc->payload[offset]), chunk);
+
+        submit_spi_job(job);
+
+        address += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+}
+
+// A scatter-gather read carries a vector of (address, length) pairs and is
+// answered with a single MSG_READ_MEM_RES holding the regions concatenated
+// in request order. This lets a client fetch non-contiguous memory, such as
+// interleaved bitplanes, in one round trip.
+static void handle_msg_read_mem_sg(ClientConnection *cc)
+{
+    size_t count = cc->header.length / 8;
+
+    if (count == 0 || cc->header.length % 8 != 0)
+    {
+        logger_warn("Received a MSG_READ_MEM_SG message with bad bounds from client\n");
+        return;
+    }
+
+    SpiJob *job = new SpiJob();
+    job->type = SPI_JOB_READ_MEM_SG;
+    job->link = &links.front();
+    job->client_fd = cc->fd;
+    job->client_gen = cc->generation;
+    job->segments.resize(count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        job->segments[i].address = *(uint32_t *)&(cc->payload[i * 8]);
+        job->segments[i].length = *(uint32_t *)&(cc->payload[i * 8 + 4]);
+
+        if (job->segments[i].length == 0 || job->segments[i].length > MEM_STREAM_CHUNK_SIZE)
         {
+            logger_warn("Received a MSG_READ_MEM_SG message with bad bounds from client\n");
+            delete job;
             return;
         }
     }
+
+    submit_spi_job(job);
 }
 
-static void handle_msg_register_req(ClientConnection *cc)
+// A scatter-gather write carries a sequence of (address, length, data)
+// records and is acked with a single MSG_WRITE_MEM_RES once all regions
+// have been written.
+static void handle_msg_write_mem_sg(ClientConnection *cc)
 {
-    uint8_t result = MSG_FAIL;
+    SpiJob *job = new SpiJob();
+    job->type = SPI_JOB_WRITE_MEM_SG;
+    job->link = &links.front();
+    job->client_fd = cc->fd;
+    job->client_gen = cc->generation;
+
+    size_t pos = 0;
+    while (pos < cc->header.length)
+    {
+        if (cc->header.length - pos < 8)
+        {
+            logger_warn("Received a MSG_WRITE_MEM_SG message with bad bounds from client\n");
+            delete job;
+            return;
+        }
 
-    std::string service_name((char *)&cc->payload[0], cc->payload.size());
+        SgSegment seg;
+        seg.address = *(uint32_t *)&(cc->payload[pos]);
+        seg.length = *(uint32_t *)&(cc->payload[pos + 4]);
+        pos += 8;
 
-    auto it = services.begin();
-    for (; it != services.end(); it++)
-        if (it->name == service_name)
-            break;
+        if (seg.length == 0 || seg.length > MEM_STREAM_CHUNK_SIZE ||
+            cc->header.length - pos < seg.length)
+        {
+            logger_warn("Received a MSG_WRITE_MEM_SG message with bad bounds from client\n");
+            delete job;
+            return;
+        }
 
-    if (it == services.end())
-    {
-        services.emplace_back();
+        size_t offset = job->buf.size();
+        job->buf.resize(offset + seg.length);
+        memcpy(&job->buf[offset], &(cc->payload[pos]), seg.length);
+        pos += seg.length;
 
-        RegisteredService &srv = services.back();
-        srv.cc = cc;
-        srv.name = std::move(service_name);
+        job->segments.push_back(seg);
+    }
 
-        result = MSG_SUCCESS;
+    if (job->segments.empty())
+    {
+        logger_warn("Received a MSG_WRITE_MEM_SG message with bad bounds from client\n");
+        delete job;
+        return;
     }
 
-    create_and_send_msg(cc, MSG_REGISTER_RES, 0, &result, 1);
+    submit_spi_job(job);
 }
 
-static void handle_msg_deregister_req(ClientConnection *cc)
+static uint64_t next_connection_generation = 1;
+
+static void init_connection(ClientConnection &cc, int fd, bool is_unix)
+{
+    cc.fd = fd;
+    cc.generation = next_connection_generation++;
+    cc.is_unix = is_unix;
+    cc.pending_shm_fd = -1;
+    cc.shm_fd = -1;
+    cc.shm_map = nullptr;
+    cc.shm_size = 0;
+    cc.next_stream_id = 1;
+    cc.payload = nullptr;
+    cc.queued_bytes = 0;
+    cc.overflowed = false;
+    cc.recv_paused = false;
+    cc.flush_pending = false;
+    cc.bytes_in = 0;
+    cc.bytes_out = 0;
+    cc.messages_in = 0;
+    cc.messages_out = 0;
+
+    connections_by_fd[fd] = &cc;
+}
+
+static LogicalChannel *get_associated_channel_by_stream_id(ClientConnection *cc, int stream_id)
+{
+    for (auto ch : cc->associations)
+    {
+        if (ch->stream_id == stream_id)
+            return ch;
+    }
+    return nullptr;
+}
+
+static void handle_msg_shm_setup_req(ClientConnection *cc)
 {
     uint8_t result = MSG_FAIL;
 
-    std::string service_name((char *)&cc->payload[0], cc->payload.size());
+    uint32_t size = *(uint32_t *)&(cc->payload[0]);
 
-    for (auto it = services.begin(); it != services.end(); it++)
+    if (cc->pending_shm_fd != -1 && cc->shm_map == nullptr && size > 8)
     {
-        if (it->name == service_name && it->cc == cc)
+        void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, cc->pending_shm_fd, 0);
+        if (map != MAP_FAILED)
         {
-            services.erase(it);
+            cc->shm_fd = cc->pending_shm_fd;
+            cc->pending_shm_fd = -1;
+            cc->shm_map = (uint8_t *)map;
+            cc->shm_size = size;
             result = MSG_SUCCESS;
-            break;
         }
     }
 
-    create_and_send_msg(cc, MSG_DEREGISTER_RES, 0, &result, 1);
-}
-
-static void handle_msg_read_mem_req(ClientConnection *cc)
-{
-    uint32_t address = *(uint32_t *)&(cc->payload[0]);
-    uint32_t length = *(uint32_t *)&(cc->payload[4]);
-
-    spi_read_mem(address, length);
+    if (result == MSG_FAIL && cc->pending_shm_fd != -1)
+    {
+        close(cc->pending_shm_fd);
+        cc->pending_shm_fd = -1;
+    }
 
-    create_and_send_msg(cc, MSG_READ_MEM_RES, 0, &rx_buf[READ_SRAM_HDR_LEN], length);
+    create_and_send_msg(cc, MSG_SHM_SETUP_RES, 0, &result, 1);
 }
 
-static void handle_msg_write_mem_req(ClientConnection *cc)
+static void handle_msg_data_shm(ClientConnection *cc)
 {
-    uint32_t address = *(uint32_t *)&(cc->payload[0]);
-    uint32_t length = cc->payload.size() - 4;
+    LogicalChannel *ch = get_associated_channel_by_stream_id(cc, cc->header.stream_id);
+    if (!ch || cc->shm_map == nullptr)
+        return;
 
-    spi_write_mem(address, &(cc->payload[4]), length);
+    if (cc->header.length < 8)
+    {
+        logger_warn("Received a too short MSG_DATA_SHM message from client\n");
+        return;
+    }
 
-    create_and_send_msg(cc, MSG_WRITE_MEM_RES, 0, nullptr, 0);
-}
+    uint32_t offset = *(uint32_t *)&(cc->payload[0]);
+    uint32_t length = *(uint32_t *)&(cc->payload[4]);
 
-static LogicalChannel *get_associated_channel_by_stream_id(ClientConnection *cc, int stream_id)
-{
-    for (auto ch : cc->associations)
+    // The offset is client controlled and offset + length can wrap in 32
+    // bits, so the bounds are checked without forming the sum.
+    if (offset < 8 || length > 255 || offset >= cc->shm_size || length > cc->shm_size - offset)
     {
-        if (ch->stream_id == stream_id)
-            return ch;
+        logger_warn("Received a MSG_DATA_SHM message with bad bounds from client\n");
+        return;
     }
-    return nullptr;
+
+    create_and_enqueue_packet(ch, PKT_DATA, &cc->shm_map[offset], length);
+
+    // Publish how far the ring has been consumed so that the client can
+    // reuse the space.
+    __atomic_store_n((uint32_t *)&cc->shm_map[4], offset + length, __ATOMIC_RELEASE);
 }
 
 static void handle_msg_connect(ClientConnection *cc)
@@ -686,7 +2586,7 @@ static void handle_msg_connect_response(ClientConnection *cc)
     if (!ch)
         return;
 
-    create_and_enqueue_packet(ch, PKT_CONNECT_RESPONSE, &cc->payload[0], cc->payload.size());
+    create_and_enqueue_packet(ch, PKT_CONNECT_RESPONSE, &cc->payload[0], cc->header.length);
 
     if (cc->payload[0] != CONNECT_OK)
         remove_association(ch);
@@ -698,7 +2598,20 @@ static void handle_msg_data(ClientConnection *cc)
     if (!ch)
         return;
 
-    create_and_enqueue_packet(ch, PKT_DATA, &cc->payload[0], cc->header.length);
+    // Split the message into as many packets as the negotiated frame format
+    // and ring size allow.
+    uint32_t length = cc->header.length;
+    uint32_t offset = 0;
+
+    do
+    {
+        uint32_t chunk = length - offset;
+        if (chunk > ch->link->max_pkt_data)
+            chunk = ch->link->max_pkt_data;
+
+        create_and_enqueue_packet(ch, PKT_DATA, &cc->payload[offset], chunk);
+        offset += chunk;
+    } while (offset < length);
 }
 
 static void handle_msg_eos(ClientConnection *cc)
@@ -729,6 +2642,8 @@ static void handle_msg_reset(ClientConnection *cc)
 
 static void handle_received_message(ClientConnection *cc)
 {
+    cc->messages_in++;
+
     switch (cc->header.type)
     {
     case MSG_REGISTER_REQ:
@@ -758,6 +2673,24 @@ static void handle_received_message(ClientConnection *cc)
     case MSG_RESET:
         handle_msg_reset(cc);
         break;
+    case MSG_SHM_SETUP_REQ:
+        handle_msg_shm_setup_req(cc);
+        break;
+    case MSG_DATA_SHM:
+        handle_msg_data_shm(cc);
+        break;
+    case MSG_READ_MEM_STREAM:
+        handle_msg_read_mem_stream(cc);
+        break;
+    case MSG_WRITE_MEM_STREAM:
+        handle_msg_write_mem_stream(cc);
+        break;
+    case MSG_READ_MEM_SG:
+        handle_msg_read_mem_sg(cc);
+        break;
+    case MSG_WRITE_MEM_SG:
+        handle_msg_write_mem_sg(cc);
+        break;
     default:
         // This is bad, probably should disconnect from client.
         logger_warn("Received a message of unknown type from client\n");
@@ -765,482 +2698,1093 @@ static void handle_received_message(ClientConnection *cc)
     }
 }
 
-static void close_and_remove_connection(ClientConnection *cc)
+static void close_and_remove_connection(ClientConnection *cc)
+{
+    shutdown(cc->fd, SHUT_WR);
+    close(cc->fd);
+
+    connections_by_fd.erase(cc->fd);
+
+    release_all_message_buffers(cc->message_queue);
+
+    if (cc->flush_pending)
+        flush_list.erase(std::find(flush_list.begin(), flush_list.end(), cc));
+
+    if (cc->shm_map != nullptr)
+        munmap(cc->shm_map, cc->shm_size);
+    if (cc->shm_fd != -1)
+        close(cc->shm_fd);
+    if (cc->pending_shm_fd != -1)
+        close(cc->pending_shm_fd);
+
+    std::vector<std::string> lost_services;
+
+    {
+        auto it = services.begin();
+        while (it != services.end())
+        {
+            if (it->second == cc)
+            {
+                lost_services.push_back(it->first);
+                it = services.erase(it);
+            }
+            else
+                it++;
+        }
+    }
+
+    {
+        auto it = cc->associations.begin();
+        while (it != cc->associations.end())
+        {
+            auto ch = *it;
+
+            clear_packet_queue(ch);
+            create_and_enqueue_packet(ch, PKT_RESET, nullptr, 0);
+
+            ch->association = nullptr;
+            ch->stream_id = 0;
+
+            it = cc->associations.erase(it);
+        }
+    }
+
+    for (auto it = connections.begin(); it != connections.end(); it++)
+    {
+        if (&(*it) == cc)
+        {
+            connections.erase(it);
+            break;
+        }
+    }
+
+    // Respawn warm services so that the next connect is again handled
+    // without paying for process startup.
+    if (respawn_warm_services)
+    {
+        for (auto &name : lost_services)
+        {
+            if (!is_warm_service(name))
+                continue;
+
+            for (auto &on_demand : on_demand_services)
+            {
+                if (on_demand.service_name == name)
+                {
+                    start_on_demand_service(on_demand);
+                    logger_info("Respawned warm service %s\n", name.c_str());
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static void remove_association(LogicalChannel *ch)
+{
+    auto &ass = ch->association->associations;
+    ass.erase(std::find(ass.begin(), ass.end(), ch));
+
+    ch->association = nullptr;
+    ch->stream_id = 0;
+}
+
+static void clear_packet_queue(LogicalChannel *ch)
+{
+    if (!ch->packet_queue.empty())
+    {
+        release_all_packet_buffers(ch->packet_queue);
+        auto &q = ch->link->send_queues[ch->priority];
+        q.erase(std::find(q.begin(), q.end(), ch));
+    }
+    release_all_packet_buffers(ch->frame_queue);
+    ch->queued_bytes = 0;
+}
+
+static void create_and_enqueue_packet(LogicalChannel *ch, uint8_t type, uint8_t *data, int length)
+{
+    // Packets for a paced channel are staged in the frame queue and only
+    // enter the send queues at the frame tick.
+    std::list<PacketBuffer> &queue = ch->paced ? ch->frame_queue : ch->packet_queue;
+
+    if (!ch->paced && ch->packet_queue.empty())
+        ch->link->send_queues[ch->priority].push_back(ch);
+
+    PacketBuffer &pb = acquire_packet_buffer(queue, length);
+    pb.type = type;
+    if (data && length)
+        memcpy(&pb.data[0], data, length);
+
+    ch->queued_bytes += length;
+
+    if (ch->stats != nullptr)
+    {
+        ch->stats->packets_to_ami++;
+        ch->stats->bytes_to_ami += length;
+    }
+}
+
+// Forks and executes an on-demand service with one end of a socketpair as
+// its driver connection, and registers the new connection as the provider
+// of the service. Used both when a connect packet arrives for a service
+// that is not running, and ahead of time for services on "warm" lines.
+static ClientConnection *start_on_demand_service(OnDemandStart &on_demand)
+{
+    int fds[2];
+    int status = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    if (status != 0)
+    {
+        logger_error("Unexpectedly not able to create socket pair.\n");
+        exit(-1);
+    }
+
+    pid_t child = fork();
+    if (child == -1)
+    {
+        logger_error("Unexpectedly was not able to fork.\n");
+        exit(-1);
+    }
+    else if (child == 0)
+    {
+        close(fds[0]);
+        int fd = fds[1];
+
+        std::vector<std::string> args(on_demand.arguments);
+        args.push_back("-ondemand");
+        args.push_back(std::to_string(fd));
+        std::vector<const char *> args_arr;
+        for (auto &arg : args)
+            args_arr.push_back(arg.c_str());
+        args_arr.push_back(nullptr);
+
+        execvp(on_demand.program.c_str(), (char* const*) &args_arr[0]);
+    }
+
+    close(fds[1]);
+    int fd = fds[0];
+
+    status = fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+    if (status == -1)
+    {
+        logger_error("Unexpectedly unable to set close-on-exec flag on client socket descriptor; errno = %d\n", errno);
+        exit(-1);
+    }
+
+    status = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (status == -1)
+    {
+        logger_error("Unexpectedly unable to set client socket to non blocking; errno = %d\n", errno);
+        exit(-1);
+    }
+
+    connections.emplace_back();
+
+    ClientConnection &cc = connections.back();
+    init_connection(cc, fd, true);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = &cc;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        logger_error("epoll_ctl() failed unexpectedly with errno = %d\n", errno);
+        exit(-1);
+    }
+
+    services[on_demand.service_name] = &cc;
+
+    return &cc;
+}
+
+static void prewarm_services()
+{
+    for (auto &name : warm_services)
+    {
+        if (services.find(name) != services.end())
+            continue;
+
+        bool found = false;
+        for (auto &on_demand : on_demand_services)
+        {
+            if (on_demand.service_name == name)
+            {
+                start_on_demand_service(on_demand);
+                logger_info("Prewarmed service %s\n", name.c_str());
+                found = true;
+                break;
+            }
+        }
+
+        if (!found)
+            logger_warn("Service %s on warm line is not a registered service\n", name.c_str());
+    }
+}
+
+static void handle_pkt_connect(AmigaLink *l, int channel_id, uint8_t *data, int plen)
+{
+    if (l->channel_index[channel_id] != nullptr)
+    {
+        // We should handle this in some constructive way.
+        // This signals that should reset all logical channels.
+        logger_error("Received a CONNECT packet on a channel that was believed to be previously allocated\n");
+        exit(-1);
+    }
+
+    l->channels.emplace_back();
+
+    auto &ch = l->channels.back();
+    l->channel_index[channel_id] = &ch;
+
+    ch.channel_id = channel_id;
+    ch.link = l;
+    ch.association = nullptr;
+    ch.stream_id = 0;
+    ch.got_eos_from_ami = false;
+    ch.got_eos_from_client = false;
+    ch.queued_bytes = 0;
+
+    std::string service_name((char *)data, plen);
+
+    ch.priority = get_service_priority(service_name);
+    ch.paced = is_service_paced(service_name);
+    ch.stats = get_service_stats(service_name);
+    ch.stats->streams_opened++;
+
+    auto srv_it = services.find(service_name);
+    if (srv_it != services.end())
+    {
+        ClientConnection *cc = srv_it->second;
+
+        ch.association = cc;
+        ch.stream_id = cc->next_stream_id;
+
+        cc->next_stream_id += 2;
+        cc->associations.push_back(&ch);
+
+        create_and_send_msg(ch.association, MSG_CONNECT, ch.stream_id, data, plen);
+        return;
+    }
+
+    for (auto &on_demand : on_demand_services)
+    {
+        if (on_demand.service_name == service_name)
+        {
+            ClientConnection *cc = start_on_demand_service(on_demand);
+
+            ch.association = cc;
+            ch.stream_id = cc->next_stream_id;
+
+            cc->next_stream_id += 2;
+            cc->associations.push_back(&ch);
+
+            create_and_send_msg(ch.association, MSG_CONNECT, ch.stream_id, data, plen);
+            return;
+        }
+    }
+
+    uint8_t response = CONNECT_UNKNOWN_SERVICE;
+    create_and_enqueue_packet(&ch, PKT_CONNECT_RESPONSE, &response, 1);
+}
+
+static void handle_pkt_data(AmigaLink *l, int channel_id, uint8_t *data, int plen)
 {
-    shutdown(cc->fd, SHUT_WR);
-    close(cc->fd);
+    LogicalChannel *ch = l->channel_index[channel_id];
+    if (ch == nullptr)
+        return;
 
+    if (ch->stats != nullptr)
     {
-        auto it = services.begin();
-        while (it != services.end())
-        {
-            if (it->cc == cc)
-                it = services.erase(it);
-            else
-                it++;
-        }
+        ch->stats->packets_from_ami++;
+        ch->stats->bytes_from_ami += plen;
     }
 
+    if (ch->association != nullptr && !ch->got_eos_from_ami)
+        create_and_send_msg(ch->association, MSG_DATA, ch->stream_id, data, plen);
+}
+
+static void handle_pkt_eos(AmigaLink *l, int channel_id)
+{
+    LogicalChannel *ch = l->channel_index[channel_id];
+    if (ch == nullptr)
+        return;
+
+    if (ch->association != nullptr && !ch->got_eos_from_ami)
     {
-        auto it = cc->associations.begin();
-        while (it != cc->associations.end())
-        {
-            auto ch = *it;
+        ch->got_eos_from_ami = true;
 
-            clear_packet_queue(ch);
-            create_and_enqueue_packet(ch, PKT_RESET, nullptr, 0);
+        create_and_send_msg(ch->association, MSG_EOS, ch->stream_id, nullptr, 0);
 
-            ch->association = nullptr;
-            ch->stream_id = 0;
+        if (ch->got_eos_from_client)
+            remove_association(ch);
+    }
+}
 
-            it = cc->associations.erase(it);
-        }
+static void handle_pkt_reset(AmigaLink *l, int channel_id)
+{
+    LogicalChannel *ch = l->channel_index[channel_id];
+    if (ch == nullptr)
+        return;
+
+    clear_packet_queue(ch);
+
+    if (ch->association != nullptr)
+    {
+        create_and_send_msg(ch->association, MSG_RESET, ch->stream_id, nullptr, 0);
+        remove_association(ch);
     }
+}
 
-    for (auto it = connections.begin(); it != connections.end(); it++)
+static void remove_channel_if_not_associated_and_empty_pq(AmigaLink *l, int channel_id)
+{
+    LogicalChannel *ch = l->channel_index[channel_id];
+    if (ch == nullptr)
+        return;
+
+    if (ch->association != nullptr || !ch->packet_queue.empty() || !ch->frame_queue.empty())
+        return;
+
+    l->channel_index[channel_id] = nullptr;
+
+    for (auto it = l->channels.begin(); it != l->channels.end(); it++)
     {
-        if (&(*it) == cc)
+        if (&(*it) == ch)
         {
-            connections.erase(it);
+            l->channels.erase(it);
             break;
         }
     }
 }
 
-static void remove_association(LogicalChannel *ch)
+// Writes a PKT_SETTINGS packet, always in the legacy frame format, directly
+// into the r2a ring ahead of any queued channel packets. The packet marks
+// the exact point in the stream where the frame format switches.
+static bool send_settings_pkt(AmigaLink *l, uint8_t format)
 {
-    auto &ass = ch->association->associations;
-    ass.erase(std::find(ass.begin(), ass.end(), ch));
+    unsigned int tail = l->channel_status[R2A_TAIL_OFFSET];
+    unsigned int head = l->channel_status[R2A_HEAD_OFFSET];
+    unsigned int used = (tail - head) & (l->r2a_ring_size - 1);
 
-    ch->association = nullptr;
-    ch->stream_id = 0;
+    if (l->r2a_ring_size - 1 - used < 4)
+        return false;
+
+    uint8_t pkt[4] = {1, PKT_SETTINGS, 0, format};
+
+    uint8_t *p = pkt;
+    int to_write = sizeof(pkt);
+    int at_end = l->r2a_ring_size - tail;
+    if (at_end < to_write)
+    {
+        spi_write_mem(l, l->base_address + l->r2a_ring_offset + tail, p, at_end);
+        p += at_end;
+        to_write -= at_end;
+        tail = 0;
+    }
+
+    spi_write_mem(l, l->base_address + l->r2a_ring_offset + tail, p, to_write);
+    tail = (tail + to_write) & (l->r2a_ring_size - 1);
+
+    link_stats.r2a_ring_bytes += sizeof(pkt);
+
+    if (trace_enabled)
+        trace_pkt(TRACE_DIR_R2A, PKT_SETTINGS, 0, &format, 1);
+
+    l->channel_status[R2A_TAIL_OFFSET] = tail;
+    l->channel_status_updated |= A_EVENT_R2A_TAIL;
+    return true;
 }
 
-static void clear_packet_queue(LogicalChannel *ch)
+static void handle_pkt_settings(AmigaLink *l, uint8_t *data, int plen)
 {
-    if (!ch->packet_queue.empty())
+    if (plen < 1 || (data[0] & FRAME_FORMAT_EXT16) == 0)
+        return;
+
+    if (!l->r2a_ext_frames)
+    {
+        // Offer from the Amiga driver: acknowledge it, and use the extended
+        // format for everything that follows the ack in the r2a ring.
+        if (!send_settings_pkt(l, FRAME_FORMAT_EXT16))
+        {
+            logger_warn("No room in r2a ring to acknowledge PKT_SETTINGS, staying with legacy frames\n");
+            return;
+        }
+
+        l->r2a_ext_frames = true;
+
+        l->max_pkt_data = EXT_FRAME_MAX_DATA;
+        if (l->max_pkt_data > l->r2a_ring_size - 16)
+            l->max_pkt_data = l->r2a_ring_size - 16;
+
+        logger_info("Negotiated 16-bit packet framing (max data length %d bytes)\n", l->max_pkt_data);
+    }
+    else if (!l->a2r_ext_frames)
     {
-        ch->packet_queue.clear();
-        send_queue.erase(std::find(send_queue.begin(), send_queue.end(), ch));
+        // Confirm from the Amiga driver: a2r packets after this one use the
+        // extended format.
+        l->a2r_ext_frames = true;
     }
 }
 
-static void create_and_enqueue_packet(LogicalChannel *ch, uint8_t type, uint8_t *data, uint8_t length)
+static void handle_received_pkt(AmigaLink *l, int ptype, int channel_id, uint8_t *data, int plen)
 {
-    if (ch->packet_queue.empty())
-        send_queue.push_back(ch);
+    if (trace_enabled)
+        trace_pkt(TRACE_DIR_A2R, ptype, channel_id, data, plen);
 
-    ch->packet_queue.emplace_back();
+    if (ptype == PKT_SETTINGS)
+    {
+        handle_pkt_settings(l, data, plen);
+        return;
+    }
 
-    PacketBuffer &pb = ch->packet_queue.back();
-    pb.type = type;
-    pb.data.resize(length);
-    if (data && length)
-        memcpy(&pb.data[0], data, length);
+    if (ptype == PKT_CONNECT)
+        handle_pkt_connect(l, channel_id, data, plen);
+    else if (ptype == PKT_DATA)
+        handle_pkt_data(l, channel_id, data, plen);
+    else if (ptype == PKT_EOS)
+        handle_pkt_eos(l, channel_id);
+    else if (ptype == PKT_RESET)
+        handle_pkt_reset(l, channel_id);
+
+    remove_channel_if_not_associated_and_empty_pq(l, channel_id);
 }
 
-static void handle_pkt_connect(int channel_id, uint8_t *data, int plen)
+static void parse_a2r_packets(AmigaLink *l, int len)
 {
-    for (auto &ch : channels)
+    uint8_t *p = recv_buf;
+    while (p < recv_buf + len)
     {
-        if (ch.channel_id == channel_id)
+        // The frame format is re-checked per packet since a PKT_SETTINGS
+        // confirm switches it for the rest of the buffer.
+        int plen;
+        if (l->a2r_ext_frames)
         {
-            // We should handle this in some constructive way.
-            // This signals that should reset all logical channels.
-            logger_error("Received a CONNECT packet on a channel that was believed to be previously allocated\n");
-            exit(-1);
+            plen = (p[0] << 8) | p[1];
+            p += 2;
         }
-    }
+        else
+            plen = *p++;
 
-    channels.emplace_back();
+        uint8_t ptype = *p++;
+        uint8_t channel_id = *p++;
+        handle_received_pkt(l, ptype, channel_id, p, plen);
+        p += plen;
+    }
 
-    auto &ch = channels.back();
+    link_stats.a2r_ring_bytes += len;
 
-    ch.channel_id = channel_id;
-    ch.association = nullptr;
-    ch.stream_id = 0;
-    ch.got_eos_from_ami = false;
-    ch.got_eos_from_client = false;
+    l->channel_status[A2R_HEAD_OFFSET] = l->channel_status[A2R_TAIL_OFFSET];
+    l->channel_status_updated |= A_EVENT_A2R_HEAD;
+}
 
-    std::string service_name((char *)data, plen);
+static bool receive_from_a2r(AmigaLink *l)
+{
+    unsigned int head = l->channel_status[A2R_HEAD_OFFSET];
+    unsigned int tail = l->channel_status[A2R_TAIL_OFFSET];
+    unsigned int len = (tail - head) & (l->a2r_ring_size - 1);
+    if (len == 0)
+        return false;
 
-    for (auto &srv : services)
+    if (head < tail)
+    {
+        spi_read_mem(l, l->base_address + l->a2r_ring_offset + head, tail - head);
+        memcpy(recv_buf, &rx_buf[READ_SRAM_HDR_LEN], len);
+    }
+    else
     {
-        if (srv.name == service_name)
+        spi_read_mem(l, l->base_address + l->a2r_ring_offset + head, l->a2r_ring_size - head);
+        memcpy(recv_buf, &rx_buf[READ_SRAM_HDR_LEN], l->a2r_ring_size - head);
+
+        if (tail != 0)
         {
-            ClientConnection *cc = srv.cc;
+            spi_read_mem(l, l->base_address + l->a2r_ring_offset, tail);
+            memcpy(&recv_buf[len - tail], &rx_buf[READ_SRAM_HDR_LEN], tail);
+        }
+    }
 
-            ch.association = cc;
-            ch.stream_id = cc->next_stream_id;
+    parse_a2r_packets(l, len);
+    return true;
+}
 
-            cc->next_stream_id += 2;
-            cc->associations.push_back(&ch);
+static bool flush_send_queue(AmigaLink *l)
+{
+    unsigned int tail = l->channel_status[R2A_TAIL_OFFSET];
+    unsigned int head = l->channel_status[R2A_HEAD_OFFSET];
+    int len = (tail - head) & (l->r2a_ring_size - 1);
+    int left = l->r2a_ring_size - 1 - len;
 
-            create_and_send_msg(ch.association, MSG_CONNECT, ch.stream_id, data, plen);
-            return;
-        }
-    }
+    int pos = 0;
+    int hdr = l->r2a_ext_frames ? 4 : 3;
 
-    for (auto &on_demand : on_demand_services)
+    // Drain the priority classes in strict order, round-robin between the
+    // channels within a class. Stop packing entirely when a packet doesn't
+    // fit, so that a lower class cannot overtake a higher one.
+    for (int prio = 0; prio < PRIO_CLASS_COUNT && left >= hdr; prio++)
     {
-        if (on_demand.service_name == service_name)
+        auto &q = l->send_queues[prio];
+
+        while (!q.empty())
         {
-            int fds[2];
-            int status = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
-            if (status != 0)
-            {
-                logger_error("Unexpectedly not able to create socket pair.\n");
-                exit(-1);
-            }
+            LogicalChannel *ch = q.front();
+            PacketBuffer &pb = ch->packet_queue.front();
 
-            pid_t child = fork();
-            if (child == -1)
+            int ptype = pb.type;
+            int plen = hdr + pb.data.size();
+
+            if (left < plen)
             {
-                logger_error("Unexpectedly was not able to fork.\n");
-                exit(-1);
+                prio = PRIO_CLASS_COUNT;
+                break;
             }
-            else if (child == 0)
+
+            if (l->r2a_ext_frames)
             {
-                close(fds[0]);
-                int fd = fds[1];
-
-                std::vector<std::string> args(on_demand.arguments);
-                args.push_back("-ondemand");
-                args.push_back(std::to_string(fd));
-                std::vector<const char *> args_arr;
-                for (auto &arg : args)
-                    args_arr.push_back(arg.c_str());
-                args_arr.push_back(nullptr);
-
-                execvp(on_demand.program.c_str(), (char* const*) &args_arr[0]);
+                send_buf[pos++] = (uint8_t)(pb.data.size() >> 8);
+                send_buf[pos++] = (uint8_t)pb.data.size();
             }
             else
-            {
-                close(fds[1]);
-                int fd = fds[0];
+                send_buf[pos++] = pb.data.size();
+            send_buf[pos++] = ptype;
+            send_buf[pos++] = ch->channel_id;
+            memcpy(&send_buf[pos], &pb.data[0], pb.data.size());
+            pos += pb.data.size();
 
-                int status = fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
-                if (status == -1)
-                {
-                    logger_error("Unexpectedly unable to set close-on-exec flag on client socket descriptor; errno = %d\n", errno);
-                    exit(-1);
-                }
+            if (trace_enabled)
+                trace_pkt(TRACE_DIR_R2A, ptype, ch->channel_id,
+                    pb.data.empty() ? nullptr : &pb.data[0], pb.data.size());
 
-                status = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
-                if (status == -1)
-                {
-                    logger_error("Unexpectedly unable to set client socket to non blocking; errno = %d\n", errno);
-                    exit(-1);
-                }
+            ch->queued_bytes -= pb.data.size();
+            release_packet_buffer(ch->packet_queue, ch->packet_queue.begin());
 
-                int flag = 1;
-                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+            q.pop_front();
 
-                connections.emplace_back();
+            if (!ch->packet_queue.empty())
+                q.push_back(ch);
+            else
+                remove_channel_if_not_associated_and_empty_pq(l, ch->channel_id);
 
-                ClientConnection &cc = connections.back();
-                cc.fd = fd;
-                cc.next_stream_id = 1;
-                cc.bytes_read = 0;
+            left -= plen;
+        }
+    }
 
-                struct epoll_event ev;
-                ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-                ev.data.fd = fd;
-                if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
-                {
-                    logger_error("epoll_ctl() failed unexpectedly with errno = %d\n", errno);
-                    exit(-1);
-                }
+    int to_write = pos;
+    if (!to_write)
+        return false;
 
-                services.emplace_back();
+    link_stats.r2a_ring_bytes += pos;
 
-                RegisteredService &srv = services.back();
-                srv.cc = &cc;
-                srv.name = std::move(service_name);
+    uint8_t *p = send_buf;
+    int at_end = l->r2a_ring_size - tail;
+    if (at_end < to_write)
+    {
+        spi_write_mem(l, l->base_address + l->r2a_ring_offset + tail, p, at_end);
+        p += at_end;
+        to_write -= at_end;
+        tail = 0;
+    }
+
+    spi_write_mem(l, l->base_address + l->r2a_ring_offset + tail, p, to_write);
+    tail = (tail + to_write) & (l->r2a_ring_size - 1);
 
-                ch.association = &cc;
-                ch.stream_id = cc.next_stream_id;
+    l->channel_status[R2A_TAIL_OFFSET] = tail;
+    l->channel_status_updated |= A_EVENT_R2A_TAIL;
+    return true;
+}
 
-                cc.next_stream_id += 2;
-                cc.associations.push_back(&ch);
+static bool is_valid_ring_size(unsigned int size)
+{
+    return size >= 256 && size <= 65536 && (size & (size - 1)) == 0;
+}
 
-                create_and_send_msg(ch.association, MSG_CONNECT, ch.stream_id, data, plen);
-                return;
-            }
-        }
+static void read_ring_sizes(AmigaLink *l)
+{
+    if (!l->com_area_v2)
+    {
+        l->a2r_ring_size = 256;
+        l->r2a_ring_size = 256;
+        l->a2r_ring_offset = 4;
+        l->r2a_ring_offset = 260;
+        return;
     }
 
-    uint8_t response = CONNECT_UNKNOWN_SERVICE;
-    create_and_enqueue_packet(&ch, PKT_CONNECT_RESPONSE, &response, 1);
+    spi_read_mem(l, l->base_address + 8, 4);
+
+    l->a2r_ring_size = (rx_buf[READ_SRAM_HDR_LEN] << 8) | rx_buf[READ_SRAM_HDR_LEN + 1];
+    l->r2a_ring_size = (rx_buf[READ_SRAM_HDR_LEN + 2] << 8) | rx_buf[READ_SRAM_HDR_LEN + 3];
+
+    // A size field of zero means 65536.
+    if (l->a2r_ring_size == 0)
+        l->a2r_ring_size = 65536;
+    if (l->r2a_ring_size == 0)
+        l->r2a_ring_size = 65536;
+
+    if (!is_valid_ring_size(l->a2r_ring_size) || !is_valid_ring_size(l->r2a_ring_size))
+    {
+        logger_warn("Invalid ring sizes in com area (a2r = %d, r2a = %d)\n", l->a2r_ring_size, l->r2a_ring_size);
+        l->have_base_address = false;
+        return;
+    }
+
+    l->a2r_ring_offset = 12;
+    l->r2a_ring_offset = 12 + l->a2r_ring_size;
+
+    logger_info("Negotiated com area rev 2 with ring sizes a2r = %d, r2a = %d\n", l->a2r_ring_size, l->r2a_ring_size);
 }
 
-static void handle_pkt_data(int channel_id, uint8_t *data, int plen)
+// Restores the negotiated frame format when a restarted a314d adopts an
+// already-published base address. The Amiga driver offers PKT_SETTINGS only
+// once at driver startup, so after an a314d restart both sides would
+// otherwise disagree on the framing: this daemon falls back to legacy while
+// the driver stays in the extended format. The driver records the completed
+// negotiation in a spare CMEM nibble, which is read back here.
+static void adopt_frame_format(AmigaLink *l)
 {
-    for (auto &ch : channels)
+    if (spi_read_cmem(l, FRAME_FORMAT_ADDRESS) & FRAME_FORMAT_EXT16)
     {
-        if (ch.channel_id == channel_id)
-        {
-            if (ch.association != nullptr && !ch.got_eos_from_ami)
-                create_and_send_msg(ch.association, MSG_DATA, ch.stream_id, data, plen);
+        l->a2r_ext_frames = true;
+        l->r2a_ext_frames = true;
 
-            break;
-        }
+        l->max_pkt_data = EXT_FRAME_MAX_DATA;
+        if (l->max_pkt_data > l->r2a_ring_size - 16)
+            l->max_pkt_data = l->r2a_ring_size - 16;
+
+        logger_info("Adopted 16-bit packet framing from running driver session (max data length %d bytes)\n", l->max_pkt_data);
     }
 }
 
-static void handle_pkt_eos(int channel_id)
+static void read_base_address(AmigaLink *l, bool republished)
 {
-    for (auto &ch : channels)
+    l->have_base_address = false;
+
+    // The frame format is renegotiated from scratch whenever the Amiga
+    // driver restarts and publishes a new base address.
+    l->a2r_ext_frames = false;
+    l->r2a_ext_frames = false;
+    l->max_pkt_data = 255;
+
+    unsigned int ba1 = 0;
+    for (int i = 0; i < BASE_ADDRESS_LEN; i++)
+        ba1 |= spi_read_cmem(l, i) << (i * 4);
+
+    if ((ba1 & BASE_ADDRESS_VALID) == BASE_ADDRESS_VALID)
     {
-        if (ch.channel_id == channel_id)
-        {
-            if (ch.association != nullptr && !ch.got_eos_from_ami)
-            {
-                ch.got_eos_from_ami = true;
+        unsigned int ba2 = 0;
+        for (int i = 0; i < BASE_ADDRESS_LEN; i++)
+            ba2 |= spi_read_cmem(l, i) << (i * 4);
 
-                create_and_send_msg(ch.association, MSG_EOS, ch.stream_id, nullptr, 0);
+        if (ba1 == ba2)
+        {
+            l->have_base_address = true;
+            l->com_area_v2 = (ba1 & BASE_ADDRESS_CA_V2) != 0;
+            l->base_address = ba1 & ~(BASE_ADDRESS_VALID | BASE_ADDRESS_CA_V2);
+            read_ring_sizes(l);
 
-                if (ch.got_eos_from_client)
-                    remove_association(&ch);
-            }
-            break;
+            if (l->have_base_address && !republished)
+                adopt_frame_format(l);
         }
     }
 }
 
-static void handle_pkt_reset(int channel_id)
+static void parse_channel_status(AmigaLink *l, uint8_t *p)
 {
-    for (auto &ch : channels)
+    if (l->com_area_v2)
     {
-        if (ch.channel_id == channel_id)
-        {
-            clear_packet_queue(&ch);
+        for (int i = 0; i < 4; i++)
+            l->channel_status[i] = (p[2 * i] << 8) | p[2 * i + 1];
+    }
+    else
+    {
+        for (int i = 0; i < 4; i++)
+            l->channel_status[i] = p[i];
+    }
+}
 
-            if (ch.association != nullptr)
-            {
-                create_and_send_msg(ch.association, MSG_RESET, ch.stream_id, nullptr, 0);
-                remove_association(&ch);
-            }
+static int channel_status_length(AmigaLink *l)
+{
+    return l->com_area_v2 ? 8 : 4;
+}
 
-            break;
-        }
-    }
+static void read_channel_status(AmigaLink *l)
+{
+    spi_read_mem(l, l->base_address, channel_status_length(l));
+
+    parse_channel_status(l, &rx_buf[READ_SRAM_HDR_LEN]);
+
+    l->channel_status_updated = 0;
 }
 
-static void remove_channel_if_not_associated_and_empty_pq(int channel_id)
+static void write_channel_status(AmigaLink *l)
 {
-    for (auto it = channels.begin(); it != channels.end(); it++)
+    if (l->channel_status_updated != 0)
     {
-        if (it->channel_id == channel_id)
+        if (l->com_area_v2)
         {
-            if (it->association == nullptr && it->packet_queue.empty())
-                channels.erase(it);
-
-            break;
+            uint8_t st[4];
+            st[0] = (uint8_t)(l->channel_status[R2A_TAIL_OFFSET] >> 8);
+            st[1] = (uint8_t)l->channel_status[R2A_TAIL_OFFSET];
+            st[2] = (uint8_t)(l->channel_status[A2R_HEAD_OFFSET] >> 8);
+            st[3] = (uint8_t)l->channel_status[A2R_HEAD_OFFSET];
+            spi_write_mem(l, l->base_address + 4, st, 4);
+        }
+        else
+        {
+            uint8_t st[2];
+            st[0] = (uint8_t)l->channel_status[R2A_TAIL_OFFSET];
+            st[1] = (uint8_t)l->channel_status[A2R_HEAD_OFFSET];
+            spi_write_mem(l, l->base_address + 2, st, 2);
         }
+        spi_write_cmem(l, A_EVENTS_ADDRESS, l->channel_status_updated);
+        l->channel_status_updated = 0;
     }
 }
 
-static void handle_received_pkt(int ptype, int channel_id, uint8_t *data, int plen)
+static void close_all_logical_channels(AmigaLink *l)
 {
-    if (ptype == PKT_CONNECT)
-        handle_pkt_connect(channel_id, data, plen);
-    else if (ptype == PKT_DATA)
-        handle_pkt_data(channel_id, data, plen);
-    else if (ptype == PKT_EOS)
-        handle_pkt_eos(channel_id);
-    else if (ptype == PKT_RESET)
-        handle_pkt_reset(channel_id);
+    for (int prio = 0; prio < PRIO_CLASS_COUNT; prio++)
+        l->send_queues[prio].clear();
+
+    auto it = l->channels.begin();
+    while (it != l->channels.end())
+    {
+        LogicalChannel &ch = *it;
 
-    remove_channel_if_not_associated_and_empty_pq(channel_id);
+        if (ch.association != nullptr)
+        {
+            create_and_send_msg(ch.association, MSG_RESET, ch.stream_id, nullptr, 0);
+            remove_association(&ch);
+        }
+
+        l->channel_index[ch.channel_id] = nullptr;
+
+        it = l->channels.erase(it);
+    }
 }
 
-static bool receive_from_a2r()
+static void handle_spi_job_completions()
 {
-    int head = channel_status[A2R_HEAD_OFFSET];
-    int tail = channel_status[A2R_TAIL_OFFSET];
-    int len = (tail - head) & 255;
-    if (len == 0)
-        return false;
+    uint64_t v;
+    read(spi_complete_efd, &v, sizeof(v));
 
-    if (head < tail)
+    SpiJob *job;
+    while ((job = spi_complete_queue.pop()) != nullptr)
     {
-        spi_read_mem(base_address + 4 + head, tail - head);
-        memcpy(recv_buf, &rx_buf[READ_SRAM_HDR_LEN], len);
+        ClientConnection *cc = nullptr;
+        auto it = connections_by_fd.find(job->client_fd);
+        if (it != connections_by_fd.end() && it->second->generation == job->client_gen)
+            cc = it->second;
+
+        // The connection may have been closed while the job was in flight,
+        // in which case the result is simply dropped. The generation check
+        // covers the fd having been reused for a new connection in the
+        // meantime; delivering the stale result there would desynchronize
+        // that client's request/response pairing.
+        if (cc != nullptr)
+        {
+            if (job->type == SPI_JOB_READ_MEM)
+                create_and_send_msg(cc, MSG_READ_MEM_RES, 0, &job->buf[0], job->length);
+            else if (job->type == SPI_JOB_READ_MEM_SG)
+                create_and_send_msg(cc, MSG_READ_MEM_RES, 0, &job->buf[0], job->buf.size());
+            else if (job->type == SPI_JOB_WRITE_MEM && job->notify)
+                create_and_send_msg(cc, MSG_WRITE_MEM_RES, 0, nullptr, 0);
+            else if (job->type == SPI_JOB_WRITE_MEM_SG)
+                create_and_send_msg(cc, MSG_WRITE_MEM_RES, 0, nullptr, 0);
+        }
+
+        delete job;
     }
+}
+
+// When rings are at most this large it is cheaper to read the whole A2R ring
+// speculatively in the same transaction as the ack than to wait for the
+// status and issue exact reads.
+#define SPECULATIVE_RING_READ_LIMIT     1024
+
+// Services an interrupt with chained SPI transactions: the IRQ ack, the
+// channel status read and (for small rings) speculative reads of the whole
+// A2R ring go out as a single SPI_IOC_MESSAGE(N) ioctl instead of four or
+// more separate ioctls. The ring is read before the status is known, which
+// is safe since only the tail moves on the Amiga side; the bytes between
+// head and tail are parsed once the status has been seen. For large rings
+// the exact wrapped reads are chained into a second transaction. Returns
+// true if the interrupt was fully serviced; returns false with *events_out
+// set if the base address must be re-read, in which case the caller falls
+// back to the unchained path (and must not ack again).
+static bool service_a314_irq_chained(AmigaLink *l, uint8_t *events_out)
+{
+    unsigned int head = l->channel_status[A2R_HEAD_OFFSET];
+
+    bool speculate = l->a2r_ring_size <= SPECULATIVE_RING_READ_LIMIT;
+
+    static SpiTransaction txn;
+    txn.reset();
+
+    uint8_t *p = txn.add_segment(2);
+    if (l->spi_proto_ver >= 1)
+        p[0] = (uint8_t)((READ_CMEM_CMD << 5) | R_EVENTS_ADDRESS);
     else
+        p[0] = (uint8_t)((READ_CMEM_CMD << 4) | R_EVENTS_ADDRESS);
+
+    p = txn.add_segment(channel_status_length(l) + READ_SRAM_HDR_LEN);
+    put_sram_cmd_header(l, p, READ_SRAM_CMD, l->base_address);
+
+    int wrap_seg = -1;
+    if (speculate)
     {
-        spi_read_mem(base_address + 4 + head, 256 - head);
-        memcpy(recv_buf, &rx_buf[READ_SRAM_HDR_LEN], 256 - head);
+        p = txn.add_segment(l->a2r_ring_size - head + READ_SRAM_HDR_LEN);
+        put_sram_cmd_header(l, p, READ_SRAM_CMD, l->base_address + l->a2r_ring_offset + head);
 
-        if (tail != 0)
+        if (head != 0)
         {
-            spi_read_mem(base_address + 4, tail);
-            memcpy(&recv_buf[len - tail], &rx_buf[READ_SRAM_HDR_LEN], tail);
+            wrap_seg = txn.count;
+            p = txn.add_segment(head + READ_SRAM_HDR_LEN);
+            put_sram_cmd_header(l, p, READ_SRAM_CMD, l->base_address + l->a2r_ring_offset);
         }
     }
 
-    uint8_t *p = recv_buf;
-    while (p < recv_buf + len)
-    {
-        uint8_t plen = *p++;
-        uint8_t ptype = *p++;
-        uint8_t channel_id = *p++;
-        handle_received_pkt(ptype, channel_id, p, plen);
-        p += plen;
-    }
+    spi_execute_transaction(l, &txn);
 
-    channel_status[A2R_HEAD_OFFSET] = channel_status[A2R_TAIL_OFFSET];
-    channel_status_updated |= A_EVENT_A2R_HEAD;
-    return true;
-}
+    uint8_t events = txn.rx[0][1];
+    *events_out = events;
 
-static bool flush_send_queue()
-{
-    int tail = channel_status[R2A_TAIL_OFFSET];
-    int head = channel_status[R2A_HEAD_OFFSET];
-    int len = (tail - head) & 255;
-    int left = 255 - len;
+    if (events == 0)
+        return true;
 
-    int pos = 0;
+    if (events & R_EVENT_BASE_ADDRESS)
+        return false;
+
+    parse_channel_status(l, &txn.rx[1][READ_SRAM_HDR_LEN]);
+    l->channel_status_updated = 0;
+
+    unsigned int tail = l->channel_status[A2R_TAIL_OFFSET];
+    unsigned int len = (tail - head) & (l->a2r_ring_size - 1);
 
-    while (!send_queue.empty())
+    bool any_rcvd = false;
+    if (len != 0)
     {
-        LogicalChannel *ch = send_queue.front();
-        PacketBuffer &pb = ch->packet_queue.front();
+        if (speculate)
+        {
+            if (head < tail)
+                memcpy(recv_buf, &txn.rx[2][READ_SRAM_HDR_LEN], len);
+            else
+            {
+                memcpy(recv_buf, &txn.rx[2][READ_SRAM_HDR_LEN], l->a2r_ring_size - head);
+                if (tail != 0)
+                    memcpy(&recv_buf[l->a2r_ring_size - head], &txn.rx[wrap_seg][READ_SRAM_HDR_LEN], tail);
+            }
+        }
+        else
+        {
+            static SpiTransaction ring_txn;
+            ring_txn.reset();
 
-        int ptype = pb.type;
-        int plen = 3 + pb.data.size();
+            unsigned int first_len = head < tail ? len : l->a2r_ring_size - head;
 
-        if (left < plen)
-            break;
+            p = ring_txn.add_segment(first_len + READ_SRAM_HDR_LEN);
+            put_sram_cmd_header(l, p, READ_SRAM_CMD, l->base_address + l->a2r_ring_offset + head);
 
-        send_buf[pos++] = pb.data.size();
-        send_buf[pos++] = ptype;
-        send_buf[pos++] = ch->channel_id;
-        memcpy(&send_buf[pos], &pb.data[0], pb.data.size());
-        pos += pb.data.size();
+            if (head >= tail && tail != 0)
+            {
+                p = ring_txn.add_segment(tail + READ_SRAM_HDR_LEN);
+                put_sram_cmd_header(l, p, READ_SRAM_CMD, l->base_address + l->a2r_ring_offset);
+            }
 
-        ch->packet_queue.pop_front();
+            spi_execute_transaction(l, &ring_txn);
 
-        send_queue.pop_front();
+            memcpy(recv_buf, &ring_txn.rx[0][READ_SRAM_HDR_LEN], first_len);
+            if (ring_txn.count == 2)
+                memcpy(&recv_buf[first_len], &ring_txn.rx[1][READ_SRAM_HDR_LEN], tail);
+        }
 
-        if (!ch->packet_queue.empty())
-            send_queue.push_back(ch);
-        else
-            remove_channel_if_not_associated_and_empty_pq(ch->channel_id);
+        parse_a2r_packets(l, len);
+        any_rcvd = true;
+    }
+
+    bool any_sent = flush_send_queue(l);
+
+    if (any_rcvd || any_sent)
+        write_channel_status(l);
 
-        left -= plen;
+    return true;
+}
+
+// Returns true if the Amiga had raised any events, so that the caller can
+// keep the busy-poll window open while the link is active.
+static bool handle_a314_irq(AmigaLink *l)
+{
+    uint8_t events;
+
+    if (l->have_base_address)
+    {
+        if (service_a314_irq_chained(l, &events))
+            return events != 0;
     }
+    else
+        events = spi_ack_irq(l);
 
-    int to_write = pos;
-    if (!to_write)
+    if (events == 0)
         return false;
 
-    uint8_t *p = send_buf;
-    int at_end = 256 - tail;
-    if (at_end < to_write)
+    if ((events & R_EVENT_BASE_ADDRESS) || !l->have_base_address)
     {
-        spi_write_mem(base_address + 260 + tail, p, at_end);
-        p += at_end;
-        to_write -= at_end;
-        tail = 0;
+        if (l->have_base_address && !l->channels.empty())
+            logger_info("Base address was updated while logical channels are open -- closing channels\n");
+
+        close_all_logical_channels(l);
+        read_base_address(l, (events & R_EVENT_BASE_ADDRESS) != 0);
     }
 
-    spi_write_mem(base_address + 260 + tail, p, to_write);
-    tail = (tail + to_write) & 255;
+    if (!l->have_base_address)
+        return true;
+
+    read_channel_status(l);
+
+    bool any_rcvd = receive_from_a2r(l);
+    bool any_sent = flush_send_queue(l);
+
+    if (any_rcvd || any_sent)
+        write_channel_status(l);
 
-    channel_status[R2A_TAIL_OFFSET] = tail;
-    channel_status_updated |= A_EVENT_R2A_TAIL;
     return true;
 }
 
-static void read_base_address()
+// Flushes the send queues of every link; returns true if anything went out
+// on any link.
+static bool flush_all_send_queues()
 {
-    have_base_address = false;
-
-    unsigned int ba1 = 0;
-    for (int i = 0; i < BASE_ADDRESS_LEN; i++)
-        ba1 |= spi_read_cmem(i) << (i * 4);
-
-    if ((ba1 & 1) == 1)
+    bool any = false;
+    for (auto &l : links)
     {
-        unsigned int ba2 = 0;
-        for (int i = 0; i < BASE_ADDRESS_LEN; i++)
-            ba2 |= spi_read_cmem(i) << (i * 4);
-
-        if (ba1 == ba2)
+        if (l.have_base_address && flush_send_queue(&l))
         {
-            have_base_address = true;
-            base_address = ba1 & ~1;
+            write_channel_status(&l);
+            any = true;
         }
     }
+    return any;
 }
 
-static void read_channel_status()
+static bool any_channels_open()
 {
-    spi_read_mem(base_address, 4);
-
-    for (int i = 0; i < 4; i++)
-        channel_status[i] = rx_buf[READ_SRAM_HDR_LEN + i];
-
-    channel_status_updated = 0;
+    for (auto &l : links)
+    {
+        if (!l.channels.empty())
+            return true;
+    }
+    return false;
 }
 
-static void write_channel_status()
+// Reads from the client like read(), but uses recvmsg() on unix domain
+// sockets so that a file descriptor passed with SCM_RIGHTS is captured and
+// kept until the accompanying MSG_SHM_SETUP_REQ message is processed.
+static ssize_t conn_read(ClientConnection *cc, uint8_t *dst, size_t len)
 {
-    if (channel_status_updated != 0)
+    if (!cc->is_unix)
+        return read(cc->fd, dst, len);
+
+    struct iovec iov;
+    iov.iov_base = dst;
+    iov.iov_len = len;
+
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+
+    ssize_t r = recvmsg(cc->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (r <= 0)
+        return r;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
     {
-        spi_write_mem(base_address + 2, &channel_status[R2A_TAIL_OFFSET], 2);
-        spi_write_cmem(A_EVENTS_ADDRESS, channel_status_updated);
-        channel_status_updated = 0;
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            if (cc->pending_shm_fd != -1)
+                close(cc->pending_shm_fd);
+            cc->pending_shm_fd = fd;
+        }
     }
+
+    return r;
 }
 
-static void close_all_logical_channels()
-{
-    send_queue.clear();
+// How much to ask for per conn_read() call when draining a client socket.
+#define CLIENT_RECV_CHUNK       65536
 
-    auto it = channels.begin();
-    while (it != channels.end())
+// Reads and dispatches everything the client has sent. Returns false if the
+// connection was closed. Also called directly when a paused connection is
+// resumed, since with edge-triggered epoll there is no notification to wait
+// for once the socket has been left undrained.
+static bool read_and_dispatch_client_messages(ClientConnection *cc)
+{
+    // Read in large chunks directly into the tail of the receive buffer
+    // until the socket is drained, so that a batch of small messages
+    // costs one syscall instead of two per message.
+    while (1)
     {
-        LogicalChannel &ch = *it;
+        size_t used = cc->rbuf.size();
+        cc->rbuf.resize(used + CLIENT_RECV_CHUNK);
 
-        if (ch.association != nullptr)
+        ssize_t r = conn_read(cc, &cc->rbuf[used], CLIENT_RECV_CHUNK);
+        if (r == -1)
         {
-            create_and_send_msg(ch.association, MSG_RESET, ch.stream_id, nullptr, 0);
-            remove_association(&ch);
+            cc->rbuf.resize(used);
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            logger_error("Read failed unexpectedly with errno = %d\n", errno);
+            exit(-1);
         }
 
-        it = channels.erase(it);
-    }
-}
+        if (r == 0)
+        {
+            logger_info("Received End-of-File on client connection\n");
+            close_and_remove_connection(cc);
+            return false;
+        }
 
-static void handle_a314_irq()
-{
-    uint8_t events = spi_ack_irq();
-    if (events == 0)
-        return;
+        cc->rbuf.resize(used + r);
+        cc->bytes_in += r;
+    }
 
-    if ((events & R_EVENT_BASE_ADDRESS) || !have_base_address)
+    // Dispatch every complete message; the payload is handed to the
+    // handler as a slice of the receive buffer, without copying it out.
+    size_t pos = 0;
+    while (cc->rbuf.size() - pos >= sizeof(MessageHeader))
     {
-        if (have_base_address && !channels.empty())
-            logger_info("Base address was updated while logical channels are open -- closing channels\n");
+        memcpy(&cc->header, &cc->rbuf[pos], sizeof(MessageHeader));
 
-        close_all_logical_channels();
-        read_base_address();
-    }
+        if (cc->rbuf.size() - pos < sizeof(MessageHeader) + cc->header.length)
+            break;
 
-    if (!have_base_address)
-        return;
+        logger_trace("header: length=%d, stream_id=%d, type=%d\n", cc->header.length, cc->header.stream_id, cc->header.type);
 
-    read_channel_status();
+        cc->payload = cc->rbuf.data() + pos + sizeof(MessageHeader);
+        handle_received_message(cc);
 
-    bool any_rcvd = receive_from_a2r();
-    bool any_sent = flush_send_queue();
+        pos += sizeof(MessageHeader) + cc->header.length;
+    }
 
-    if (any_rcvd || any_sent)
-        write_channel_status();
+    if (pos != 0)
+        cc->rbuf.erase(cc->rbuf.begin(), cc->rbuf.begin() + pos);
+
+    // If the client is writing to a channel faster than the Amiga drains it,
+    // stop reading from the socket; the backpressure then reaches the client
+    // through its own socket buffer filling up.
+    for (auto ch : cc->associations)
+    {
+        if (ch->queued_bytes > PKT_QUEUE_HIGH_WATER)
+        {
+            cc->recv_paused = true;
+            break;
+        }
+    }
+
+    return true;
 }
 
 static void handle_client_connection_event(ClientConnection *cc, struct epoll_event *ev)
@@ -1252,108 +3796,62 @@ static void handle_client_connection_event(ClientConnection *cc, struct epoll_ev
         return;
     }
 
-    if (ev->events & EPOLLIN)
+    if ((ev->events & EPOLLIN) && !cc->recv_paused)
+    {
+        if (!read_and_dispatch_client_messages(cc))
+            return;
+    }
+
+    if (ev->events & EPOLLOUT)
     {
-        while (1)
+        if (drain_message_queue(cc) != 0)
         {
-            int left;
-            uint8_t *dst;
+            close_and_remove_connection(cc);
+            return;
+        }
+    }
+}
 
-            if (cc->payload.empty())
-            {
-                left = sizeof(MessageHeader) - cc->bytes_read;
-                dst = (uint8_t *)&(cc->header) + cc->bytes_read;
-            }
-            else
-            {
-                left = cc->header.length - cc->bytes_read;
-                dst = &cc->payload[cc->bytes_read];
-            }
+// Resumes reading from paused connections whose channels have drained below
+// the low water mark. Returns true if any connection was resumed, in which
+// case newly enqueued packets may need to be flushed towards the Amiga.
+static bool resume_paused_connections()
+{
+    bool any_resumed = false;
 
-            ssize_t r = read(cc->fd, dst, left);
-            if (r == -1)
-            {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                    break;
+    auto it = connections.begin();
+    while (it != connections.end())
+    {
+        ClientConnection *cc = &(*it);
+        it++;
 
-                logger_error("Read failed unexpectedly with errno = %d\n", errno);
-                exit(-1);
-            }
+        if (!cc->recv_paused)
+            continue;
 
-            if (r == 0)
-            {
-                logger_info("Received End-of-File on client connection\n");
-                close_and_remove_connection(cc);
-                return;
-            }
-            else
+        bool above_low_water = false;
+        for (auto ch : cc->associations)
+        {
+            if (ch->queued_bytes > PKT_QUEUE_LOW_WATER)
             {
-                cc->bytes_read += r;
-                left -= r;
-                if (!left)
-                {
-                    if (cc->payload.empty())
-                    {
-                        if (cc->header.length == 0)
-                        {
-                            logger_trace("header: length=%d, stream_id=%d, type=%d\n", cc->header.length, cc->header.stream_id, cc->header.type);
-                            handle_received_message(cc);
-                        }
-                        else
-                        {
-                            cc->payload.resize(cc->header.length);
-                        }
-                    }
-                    else
-                    {
-                        logger_trace("header: length=%d, stream_id=%d, type=%d\n", cc->header.length, cc->header.stream_id, cc->header.type);
-                        handle_received_message(cc);
-                        cc->payload.clear();
-                    }
-                    cc->bytes_read = 0;
-                }
+                above_low_water = true;
+                break;
             }
         }
-    }
-
-    if (ev->events & EPOLLOUT)
-    {
-        while (!cc->message_queue.empty())
-        {
-            MessageBuffer &mb = cc->message_queue.front();
 
-            int left = mb.data.size() - mb.pos;
-            uint8_t *src = &mb.data[mb.pos];
-            ssize_t r = write(cc->fd, src, left);
-            if (r == -1)
-            {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                    break;
-                else if (errno == ECONNRESET)
-                {
-                    close_and_remove_connection(cc);
-                    return;
-                }
-                else
-                {
-                    logger_error("Write failed unexpectedly with errno = %d\n", errno);
-                    exit(-1);
-                }
-            }
+        if (above_low_water)
+            continue;
 
-            mb.pos += r;
-            if (r == left)
-                cc->message_queue.pop_front();
-        }
+        cc->recv_paused = false;
+        any_resumed = true;
+        read_and_dispatch_client_messages(cc);
     }
+
+    return any_resumed;
 }
 
-static void handle_server_socket_ready()
+static void handle_listen_socket_ready(int listen_fd, bool is_unix)
 {
-    struct sockaddr_in address;
-    int alen = sizeof(struct sockaddr_in);
-
-    int fd = accept(server_socket, (struct sockaddr *)&address, (socklen_t *)&alen);
+    int fd = accept(listen_fd, nullptr, nullptr);
     if (fd < 0)
     {
         logger_error("Accept failed unexpectedly with errno = %d\n", errno);
@@ -1374,19 +3872,20 @@ static void handle_server_socket_ready()
         exit(-1);
     }
 
-    int flag = 1;
-    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+    if (!is_unix)
+    {
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+    }
 
     connections.emplace_back();
 
     ClientConnection &cc = connections.back();
-    cc.fd = fd;
-    cc.next_stream_id = 1;
-    cc.bytes_read = 0;
+    init_connection(cc, fd, is_unix);
 
     struct epoll_event ev;
     ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-    ev.data.fd = fd;
+    ev.data.ptr = &cc;
     if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
     {
         logger_error("epoll_ctl() failed unexpectedly with errno = %d\n", errno);
@@ -1394,11 +3893,196 @@ static void handle_server_socket_ready()
     }
 }
 
+// While a channel is actively streaming it is cheaper to busy-poll the
+// Amiga's event register than to sleep in epoll_pwait() and take a GPIO
+// interrupt per ring update. Each sign of link activity extends the busy-poll
+// window; when the window expires without activity we fall back to the
+// interrupt-driven path, so an idle link costs no CPU.
+#define BUSY_POLL_WINDOW_NS 2000000ULL
+
+static uint64_t busy_poll_until = 0;
+
+static uint64_t now_monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void mark_link_activity()
+{
+    busy_poll_until = now_monotonic_ns() + BUSY_POLL_WINDOW_NS;
+}
+
+// Builds the JSON stats dump. The whole dump is a few kilobytes at most, so
+// it is written to the accepted connection in one go and the connection is
+// closed; readers do "nc -U /run/a314/a314d-stats.sock".
+static std::string build_stats_json()
+{
+    char buf[256];
+    std::string json;
+
+    uint64_t uptime_ns = now_monotonic_ns() - link_stats.start_time_ns;
+
+    bool amiga_present = false;
+    for (auto &l : links)
+        amiga_present |= l.have_base_address;
+
+    snprintf(buf, sizeof(buf),
+        "{\"uptime_seconds\":%llu,\"amiga_present\":%d,",
+        (unsigned long long)(uptime_ns / 1000000000ULL), amiga_present ? 1 : 0);
+    json += buf;
+
+    json += "\"links\":[";
+    bool first_link = true;
+    for (auto &l : links)
+    {
+        snprintf(buf, sizeof(buf),
+            "%s{\"index\":%d,\"spidev\":\"%s\",\"irq_gpio\":%d,"
+            "\"amiga_present\":%d,\"speed_hz\":%u}",
+            first_link ? "" : ",", l.index, l.spidev_path.c_str(), l.irq_gpio,
+            l.have_base_address ? 1 : 0, l.speed);
+        json += buf;
+        first_link = false;
+    }
+    json += "],";
+
+    snprintf(buf, sizeof(buf),
+        "\"link\":{\"irq_count\":%llu,\"a2r_ring_bytes\":%llu,\"r2a_ring_bytes\":%llu,"
+        "\"spi_transfers\":%llu,\"spi_bytes\":%llu,\"crc_errors\":%llu,",
+        (unsigned long long)link_stats.irq_count,
+        (unsigned long long)link_stats.a2r_ring_bytes,
+        (unsigned long long)link_stats.r2a_ring_bytes,
+        (unsigned long long)link_stats.spi_transfers.load(std::memory_order_relaxed),
+        (unsigned long long)link_stats.spi_bytes.load(std::memory_order_relaxed),
+        (unsigned long long)link_stats.crc_errors.load(std::memory_order_relaxed));
+    json += buf;
+
+    json += "\"irq_to_flush_le_us\":[";
+    for (int i = 0; i < IRQ_LATENCY_BUCKETS; i++)
+    {
+        snprintf(buf, sizeof(buf), "%s[%llu,%llu]", i != 0 ? "," : "",
+            (unsigned long long)(1ULL << i),
+            (unsigned long long)link_stats.irq_latency[i]);
+        json += buf;
+    }
+    json += "]},";
+
+    json += "\"services\":[";
+    bool first = true;
+    for (auto &cs : service_stats)
+    {
+        snprintf(buf, sizeof(buf),
+            "%s{\"name\":\"%s\",\"streams_opened\":%llu,"
+            "\"packets_to_ami\":%llu,\"bytes_to_ami\":%llu,"
+            "\"packets_from_ami\":%llu,\"bytes_from_ami\":%llu}",
+            first ? "" : ",", cs.service_name.c_str(),
+            (unsigned long long)cs.streams_opened,
+            (unsigned long long)cs.packets_to_ami,
+            (unsigned long long)cs.bytes_to_ami,
+            (unsigned long long)cs.packets_from_ami,
+            (unsigned long long)cs.bytes_from_ami);
+        json += buf;
+        first = false;
+    }
+    json += "],";
+
+    json += "\"channels\":[";
+    first = true;
+    for (auto &l : links)
+    {
+        for (auto &ch : l.channels)
+        {
+            snprintf(buf, sizeof(buf),
+                "%s{\"link\":%d,\"channel_id\":%d,\"service\":\"%s\",\"priority\":%d,"
+                "\"stream_id\":%d,\"queue_depth\":%d,\"queued_bytes\":%d}",
+                first ? "" : ",", l.index, ch.channel_id,
+                ch.stats != nullptr ? ch.stats->service_name.c_str() : "",
+                ch.priority, ch.stream_id,
+                (int)ch.packet_queue.size(), (int)ch.queued_bytes);
+            json += buf;
+            first = false;
+        }
+    }
+    json += "],";
+
+    json += "\"connections\":[";
+    first = true;
+    for (auto &cc : connections)
+    {
+        std::string names;
+        for (auto &srv : services)
+        {
+            if (srv.second == &cc)
+            {
+                if (!names.empty())
+                    names += ",";
+                names += "\"" + srv.first + "\"";
+            }
+        }
+
+        snprintf(buf, sizeof(buf),
+            "%s{\"fd\":%d,\"unix\":%d,\"services\":[%s],"
+            "\"bytes_in\":%llu,\"bytes_out\":%llu,"
+            "\"messages_in\":%llu,\"messages_out\":%llu,"
+            "\"streams\":%d,\"queue_depth\":%d}",
+            first ? "" : ",", cc.fd, cc.is_unix ? 1 : 0, names.c_str(),
+            (unsigned long long)cc.bytes_in,
+            (unsigned long long)cc.bytes_out,
+            (unsigned long long)cc.messages_in,
+            (unsigned long long)cc.messages_out,
+            (int)cc.associations.size(), (int)cc.message_queue.size());
+        json += buf;
+        first = false;
+    }
+    json += "]}\n";
+
+    return json;
+}
+
+static void handle_stats_socket_ready()
+{
+    int fd = accept(stats_socket, nullptr, nullptr);
+    if (fd < 0)
+        return;
+
+    std::string json = build_stats_json();
+
+    // The dump is far smaller than the socket send buffer, so a single
+    // non-blocking send either takes everything or the reader is broken.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    send(fd, json.data(), json.size(), MSG_NOSIGNAL);
+    close(fd);
+}
+
+// Releases the staged frames of all paced channels into the send queues.
+// The frame goes to the front of its priority class so it is not interleaved
+// with traffic other channels queued since the last tick.
+static void handle_pace_tick()
+{
+    for (auto &l : links)
+    {
+        for (auto &ch : l.channels)
+        {
+            if (!ch.paced || ch.frame_queue.empty())
+                continue;
+
+            if (ch.packet_queue.empty())
+                l.send_queues[ch.priority].push_front(&ch);
+
+            ch.packet_queue.splice(ch.packet_queue.end(), ch.frame_queue);
+        }
+    }
+}
+
 static void main_loop()
 {
-    handle_a314_irq();
+    link_stats.start_time_ns = now_monotonic_ns();
+
+    for (auto &l : links)
+        handle_a314_irq(&l);
+    flush_client_queues();
 
-    bool first_gpio_event = true;
     bool shutting_down = false;
     bool done = false;
 
@@ -1406,6 +4090,9 @@ static void main_loop()
     {
         struct epoll_event ev;
         int timeout = shutting_down ? 10000 : -1;
+        bool busy_polling = !shutting_down && now_monotonic_ns() < busy_poll_until;
+        if (busy_polling)
+            timeout = 0;
         int n = epoll_pwait(epfd, &ev, 1, timeout, &original_sigset);
         if (n == -1)
         {
@@ -1414,14 +4101,17 @@ static void main_loop()
                 logger_info("Received SIGTERM\n");
 
                 shutdown_server_socket();
+                shutdown_unix_socket();
+                shutdown_stats_socket();
+
+                respawn_warm_services = false;
 
                 while (!connections.empty())
                     close_and_remove_connection(&connections.front());
 
-                if (flush_send_queue())
-                    write_channel_status();
+                flush_all_send_queues();
 
-                if (!channels.empty())
+                if (any_channels_open())
                     shutting_down = true;
                 else
                     done = true;
@@ -1436,6 +4126,14 @@ static void main_loop()
         {
             if (shutting_down)
                 done = true;
+            else if (busy_polling)
+            {
+                for (auto &l : links)
+                {
+                    if (handle_a314_irq(&l))
+                        mark_link_activity();
+                }
+            }
             else
             {
                 logger_error("epoll_pwait returned 0 which is unexpected since no timeout was set\n");
@@ -1444,61 +4142,92 @@ static void main_loop()
         }
         else
         {
-            if (ev.data.fd == gpio_fd)
+            AmigaLink *event_link = nullptr;
+            for (auto &l : links)
             {
-                logger_trace("Epoll event: gpio is ready, events = %d\n", ev.events);
+                if (ev.data.ptr == &l)
+                {
+                    event_link = &l;
+                    break;
+                }
+            }
 
-                lseek(gpio_fd, 0, SEEK_SET);
+            if (event_link != nullptr)
+            {
+                logger_trace("Epoll event: gpio is ready, events = %d\n", ev.events);
 
-                char buf;
-                if (read(gpio_fd, &buf, 1) != 1)
+                struct gpio_v2_line_event event;
+                if (read(event_link->gpio_fd, &event, sizeof(event)) != sizeof(event))
                 {
-                    logger_error("Read from GPIO value file, and unexpectedly didn't return 1 byte\n");
+                    logger_error("Read from GPIO line event fd unexpectedly didn't return a full event\n");
                     exit(-1);
                 }
 
-                if (first_gpio_event)
-                {
-                    logger_debug("Received first GPIO event, which is ignored\n");
-                    first_gpio_event = false;
-                }
-                else
-                {
-                    logger_trace("GPIO interupted\n");
-                    handle_a314_irq();
-                    if (shutting_down && channels.empty())
-                        done = true;
-                }
+                if (handle_a314_irq(event_link))
+                    mark_link_activity();
+
+                link_stats.irq_count++;
+                record_irq_latency(now_monotonic_ns() - event.timestamp_ns);
+                if (shutting_down && !any_channels_open())
+                    done = true;
+            }
+            else if (ev.data.ptr == &spi_complete_efd)
+            {
+                logger_trace("Epoll event: spi job completed, events = %d\n", ev.events);
+                handle_spi_job_completions();
             }
-            else if (ev.data.fd == server_socket)
+            else if (ev.data.ptr == &server_socket)
             {
                 logger_trace("Epoll event: server socket is ready, events = %d\n", ev.events);
-                handle_server_socket_ready();
+                handle_listen_socket_ready(server_socket, false);
             }
-            else
+            else if (ev.data.ptr == &unix_socket)
             {
-                logger_trace("Epoll event: client socket is ready, events = %d\n", ev.events);
-
-                auto it = connections.begin();
-                for (; it != connections.end(); it++)
-                {
-                    if (it->fd == ev.data.fd)
-                        break;
-                }
+                logger_trace("Epoll event: unix socket is ready, events = %d\n", ev.events);
+                handle_listen_socket_ready(unix_socket, true);
+            }
+            else if (ev.data.ptr == &stats_socket)
+            {
+                logger_trace("Epoll event: stats socket is ready, events = %d\n", ev.events);
+                handle_stats_socket_ready();
+            }
+            else if (ev.data.ptr == &pace_timer_fd)
+            {
+                logger_trace("Epoll event: frame tick, events = %d\n", ev.events);
 
-                if (it == connections.end())
+                uint64_t expirations;
+                if (read(pace_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
                 {
-                    logger_error("Got notified about an event on a client connection that supposedly isn't currently open\n");
+                    logger_error("Read from frame tick timer fd unexpectedly didn't return a full count\n");
                     exit(-1);
                 }
 
-                ClientConnection *cc = &(*it);
+                handle_pace_tick();
+
+                if (flush_all_send_queues())
+                    mark_link_activity();
+            }
+            else
+            {
+                logger_trace("Epoll event: client socket is ready, events = %d\n", ev.events);
+
+                ClientConnection *cc = (ClientConnection *)ev.data.ptr;
                 handle_client_connection_event(cc, &ev);
 
-                if (flush_send_queue())
-                    write_channel_status();
+                if (flush_all_send_queues())
+                    mark_link_activity();
             }
         }
+
+        // Paused connections are not re-armed by epoll; resume the ones
+        // whose channels have drained and flush whatever they produced.
+        if (resume_paused_connections())
+        {
+            if (flush_all_send_queues())
+                mark_link_activity();
+        }
+
+        flush_client_queues();
     }
 }
 
@@ -1512,7 +4241,10 @@ int main(int argc, char **argv)
     load_config_file(conf_filename.c_str());
 
     if (init_driver() == 0)
+    {
+        prewarm_services();
         main_loop();
+    }
     shutdown_driver();
     return 0;
 }
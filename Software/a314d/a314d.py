@@ -21,6 +21,10 @@ MSG_CONNECT_RESPONSE    = 10
 MSG_DATA                = 11
 MSG_EOS                 = 12
 MSG_RESET               = 13
+MSG_READ_MEM_STREAM     = 17
+MSG_WRITE_MEM_STREAM    = 18
+MSG_READ_MEM_SG         = 19
+MSG_WRITE_MEM_SG        = 20
 
 def wait_for_msg():
     header = b''
@@ -67,6 +71,54 @@ def write_mem(address, data):
         logger.error('Expected MSG_WRITE_MEM_RES but got %s. Shutting down.', ptype)
         exit(-1)
 
+def read_mem_stream(address, length):
+    # a314d pipelines the chunked SPI transfers itself and streams the
+    # chunks back as MSG_READ_MEM_RES messages.
+    m = struct.pack('=IIBII', 8, 0, MSG_READ_MEM_STREAM, address, length)
+    drv.sendall(m)
+    payload = b''
+    while len(payload) < length:
+        _, ptype, chunk = wait_for_msg()
+        if ptype != MSG_READ_MEM_RES:
+            logger.error('Expected MSG_READ_MEM_RES but got %s. Shutting down.', ptype)
+            exit(-1)
+        payload += chunk
+    return payload
+
+def write_mem_stream(address, data):
+    m = struct.pack('=IIBI', 4 + len(data), 0, MSG_WRITE_MEM_STREAM, address) + data
+    drv.sendall(m)
+    _, ptype, _ = wait_for_msg()
+    if ptype != MSG_WRITE_MEM_RES:
+        logger.error('Expected MSG_WRITE_MEM_RES but got %s. Shutting down.', ptype)
+        exit(-1)
+
+def read_mem_sg(segments):
+    # segments is a list of (address, length) pairs; a314d resolves them in
+    # one pass over the SPI link and returns the regions concatenated in
+    # request order.
+    m = struct.pack('=IIB', 8 * len(segments), 0, MSG_READ_MEM_SG)
+    for address, length in segments:
+        m += struct.pack('=II', address, length)
+    drv.sendall(m)
+    _, ptype, payload = wait_for_msg()
+    if ptype != MSG_READ_MEM_RES:
+        logger.error('Expected MSG_READ_MEM_RES but got %s. Shutting down.', ptype)
+        exit(-1)
+    return payload
+
+def write_mem_sg(segments):
+    # segments is a list of (address, data) pairs.
+    body = b''
+    for address, data in segments:
+        body += struct.pack('=II', address, len(data)) + data
+    m = struct.pack('=IIB', len(body), 0, MSG_WRITE_MEM_SG) + body
+    drv.sendall(m)
+    _, ptype, _ = wait_for_msg()
+    if ptype != MSG_WRITE_MEM_RES:
+        logger.error('Expected MSG_WRITE_MEM_RES but got %s. Shutting down.', ptype)
+        exit(-1)
+
 def send_connect_response(stream_id, result):
     m = struct.pack('=IIBB', 1, stream_id, MSG_CONNECT_RESPONSE, result)
     drv.sendall(m)
@@ -87,11 +139,17 @@ def set_on_demand_fd(fd):
     global drv
     drv = socket.socket(fileno=fd)
 
+UNIX_SOCKET_PATH = '/run/a314/a314d.sock'
+
 def connect_a314d(service_name):
     global drv
-    drv = socket.socket()
-    drv.connect(('localhost', 7110))
-    drv.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    try:
+        drv = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        drv.connect(UNIX_SOCKET_PATH)
+    except OSError:
+        drv = socket.socket()
+        drv.connect(('localhost', 7110))
+        drv.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
 
     send_register_req(service_name)
     _, _, payload = wait_for_msg()
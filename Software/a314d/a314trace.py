@@ -0,0 +1,90 @@
+#!/usr/bin/python3
+# -*- coding: utf-8 -*-
+
+# Decoder for the binary packet traces written by a314d when a
+# "trace <filename>" line is present in a314d.conf.
+#
+# Usage: a314trace.py <trace-file>
+#
+# Each line of output is one packet crossing the link:
+#
+#   <time>  <+delta>  <dir>  ch=<channel>  <ptype>  len=<length>  <payload prefix>
+#
+# where time is seconds since the first record and dir is A2R (Amiga to
+# Raspberry) or R2A. For PKT_CONNECT the payload prefix is the service name,
+# so the per-channel flows can be followed from connect to reset.
+
+import struct
+import sys
+
+MAGIC = b'A314TRC1'
+
+PKT_NAMES = {
+    3: 'SETTINGS',
+    4: 'CONNECT',
+    5: 'CONNECT_RESPONSE',
+    6: 'DATA',
+    7: 'EOS',
+    8: 'RESET',
+}
+
+DIR_NAMES = ['A2R', 'R2A']
+
+
+def main():
+    if len(sys.argv) != 2:
+        print('Usage: a314trace.py <trace-file>', file=sys.stderr)
+        sys.exit(1)
+
+    with open(sys.argv[1], 'rb') as f:
+        header = f.read(16)
+        if len(header) != 16 or header[0:8] != MAGIC:
+            print('Not an a314d trace file', file=sys.stderr)
+            sys.exit(1)
+
+        (record_size,) = struct.unpack('<I', header[8:12])
+
+        # Channels seen connecting, so DATA packets can be attributed.
+        channel_services = {}
+
+        first_ts = None
+        prev_ts = None
+
+        while True:
+            record = f.read(record_size)
+            if len(record) < record_size:
+                break
+
+            (ts, direction, ptype, channel_id, length) = \
+                struct.unpack('<QBBBxH', record[0:14])
+            payload = record[14:14 + min(length, record_size - 14)]
+
+            if first_ts is None:
+                first_ts = ts
+                prev_ts = ts
+
+            ptype_name = PKT_NAMES.get(ptype, str(ptype))
+
+            if ptype == 4:
+                channel_services[channel_id] = payload.decode('latin-1')
+            service = channel_services.get(channel_id, '?')
+
+            if ptype == 4:
+                detail = payload.decode('latin-1')
+            elif length != 0:
+                detail = payload.hex()
+                if length > len(payload):
+                    detail += '..'
+            else:
+                detail = ''
+
+            print('%12.6f  %+10.6f  %s  ch=%-3d %-16s %-12s len=%-3d %s' % (
+                (ts - first_ts) / 1e9, (ts - prev_ts) / 1e9,
+                DIR_NAMES[direction] if direction < 2 else str(direction),
+                channel_id, ptype_name, service, length, detail))
+
+            prev_ts = ts
+
+
+if __name__ == '__main__':
+    main()
@@ -31,29 +31,55 @@
 
 #define SysBase (*(struct ExecBase **)4)
 
+static UBYTE *a2r_buffer(struct ComArea *ca)
+{
+	return ca->buffers;
+}
+
+static UBYTE *r2a_buffer(struct ComArea *ca)
+{
+	return ca->buffers + ca->a2r_size;
+}
+
 static int used_in_r2a(struct ComArea *ca)
 {
-	return (ca->r2a_tail - ca->r2a_head) & 255;
+	return (ca->r2a_tail - ca->r2a_head) & (UWORD)(ca->r2a_size - 1);
 }
 
 static int used_in_a2r(struct ComArea *ca)
 {
-	return (ca->a2r_tail - ca->a2r_head) & 255;
+	return (ca->a2r_tail - ca->a2r_head) & (UWORD)(ca->a2r_size - 1);
 }
 
-static BOOL room_in_a2r(struct ComArea *ca, int len)
+static BOOL room_in_a2r(struct A314Device *dev, int len)
 {
-	return used_in_a2r(ca) + 3 + len <= 255;
+	struct ComArea *ca = dev->ca;
+	int hdr = dev->a2r_ext ? 4 : 3;
+	return used_in_a2r(ca) + hdr + len <= (int)(ca->a2r_size - 1);
 }
 
-static void append_a2r_packet(struct ComArea *ca, UBYTE type, UBYTE stream_id, UBYTE length, UBYTE *data)
+static void append_a2r_packet(struct A314Device *dev, UBYTE type, UBYTE stream_id, UWORD length, UBYTE *data)
 {
-	UBYTE index = ca->a2r_tail;
-	ca->a2r_buffer[index++] = length;
-	ca->a2r_buffer[index++] = type;
-	ca->a2r_buffer[index++] = stream_id;
+	struct ComArea *ca = dev->ca;
+	UBYTE *buf = a2r_buffer(ca);
+	UWORD mask = ca->a2r_size - 1;
+	UWORD index = ca->a2r_tail;
+	if (dev->a2r_ext)
+	{
+		buf[index] = (UBYTE)(length >> 8);
+		index = (index + 1) & mask;
+	}
+	buf[index] = (UBYTE)length;
+	index = (index + 1) & mask;
+	buf[index] = type;
+	index = (index + 1) & mask;
+	buf[index] = stream_id;
+	index = (index + 1) & mask;
 	for (int i = 0; i < (int)length; i++)
-		ca->a2r_buffer[index++] = *data++;
+	{
+		buf[index] = *data++;
+		index = (index + 1) & mask;
+	}
 	ca->a2r_tail = index;
 }
 
@@ -113,9 +139,9 @@ static void close_socket(struct A314Device *dev, struct Socket *s, BOOL should_s
 
 	if (should_send_reset)
 	{
-		if (dev->send_queue_head == NULL && room_in_a2r(dev->ca, 0))
+		if (dev->send_queue_head == NULL && room_in_a2r(dev, 0))
 		{
-			append_a2r_packet(dev->ca, PKT_RESET, s->stream_id, 0, NULL);
+			append_a2r_packet(dev, PKT_RESET, s->stream_id, 0, NULL);
 		}
 		else
 		{
@@ -129,7 +155,7 @@ static void close_socket(struct A314Device *dev, struct Socket *s, BOOL should_s
 		delete_socket(dev, s);
 }
 
-static void handle_pkt_connect_response(struct A314Device *dev, UBYTE offset, UBYTE length, struct Socket *s)
+static void handle_pkt_connect_response(struct A314Device *dev, UWORD offset, UWORD length, struct Socket *s)
 {
 	debug_printf("Received a CONNECT RESPONSE packet from rpi\n");
 
@@ -145,7 +171,7 @@ static void handle_pkt_connect_response(struct A314Device *dev, UBYTE offset, UB
 	}
 	else
 	{
-		UBYTE result = dev->ca->r2a_buffer[offset];
+		UBYTE result = r2a_buffer(dev->ca)[offset];
 		if (result == 0)
 		{
 			struct A314_IORequest *ior = s->pending_connect;
@@ -167,10 +193,13 @@ static void handle_pkt_connect_response(struct A314Device *dev, UBYTE offset, UB
 	}
 }
 
-static void handle_pkt_data(struct A314Device *dev, UBYTE offset, UBYTE length, struct Socket *s)
+static void handle_pkt_data(struct A314Device *dev, UWORD offset, UWORD length, struct Socket *s)
 {
 	debug_printf("Received a DATA packet from rpi\n");
 
+	UBYTE *buf = r2a_buffer(dev->ca);
+	UWORD mask = dev->ca->r2a_size - 1;
+
 	if (s->pending_read != NULL)
 	{
 		struct A314_IORequest *ior = s->pending_read;
@@ -179,10 +208,12 @@ static void handle_pkt_data(struct A314Device *dev, UBYTE offset, UBYTE length,
 			close_socket(dev, s, TRUE);
 		else
 		{
-			UBYTE *r2a_buffer = dev->ca->r2a_buffer;
 			UBYTE *dst = ior->a314_Buffer;
 			for (int i = 0; i < length; i++)
-				*dst++ = r2a_buffer[offset++];
+			{
+				*dst++ = buf[offset];
+				offset = (offset + 1) & mask;
+			}
 
 			ior->a314_Length = length;
 			ior->a314_Request.io_Error = A314_READ_OK;
@@ -197,10 +228,12 @@ static void handle_pkt_data(struct A314Device *dev, UBYTE offset, UBYTE length,
 		qd->next = NULL,
 		qd->length = length;
 
-		UBYTE *r2a_buffer = dev->ca->r2a_buffer;
 		UBYTE *dst = qd->data;
 		for (int i = 0; i < length; i++)
-			*dst++ = r2a_buffer[offset++];
+		{
+			*dst++ = buf[offset];
+			offset = (offset + 1) & mask;
+		}
 
 		if (s->rq_head == NULL)
 			s->rq_head = qd;
@@ -232,8 +265,32 @@ static void handle_pkt_eos(struct A314Device *dev, struct Socket *s)
 	}
 }
 
-static void handle_r2a_packet(struct A314Device *dev, UBYTE type, UBYTE stream_id, UBYTE offset, UBYTE length)
+static void handle_pkt_settings(struct A314Device *dev, UWORD offset, UWORD length)
+{
+	debug_printf("Received a SETTINGS packet from rpi\n");
+
+	if (length < 1 || dev->r2a_ext)
+		return;
+
+	UBYTE format = r2a_buffer(dev->ca)[offset];
+	if (!(format & FRAME_FORMAT_EXT16))
+		return;
+
+	// a314d acknowledged the extended framing offer. Packets after this one
+	// in the r2a ring use the extended format; the a2r direction switches
+	// once the confirm packet has been appended by handle_room_in_a2r().
+	dev->r2a_ext = TRUE;
+	dev->send_settings_confirm = TRUE;
+}
+
+static void handle_r2a_packet(struct A314Device *dev, UBYTE type, UBYTE stream_id, UWORD offset, UWORD length)
 {
+	if (type == PKT_SETTINGS)
+	{
+		handle_pkt_settings(dev, offset, length);
+		return;
+	}
+
 	struct Socket *s = find_socket_by_stream_id(dev, stream_id);
 
 	if (s != NULL && type == PKT_RESET)
@@ -267,31 +324,67 @@ static void handle_r2a_packet(struct A314Device *dev, UBYTE type, UBYTE stream_i
 static void handle_packets_received_r2a(struct A314Device *dev)
 {
 	struct ComArea *ca = dev->ca;
+	UBYTE *buf = r2a_buffer(ca);
+	UWORD mask = ca->r2a_size - 1;
 
 	while (used_in_r2a(ca) != 0)
 	{
-		UBYTE index = ca->r2a_head;
+		UWORD index = ca->r2a_head;
 
-		UBYTE len = ca->r2a_buffer[index++];
-		UBYTE type = ca->r2a_buffer[index++];
-		UBYTE stream_id = ca->r2a_buffer[index++];
+		// The frame format is re-checked per packet since a PKT_SETTINGS
+		// ack switches it for the rest of the ring contents.
+		UWORD len;
+		if (dev->r2a_ext)
+		{
+			len = buf[index] << 8;
+			index = (index + 1) & mask;
+			len |= buf[index];
+			index = (index + 1) & mask;
+		}
+		else
+		{
+			len = buf[index];
+			index = (index + 1) & mask;
+		}
+		UBYTE type = buf[index];
+		index = (index + 1) & mask;
+		UBYTE stream_id = buf[index];
+		index = (index + 1) & mask;
 
 		handle_r2a_packet(dev, type, stream_id, index, len);
 
-		index += len;
-		ca->r2a_head = index;
+		ca->r2a_head = (index + len) & mask;
 	}
 }
 
 static void handle_room_in_a2r(struct A314Device *dev)
 {
-	struct ComArea *ca = dev->ca;
+	// A pending PKT_SETTINGS confirm goes out ahead of any queued channel
+	// packets; it is the last legacy-format packet in the a2r ring.
+	if (dev->send_settings_confirm && room_in_a2r(dev, 1))
+	{
+		UBYTE format = FRAME_FORMAT_EXT16;
+		append_a2r_packet(dev, PKT_SETTINGS, 0, 1, &format);
+
+		dev->send_settings_confirm = FALSE;
+		dev->a2r_ext = TRUE;
+
+		// Record the negotiated format in CMEM so that a restarted
+		// a314d, which adopts the published base address without a
+		// new settings handshake, keeps framing packets the same way.
+		write_cmem_safe(FRAME_FORMAT_ADDRESS, FRAME_FORMAT_EXT16);
+
+		ULONG a2r_bytes = dev->ca->a2r_size ? dev->ca->a2r_size : 65536;
+		dev->max_data_len = EXT_FRAME_MAX_DATA;
+		if ((ULONG)dev->max_data_len > a2r_bytes - 8)
+			dev->max_data_len = a2r_bytes - 8;
+	}
 
 	while (dev->send_queue_head != NULL)
 	{
 		struct Socket *s = dev->send_queue_head;
 
-		if (!room_in_a2r(ca, s->send_queue_required_length))
+		if (!room_in_a2r(dev, s->send_queue_required_length))
 			break;
 
 		remove_from_send_queue(dev, s);
@@ -300,7 +393,7 @@ static void handle_room_in_a2r(struct A314Device *dev)
 		{
 			struct A314_IORequest *ior = s->pending_connect;
 			int len = ior->a314_Length;
-			append_a2r_packet(ca, PKT_CONNECT, s->stream_id, (UBYTE)len, ior->a314_Buffer);
+			append_a2r_packet(dev, PKT_CONNECT, s->stream_id, (UWORD)len, ior->a314_Buffer);
 		}
 		else if (s->pending_write != NULL)
 		{
@@ -309,7 +402,7 @@ static void handle_room_in_a2r(struct A314Device *dev)
 
 			if (ior->a314_Request.io_Command == A314_WRITE)
 			{
-				append_a2r_packet(ca, PKT_DATA, s->stream_id, (UBYTE)len, ior->a314_Buffer);
+				append_a2r_packet(dev, PKT_DATA, s->stream_id, (UWORD)len, ior->a314_Buffer);
 
 				ior->a314_Request.io_Error = A314_WRITE_OK;
 				ReplyMsg((struct Message *)ior);
@@ -318,7 +411,7 @@ static void handle_room_in_a2r(struct A314Device *dev)
 			}
 			else // A314_EOS
 			{
-				append_a2r_packet(ca, PKT_EOS, s->stream_id, 0, NULL);
+				append_a2r_packet(dev, PKT_EOS, s->stream_id, 0, NULL);
 
 				ior->a314_Request.io_Error = A314_EOS_OK;
 				ReplyMsg((struct Message *)ior);
@@ -333,7 +426,7 @@ static void handle_room_in_a2r(struct A314Device *dev)
 		}
 		else if (s->flags & SOCKET_SHOULD_SEND_RESET)
 		{
-			append_a2r_packet(ca, PKT_RESET, s->stream_id, 0, NULL);
+			append_a2r_packet(dev, PKT_RESET, s->stream_id, 0, NULL);
 			delete_socket(dev, s);
 		}
 		else
@@ -352,7 +445,7 @@ static void handle_app_connect(struct A314Device *dev, struct A314_IORequest *io
 		ior->a314_Request.io_Error = A314_CONNECT_SOCKET_IN_USE;
 		ReplyMsg((struct Message *)ior);
 	}
-	else if (ior->a314_Length + 3 > 255)
+	else if (ior->a314_Length > dev->max_data_len)
 	{
 		ior->a314_Request.io_Error = A314_CONNECT_RESET;
 		ReplyMsg((struct Message *)ior);
@@ -365,9 +458,9 @@ static void handle_app_connect(struct A314Device *dev, struct A314_IORequest *io
 		s->flags = 0;
 
 		int len = ior->a314_Length;
-		if (dev->send_queue_head == NULL && room_in_a2r(dev->ca, len))
+		if (dev->send_queue_head == NULL && room_in_a2r(dev, len))
 		{
-			append_a2r_packet(dev->ca, PKT_CONNECT, s->stream_id, (UBYTE)len, ior->a314_Buffer);
+			append_a2r_packet(dev, PKT_CONNECT, s->stream_id, (UWORD)len, ior->a314_Buffer);
 		}
 		else
 		{
@@ -452,7 +545,7 @@ static void handle_app_write(struct A314Device *dev, struct A314_IORequest *ior,
 	else
 	{
 		int len = ior->a314_Length;
-		if (s->pending_connect != NULL || s->pending_write != NULL || (s->flags & SOCKET_RCVD_EOS_FROM_APP) || len + 3 > 255)
+		if (s->pending_connect != NULL || s->pending_write != NULL || (s->flags & SOCKET_RCVD_EOS_FROM_APP) || len > dev->max_data_len)
 		{
 			ior->a314_Length = 0;
 			ior->a314_Request.io_Error = A314_WRITE_RESET;
@@ -462,9 +555,9 @@ static void handle_app_write(struct A314Device *dev, struct A314_IORequest *ior,
 		}
 		else
 		{
-			if (dev->send_queue_head == NULL && room_in_a2r(dev->ca, len))
+			if (dev->send_queue_head == NULL && room_in_a2r(dev, len))
 			{
-				append_a2r_packet(dev->ca, PKT_DATA, s->stream_id, (UBYTE)len, ior->a314_Buffer);
+				append_a2r_packet(dev, PKT_DATA, s->stream_id, (UWORD)len, ior->a314_Buffer);
 
 				ior->a314_Request.io_Error = A314_WRITE_OK;
 				ReplyMsg((struct Message *)ior);
@@ -501,9 +594,9 @@ static void handle_app_eos(struct A314Device *dev, struct A314_IORequest *ior, s
 		{
 			s->flags |= SOCKET_RCVD_EOS_FROM_APP;
 
-			if (dev->send_queue_head == NULL && room_in_a2r(dev->ca, 0))
+			if (dev->send_queue_head == NULL && room_in_a2r(dev, 0))
 			{
-				append_a2r_packet(dev->ca, PKT_EOS, s->stream_id, 0, NULL);
+				append_a2r_packet(dev, PKT_EOS, s->stream_id, 0, NULL);
 
 				ior->a314_Request.io_Error = A314_EOS_OK;
 				ReplyMsg((struct Message *)ior);
@@ -579,8 +672,8 @@ void task_main()
 
 		ULONG signal = Wait(SIGF_MSGPORT | SIGF_INT);
 
-		UBYTE prev_a2r_tail = ca->a2r_tail;
-		UBYTE prev_r2a_head = ca->r2a_head;
+		UWORD prev_a2r_tail = ca->a2r_tail;
+		UWORD prev_r2a_head = ca->r2a_head;
 
 		if (signal & SIGF_MSGPORT)
 		{
@@ -612,7 +705,7 @@ void task_main()
 			{
 				if (dev->send_queue_head == NULL)
 					a_enable = A_EVENT_R2A_TAIL;
-				else if (!room_in_a2r(ca, dev->send_queue_head->send_queue_required_length))
+				else if (!room_in_a2r(dev, dev->send_queue_head->send_queue_required_length))
 					a_enable = A_EVENT_R2A_TAIL | A_EVENT_A2R_HEAD;
 
 				if (a_enable != 0)
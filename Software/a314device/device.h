@@ -21,6 +21,7 @@ struct A314Device
     ULONG fw_flags;
 
     struct ComArea *ca;
+    ULONG ca_size;
 
     struct Task task;
     struct MsgPort task_mp;
@@ -33,6 +34,14 @@ struct A314Device
     struct Socket *send_queue_head;
     struct Socket *send_queue_tail;
 
+    // 16-bit packet framing negotiated through PKT_SETTINGS. The two ring
+    // directions switch independently; a2r stays in the legacy format until
+    // the confirm packet has been appended.
+    BOOL a2r_ext;
+    BOOL r2a_ext;
+    BOOL send_settings_confirm;
+    UWORD max_data_len;
+
     UBYTE next_stream_id;
 };
 
@@ -10,13 +10,36 @@
 #define PKT_EOS				7
 #define PKT_RESET			8
 
+// Frame formats negotiated through PKT_SETTINGS. The legacy format has a
+// 1-byte packet length; FRAME_FORMAT_EXT16 uses a 2-byte big-endian length.
+// The driver offers the extended format in the first a2r packet; each ring
+// direction switches right after the PKT_SETTINGS packet that acknowledges
+// (r2a) or confirms (a2r) it.
+#define FRAME_FORMAT_EXT16		1
+
+// Largest PKT_DATA payload in the extended frame format; also bounded by
+// the ring sizes.
+#define EXT_FRAME_MAX_DATA		4096
+
+// Bits in the base address that is published through CMEM.
+#define BASE_ADDRESS_VALID		1
+#define BASE_ADDRESS_CA_V2		2
+
 // The communication area, used to create the physical channel.
+// Revision 2 of the com area uses 16-bit queue pointers and ring sizes that
+// are chosen by the driver; the driver signals the revision by setting
+// BASE_ADDRESS_CA_V2 in the published base address. Ring sizes are powers of
+// two of at most 65536 bytes (a size field of zero means 65536). The a2r
+// ring is stored first in buffers, immediately followed by the r2a ring.
 struct ComArea
 {
-	volatile UBYTE a2r_tail;
-	volatile UBYTE r2a_head;
-	volatile UBYTE r2a_tail;
-	volatile UBYTE a2r_head;
-	UBYTE a2r_buffer[256];
-	UBYTE r2a_buffer[256];
+	volatile UWORD a2r_tail;
+	volatile UWORD r2a_head;
+	volatile UWORD r2a_tail;
+	volatile UWORD a2r_head;
+	UWORD a2r_size;
+	UWORD r2a_size;
+	UBYTE buffers[1];
 };
+
+#define COM_AREA_SIZE(a2r_size, r2a_size)	(12 + (a2r_size) + (r2a_size))
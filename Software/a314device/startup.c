@@ -107,17 +107,48 @@ BOOL task_start(struct A314Device *dev)
 
 	detect_and_write_address_swap();
 
-	dev->ca = (struct ComArea *)AllocMem(sizeof(struct ComArea), MEMF_A314 | MEMF_CLEAR);
+	// Prefer large rings to cut down on ring refill round trips during bulk
+	// transfers, but fall back gracefully when A314 memory is scarce.
+	static const UWORD ring_size_attempts[] = { 16384, 4096, 1024, 256 };
+
+	UWORD ring_size = 0;
+	dev->ca = NULL;
+	for (int i = 0; i < 4; i++)
+	{
+		ring_size = ring_size_attempts[i];
+		dev->ca_size = COM_AREA_SIZE(ring_size, ring_size);
+		dev->ca = (struct ComArea *)AllocMem(dev->ca_size, MEMF_A314 | MEMF_CLEAR);
+		if (dev->ca != NULL)
+			break;
+	}
+
 	if (dev->ca == NULL)
 	{
 		debug_printf("Unable to allocate A314 memory for com area\n");
 		return FALSE;
 	}
 
+	dev->ca->a2r_size = ring_size;
+	dev->ca->r2a_size = ring_size;
+
+	// Offer the extended 16-bit packet framing as the very first a2r packet,
+	// seeded before the base address is published. a314d acknowledges with a
+	// PKT_SETTINGS packet in the r2a ring if it supports the format.
+	dev->ca->buffers[0] = 1;
+	dev->ca->buffers[1] = PKT_SETTINGS;
+	dev->ca->buffers[2] = 0;
+	dev->ca->buffers[3] = FRAME_FORMAT_EXT16;
+	dev->ca->a2r_tail = 4;
+
+	dev->a2r_ext = FALSE;
+	dev->r2a_ext = FALSE;
+	dev->send_settings_confirm = FALSE;
+	dev->max_data_len = 252;
+
 	if (!create_task(dev))
 	{
 		debug_printf("Unable to create task stack\n");
-		FreeMem(dev->ca, sizeof(struct ComArea));
+		FreeMem(dev->ca, dev->ca_size);
 		return FALSE;
 	}
 
@@ -127,7 +158,11 @@ BOOL task_start(struct A314Device *dev)
 	write_cmem_safe(A_ENABLE_ADDRESS, 0);
 	read_cmem_safe(A_EVENTS_ADDRESS);
 
-	write_base_address(a314base_translate_address(dev, dev->ca));
+	// No frame format has been negotiated yet for this session; a314d reads
+	// this nibble when it adopts an already-published base address.
+	write_cmem_safe(FRAME_FORMAT_ADDRESS, 0);
+
+	write_base_address(a314base_translate_address(dev, dev->ca) | BASE_ADDRESS_CA_V2);
 
 	write_cmem_safe(R_EVENTS_ADDRESS, R_EVENT_BASE_ADDRESS);
 
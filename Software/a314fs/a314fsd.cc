@@ -0,0 +1,1432 @@
+/*
+ * a314fsd - native backend for the a314fs file system.
+ *
+ * Speaks the same wire protocol as a314fs.py, but keeps directory listings,
+ * stat results and metadata (protection bits and comments from the ":a314"
+ * metafiles) in an in-memory cache that is invalidated through inotify, so
+ * a Workbench directory scan no longer walks the file system once per entry.
+ *
+ * The connection to a314d is set up through a314client.h; since each a314fs
+ * request is a synchronous round-trip, the message I/O here is the blocking
+ * send_msg()/wait_for_msg() pair rather than the library's poll-driven path.
+ */
+
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../a314client/a314client.h"
+
+#define LOGGER_TRACE 0
+#define logger_trace(...) do { if (LOGGER_TRACE) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_DEBUG 0
+#define logger_debug(...) do { if (LOGGER_DEBUG) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_INFO 1
+#define logger_info(...) do { if (LOGGER_INFO) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_WARN 1
+#define logger_warn(...) do { if (LOGGER_WARN) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_ERROR 1
+#define logger_error(...) do { if (LOGGER_ERROR) fprintf(stderr, __VA_ARGS__); } while (0)
+
+#define CONFIG_FILE_PATH        "/etc/opt/a314/a314fs.conf"
+#define METAFILE_EXTENSION      ":a314"
+
+// Actions in the a314fs request protocol. Only the ones that a314fs.c sends
+// are handled; the rest answer ERROR_ACTION_NOT_KNOWN.
+#define ACTION_LOCATE_OBJECT    8
+#define ACTION_WRITE            ((uint16_t)'W')
+#define ACTION_READ             ((uint16_t)'R')
+#define ACTION_FREE_LOCK        15
+#define ACTION_DELETE_OBJECT    16
+#define ACTION_RENAME_OBJECT    17
+#define ACTION_COPY_DIR         19
+#define ACTION_SET_PROTECT      21
+#define ACTION_CREATE_DIR       22
+#define ACTION_EXAMINE_OBJECT   23
+#define ACTION_EXAMINE_NEXT     24
+#define ACTION_SET_COMMENT      28
+#define ACTION_PARENT           29
+#define ACTION_SAME_LOCK        40
+#define ACTION_FINDUPDATE       1004
+#define ACTION_FINDINPUT        1005
+#define ACTION_FINDOUTPUT       1006
+#define ACTION_END              1007
+#define ACTION_SEEK             1008
+#define ACTION_EXAMINE_FH       1034
+#define ACTION_UNSUPPORTED      65535
+
+#define ERROR_OBJECT_IN_USE             202
+#define ERROR_OBJECT_EXISTS             203
+#define ERROR_OBJECT_NOT_FOUND          205
+#define ERROR_ACTION_NOT_KNOWN          209
+#define ERROR_INVALID_LOCK              211
+#define ERROR_OBJECT_WRONG_TYPE         212
+#define ERROR_DIRECTORY_NOT_EMPTY       216
+#define ERROR_SEEK_ERROR                219
+#define ERROR_COMMENT_TOO_BIG           220
+#define ERROR_DISK_FULL                 221
+#define ERROR_DELETE_PROTECTED          222
+#define ERROR_WRITE_PROTECTED           223
+#define ERROR_READ_PROTECTED            224
+#define ERROR_NO_MORE_ENTRIES           232
+
+#define SHARED_LOCK             -2
+#define EXCLUSIVE_LOCK          -1
+
+#define LOCK_DIFFERENT          -1
+#define LOCK_SAME               0
+#define LOCK_SAME_VOLUME        1
+
+// The FIND* action numbers coincide with the AmigaDOS open modes.
+#define MODE_OLDFILE            1005
+#define MODE_NEWFILE            1006
+#define MODE_READWRITE          1004
+
+#define OFFSET_BEGINNING        -1
+#define OFFSET_CURRENT          0
+#define OFFSET_END              1
+
+#define ST_USERDIR              2
+#define ST_FILE                 -3
+
+static std::string shared_directory = "/home/pi/a314shared";
+static std::string volume_name = "PiDisk";
+static std::string volume_name_lower = "pidisk";
+
+static int drv_fd = -1;
+
+// ---------------------------------------------------------------------------
+// Big-endian packing helpers; the a314fs request protocol is m68k-ordered.
+
+static uint16_t get_u16(const uint8_t *p)
+{
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u16(std::vector<uint8_t> &v, uint16_t x)
+{
+    v.push_back((uint8_t)(x >> 8));
+    v.push_back((uint8_t)x);
+}
+
+static void put_u32(std::vector<uint8_t> &v, uint32_t x)
+{
+    v.push_back((uint8_t)(x >> 24));
+    v.push_back((uint8_t)(x >> 16));
+    v.push_back((uint8_t)(x >> 8));
+    v.push_back((uint8_t)x);
+}
+
+static std::vector<uint8_t> pack_error(uint16_t error_code)
+{
+    std::vector<uint8_t> res;
+    put_u16(res, 0);
+    put_u16(res, error_code);
+    return res;
+}
+
+// ---------------------------------------------------------------------------
+// Connection to a314d.
+
+static void recv_exact(uint8_t *dst, size_t len)
+{
+    while (len != 0)
+    {
+        ssize_t r = recv(drv_fd, dst, len, 0);
+        if (r <= 0)
+        {
+            logger_error("Connection to a314d was closed, terminating.\n");
+            exit(-1);
+        }
+        dst += r;
+        len -= r;
+    }
+}
+
+static void send_all(const uint8_t *src, size_t len)
+{
+    while (len != 0)
+    {
+        ssize_t w = send(drv_fd, src, len, 0);
+        if (w <= 0)
+        {
+            logger_error("Connection to a314d was closed, terminating.\n");
+            exit(-1);
+        }
+        src += w;
+        len -= w;
+    }
+}
+
+struct DriverMsg
+{
+    uint32_t stream_id;
+    uint8_t type;
+    std::vector<uint8_t> payload;
+};
+
+static void wait_for_msg(DriverMsg &msg)
+{
+    uint8_t header[9];
+    recv_exact(header, sizeof(header));
+
+    uint32_t plen;
+    memcpy(&plen, &header[0], 4);
+    memcpy(&msg.stream_id, &header[4], 4);
+    msg.type = header[8];
+
+    msg.payload.resize(plen);
+    if (plen != 0)
+        recv_exact(&msg.payload[0], plen);
+}
+
+static void send_msg(uint8_t type, uint32_t stream_id, const uint8_t *data, uint32_t length)
+{
+    uint8_t header[9];
+    memcpy(&header[0], &length, 4);
+    memcpy(&header[4], &stream_id, 4);
+    header[8] = type;
+
+    send_all(header, sizeof(header));
+    if (length != 0)
+        send_all(data, length);
+}
+
+static void read_mem(uint32_t address, uint32_t length, std::vector<uint8_t> &data)
+{
+    uint8_t req[8];
+    memcpy(&req[0], &address, 4);
+    memcpy(&req[4], &length, 4);
+    send_msg(MSG_READ_MEM_REQ, 0, req, sizeof(req));
+
+    DriverMsg msg;
+    wait_for_msg(msg);
+    if (msg.type != MSG_READ_MEM_RES)
+    {
+        logger_error("Expected MSG_READ_MEM_RES but got %d. Shutting down.\n", msg.type);
+        exit(-1);
+    }
+    data = std::move(msg.payload);
+}
+
+static void write_mem(uint32_t address, const uint8_t *data, uint32_t length)
+{
+    std::vector<uint8_t> req(4 + length);
+    memcpy(&req[0], &address, 4);
+    memcpy(&req[4], data, length);
+    send_msg(MSG_WRITE_MEM_REQ, 0, &req[0], req.size());
+
+    DriverMsg msg;
+    wait_for_msg(msg);
+    if (msg.type != MSG_WRITE_MEM_RES)
+    {
+        logger_error("Expected MSG_WRITE_MEM_RES but got %d. Shutting down.\n", msg.type);
+        exit(-1);
+    }
+}
+
+static void send_connect_response(uint32_t stream_id, uint8_t result)
+{
+    send_msg(MSG_CONNECT_RESPONSE, stream_id, &result, 1);
+}
+
+// ---------------------------------------------------------------------------
+// Configuration; a314fs.conf is a small JSON file and the two fields that are
+// used are scanned for directly rather than pulling in a JSON library.
+
+static std::string json_find_string(const std::string &text, const std::string &key, size_t from)
+{
+    size_t pos = text.find("\"" + key + "\"", from);
+    if (pos == std::string::npos)
+        return "";
+
+    pos = text.find(':', pos);
+    if (pos == std::string::npos)
+        return "";
+
+    pos = text.find('"', pos);
+    if (pos == std::string::npos)
+        return "";
+
+    size_t end = text.find('"', pos + 1);
+    if (end == std::string::npos)
+        return "";
+
+    return text.substr(pos + 1, end - pos - 1);
+}
+
+static void load_config_file()
+{
+    FILE *f = fopen(CONFIG_FILE_PATH, "rb");
+    if (f == nullptr)
+        return;
+
+    std::string text;
+    char buf[512];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) != 0)
+        text.append(buf, n);
+    fclose(f);
+
+    size_t dev = text.find("\"PI0\"");
+    if (dev == std::string::npos)
+        return;
+
+    std::string path = json_find_string(text, "path", dev);
+    if (!path.empty())
+        shared_directory = path;
+
+    std::string volume = json_find_string(text, "volume", dev);
+    if (!volume.empty())
+    {
+        volume_name = volume;
+        volume_name_lower = volume;
+        for (auto &c : volume_name_lower)
+            c = tolower(c);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Metadata cache. Paths are relative to the shared directory, "." for the
+// root. Cached directory listings, stat results and metafile contents are
+// invalidated when inotify reports that someone else touched the tree, and
+// directly when this process modifies it.
+
+struct Metadata
+{
+    uint32_t protection;
+    std::string comment;
+};
+
+static std::unordered_map<std::string, std::vector<std::string>> dir_cache;
+static std::unordered_map<std::string, struct stat> stat_cache;
+static std::unordered_map<std::string, Metadata> meta_cache;
+
+static int inotify_fd = -1;
+static std::unordered_map<int, std::string> watch_dirs;
+static std::unordered_map<std::string, int> dir_watches;
+
+static void init_inotify()
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+        logger_warn("Unable to initialize inotify; running without cache invalidation\n");
+}
+
+static void watch_dir(const std::string &dir)
+{
+    if (inotify_fd < 0 || dir_watches.count(dir))
+        return;
+
+    int wd = inotify_add_watch(inotify_fd, dir.c_str(),
+        IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+        IN_CLOSE_WRITE | IN_ATTRIB | IN_MODIFY);
+    if (wd < 0)
+        return;
+
+    watch_dirs[wd] = dir;
+    dir_watches[dir] = wd;
+}
+
+static std::string child_path(const std::string &dir, const std::string &name)
+{
+    return dir == "." ? name : dir + "/" + name;
+}
+
+static void invalidate_entry(const std::string &path)
+{
+    stat_cache.erase(path);
+    meta_cache.erase(path);
+}
+
+static void invalidate_dir(const std::string &dir)
+{
+    auto it = dir_cache.find(dir);
+    if (it != dir_cache.end())
+    {
+        for (auto &name : it->second)
+            invalidate_entry(child_path(dir, name));
+        dir_cache.erase(it);
+    }
+    invalidate_entry(dir);
+}
+
+static void invalidate_all()
+{
+    dir_cache.clear();
+    stat_cache.clear();
+    meta_cache.clear();
+}
+
+// Drains pending inotify events and invalidates the affected cache entries.
+// Called before each request is processed so that external modifications to
+// the shared directory are picked up.
+static void drain_inotify()
+{
+    if (inotify_fd < 0)
+        return;
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true)
+    {
+        ssize_t len = read(inotify_fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+
+        ssize_t pos = 0;
+        while (pos < len)
+        {
+            struct inotify_event *event = (struct inotify_event *)&buf[pos];
+            pos += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                invalidate_all();
+                continue;
+            }
+
+            auto it = watch_dirs.find(event->wd);
+            if (it == watch_dirs.end())
+                continue;
+
+            if (event->mask & IN_IGNORED)
+            {
+                dir_watches.erase(it->second);
+                invalidate_dir(it->second);
+                watch_dirs.erase(it);
+                continue;
+            }
+
+            if (event->len != 0)
+            {
+                std::string name(event->name);
+
+                // A change to a metafile invalidates the metadata of the
+                // file it belongs to.
+                size_t ext = name.rfind(METAFILE_EXTENSION);
+                if (ext != std::string::npos && ext == name.size() - strlen(METAFILE_EXTENSION))
+                    name = name.substr(0, ext);
+
+                invalidate_entry(child_path(it->second, name));
+            }
+
+            if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+                dir_cache.erase(it->second);
+        }
+    }
+}
+
+static const std::vector<std::string> &cached_list_dir(const std::string &dir)
+{
+    auto it = dir_cache.find(dir);
+    if (it != dir_cache.end())
+        return it->second;
+
+    std::vector<std::string> names;
+
+    DIR *d = opendir(dir.c_str());
+    if (d != nullptr)
+    {
+        struct dirent *de;
+        while ((de = readdir(d)) != nullptr)
+        {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            names.push_back(de->d_name);
+        }
+        closedir(d);
+
+        watch_dir(dir);
+    }
+
+    return dir_cache.emplace(dir, std::move(names)).first->second;
+}
+
+static bool cached_stat(const std::string &path, struct stat *st)
+{
+    auto it = stat_cache.find(path);
+    if (it != stat_cache.end())
+    {
+        *st = it->second;
+        return true;
+    }
+
+    if (stat(path.c_str(), st) != 0)
+        return false;
+
+    stat_cache[path] = *st;
+    return true;
+}
+
+static Metadata read_metadata(const std::string &path)
+{
+    auto it = meta_cache.find(path);
+    if (it != meta_cache.end())
+        return it->second;
+
+    Metadata md;
+    md.protection = 0;
+
+    FILE *f = fopen((path + METAFILE_EXTENSION).c_str(), "r");
+    if (f != nullptr)
+    {
+        char line[256];
+        while (fgets(line, sizeof(line), f) != nullptr)
+        {
+            size_t len = strlen(line);
+            while (len != 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+                line[--len] = 0;
+
+            if (line[0] == 'p')
+                md.protection = strtoul(&line[1], nullptr, 10);
+            else if (line[0] == 'c')
+                md.comment = std::string(&line[1]).substr(0, 79);
+        }
+        fclose(f);
+    }
+
+    meta_cache[path] = md;
+    return md;
+}
+
+static bool write_metadata(const std::string &path, const uint32_t *protection, const std::string *comment)
+{
+    Metadata old = read_metadata(path);
+    Metadata md = old;
+
+    if (protection != nullptr)
+        md.protection = *protection;
+    if (comment != nullptr)
+        md.comment = *comment;
+
+    if (old.protection == md.protection && old.comment == md.comment)
+        return true;
+
+    FILE *f = fopen((path + METAFILE_EXTENSION).c_str(), "w");
+    if (f == nullptr)
+    {
+        logger_warn("Failed to write metadata for file %s\n", path.c_str());
+        return false;
+    }
+
+    fprintf(f, "p%u\n", md.protection);
+    fprintf(f, "c%s\n", md.comment.c_str());
+    fclose(f);
+
+    meta_cache[path] = md;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Locks and file handles.
+
+struct ObjectLock
+{
+    int mode;
+    std::vector<std::string> path;
+
+    // Snapshot of the directory listing used by ACTION_EXAMINE_NEXT.
+    std::vector<std::string> entries;
+    size_t entry_pos;
+    bool iterating;
+
+    ObjectLock() : mode(SHARED_LOCK), entry_pos(0), iterating(false) {}
+};
+
+static std::unordered_map<uint32_t, ObjectLock> locks;
+static uint32_t next_key = 1;
+
+static uint32_t get_key()
+{
+    uint32_t key = next_key;
+    next_key = next_key == 0x7fffffff ? 1 : next_key + 1;
+    while (locks.count(key))
+        key++;
+    return key;
+}
+
+struct OpenFileHandle
+{
+    int fd;
+    uint32_t protection;
+    std::string path;
+};
+
+static std::unordered_map<uint32_t, OpenFileHandle> open_file_handles;
+static uint32_t next_fp = 1;
+
+static uint32_t get_file_ptr()
+{
+    uint32_t fp = next_fp;
+    next_fp = next_fp == 0x7fffffff ? 1 : next_fp + 1;
+    while (open_file_handles.count(fp))
+        fp++;
+    return fp;
+}
+
+// ---------------------------------------------------------------------------
+// Path resolution.
+
+static std::string join_path(const std::vector<std::string> &cp)
+{
+    if (cp.empty())
+        return ".";
+
+    std::string path = cp[0];
+    for (size_t i = 1; i < cp.size(); i++)
+        path += "/" + cp[i];
+    return path;
+}
+
+static std::string to_lower(const std::string &s)
+{
+    std::string r = s;
+    for (auto &c : r)
+        c = tolower(c);
+    return r;
+}
+
+// Resolves an AmigaDOS path relative to a lock into a component path
+// relative to the shared directory. Case-insensitive component matching is
+// done against the cached directory listings. The last component is allowed
+// to not exist (for create/open-for-output); returns false if an
+// intermediate component is missing or the lock is unknown.
+static bool find_path(uint32_t key, std::string name, std::vector<std::string> &cp_out)
+{
+    size_t colon = name.find(':');
+    if (colon != std::string::npos)
+    {
+        std::string vol = to_lower(name.substr(0, colon));
+        if (vol.empty() || vol == "pi0" || vol == volume_name_lower)
+            key = 0;
+        name = name.substr(colon + 1);
+    }
+
+    std::vector<std::string> cp;
+    if (key != 0)
+    {
+        auto it = locks.find(key);
+        if (it == locks.end())
+            return false;
+        cp = it->second.path;
+    }
+
+    while (!name.empty())
+    {
+        std::string comp;
+        size_t slash = name.find('/');
+        if (slash == std::string::npos)
+        {
+            comp = name;
+            name.clear();
+        }
+        else
+        {
+            comp = name.substr(0, slash);
+            name = name.substr(slash + 1);
+        }
+
+        if (comp.empty())
+        {
+            if (cp.empty())
+                return false;
+            cp.pop_back();
+        }
+        else
+        {
+            const std::vector<std::string> &entries = cached_list_dir(join_path(cp));
+            std::string comp_lower = to_lower(comp);
+
+            bool found = false;
+            for (auto &e : entries)
+            {
+                if (comp_lower == to_lower(e))
+                {
+                    cp.push_back(e);
+                    found = true;
+                    break;
+                }
+            }
+
+            if (!found)
+            {
+                if (name.empty())
+                    cp.push_back(comp);
+                else
+                    return false;
+            }
+        }
+    }
+
+    cp_out = std::move(cp);
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Request processing.
+
+static void mtime_to_dmt(time_t mtime, uint32_t *days, uint32_t *mins, uint32_t *ticks)
+{
+    int64_t d = mtime / 86400;
+    int64_t left = mtime - d * 86400;
+    int64_t m = left / 60;
+    int64_t secs = left - m * 60;
+
+    d -= 2922; // Days between 1970-01-01 and 1978-01-01.
+    if (d < 0)
+        d = 0;
+
+    *days = (uint32_t)d;
+    *mins = (uint32_t)m;
+    *ticks = (uint32_t)(secs * 50);
+}
+
+static std::vector<uint8_t> pack_examine(uint16_t disk_key, const std::string &fn, const std::string &path)
+{
+    struct stat st;
+    if (!cached_stat(path, &st))
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    uint32_t days, mins, ticks;
+    mtime_to_dmt(st.st_mtime, &days, &mins, &ticks);
+
+    Metadata md = read_metadata(path);
+
+    int16_t type;
+    uint32_t size;
+    if (S_ISREG(st.st_mode))
+    {
+        type = ST_FILE;
+        size = st.st_size > 0x7fffffff ? 0x7fffffff : (uint32_t)st.st_size;
+    }
+    else
+    {
+        type = ST_USERDIR;
+        size = 0;
+    }
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    put_u16(res, disk_key);
+    put_u16(res, (uint16_t)type);
+    put_u32(res, size);
+    put_u32(res, md.protection);
+    put_u32(res, days);
+    put_u32(res, mins);
+    put_u32(res, ticks);
+
+    res.push_back((uint8_t)fn.size());
+    res.insert(res.end(), fn.begin(), fn.end());
+    res.push_back((uint8_t)md.comment.size());
+    res.insert(res.end(), md.comment.begin(), md.comment.end());
+    return res;
+}
+
+static std::vector<uint8_t> process_locate_object(uint32_t key, int16_t mode, const std::string &name)
+{
+    logger_debug("ACTION_LOCATE_OBJECT, key: %u, mode: %d, name: %s\n", key, mode, name.c_str());
+
+    std::vector<std::string> cp;
+    if (!find_path(key, name, cp))
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    struct stat st;
+    if (!cp.empty() && !cached_stat(join_path(cp), &st))
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    key = get_key();
+    ObjectLock &ol = locks[key];
+    ol.mode = mode;
+    ol.path = std::move(cp);
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    put_u32(res, key);
+    return res;
+}
+
+static std::vector<uint8_t> process_free_lock(uint32_t key)
+{
+    logger_debug("ACTION_FREE_LOCK, key: %u\n", key);
+
+    locks.erase(key);
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    return res;
+}
+
+static std::vector<uint8_t> process_copy_dir(uint32_t prev_key)
+{
+    logger_debug("ACTION_COPY_DIR, prev_key: %u\n", prev_key);
+
+    auto it = locks.find(prev_key);
+    if (it == locks.end())
+        return pack_error(ERROR_INVALID_LOCK);
+
+    int mode = it->second.mode;
+    std::vector<std::string> path = it->second.path;
+
+    uint32_t key = get_key();
+    ObjectLock &ol = locks[key];
+    ol.mode = mode;
+    ol.path = std::move(path);
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    put_u32(res, key);
+    return res;
+}
+
+static std::vector<uint8_t> process_parent(uint32_t prev_key)
+{
+    logger_debug("ACTION_PARENT, prev_key: %u\n", prev_key);
+
+    auto it = locks.find(prev_key);
+    if (it == locks.end())
+        return pack_error(ERROR_INVALID_LOCK);
+
+    uint32_t key = 0;
+    if (!it->second.path.empty())
+    {
+        std::vector<std::string> path = it->second.path;
+        path.pop_back();
+
+        key = get_key();
+        ObjectLock &ol = locks[key];
+        ol.mode = SHARED_LOCK;
+        ol.path = std::move(path);
+    }
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    put_u32(res, key);
+    return res;
+}
+
+static std::vector<uint8_t> process_examine_object(uint32_t key)
+{
+    logger_debug("ACTION_EXAMINE_OBJECT, key: %u\n", key);
+
+    auto it = locks.find(key);
+    if (it == locks.end())
+        return pack_error(ERROR_INVALID_LOCK);
+
+    ObjectLock &ol = it->second;
+
+    std::string fn = ol.path.empty() ? volume_name : ol.path.back();
+    std::string path = join_path(ol.path);
+
+    struct stat st;
+    if (cached_stat(path, &st) && S_ISDIR(st.st_mode))
+    {
+        ol.entries = cached_list_dir(path);
+        ol.entry_pos = 0;
+        ol.iterating = true;
+    }
+
+    return pack_examine(666, fn, path);
+}
+
+static std::vector<uint8_t> process_examine_next(uint32_t key, uint16_t disk_key)
+{
+    logger_debug("ACTION_EXAMINE_NEXT, key: %u, disk_key: %u\n", key, disk_key);
+
+    auto it = locks.find(key);
+    if (it == locks.end())
+        return pack_error(ERROR_INVALID_LOCK);
+
+    ObjectLock &ol = it->second;
+    std::string dir = join_path(ol.path);
+
+    struct stat st;
+    if (!cached_stat(dir, &st) || !S_ISDIR(st.st_mode))
+        return pack_error(ERROR_OBJECT_WRONG_TYPE);
+
+    if (!ol.iterating)
+    {
+        ol.entries = cached_list_dir(dir);
+        ol.entry_pos = 0;
+        ol.iterating = true;
+    }
+
+    disk_key++;
+
+    const size_t ext_len = strlen(METAFILE_EXTENSION);
+    while (ol.entry_pos < ol.entries.size())
+    {
+        const std::string &name = ol.entries[ol.entry_pos];
+        if (name.size() >= ext_len &&
+            name.compare(name.size() - ext_len, ext_len, METAFILE_EXTENSION) == 0)
+        {
+            ol.entry_pos++;
+            continue;
+        }
+        break;
+    }
+
+    if (ol.entry_pos == ol.entries.size())
+        return pack_error(ERROR_NO_MORE_ENTRIES);
+
+    std::string fn = ol.entries[ol.entry_pos++];
+    return pack_examine(disk_key, fn, child_path(dir, fn));
+}
+
+static std::vector<uint8_t> process_examine_fh(uint32_t arg1)
+{
+    logger_debug("ACTION_EXAMINE_FH, arg1: %u\n", arg1);
+
+    auto it = open_file_handles.find(arg1);
+    if (it == open_file_handles.end())
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    const std::string &path = it->second.path;
+    std::string fn = path;
+    size_t slash = fn.rfind('/');
+    if (slash != std::string::npos)
+        fn = fn.substr(slash + 1);
+
+    return pack_examine(666, fn, path);
+}
+
+static std::vector<uint8_t> process_findxxx(uint16_t mode, uint32_t key, const std::string &name)
+{
+    logger_debug("ACTION_FINDXXX, mode: %u, key: %u, name: %s\n", mode, key, name.c_str());
+
+    std::vector<std::string> cp;
+    if (!find_path(key, name, cp))
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    std::string path = join_path(cp);
+
+    struct stat st;
+    bool exists = cached_stat(path, &st);
+    if (cp.empty() || (exists && S_ISDIR(st.st_mode)))
+        return pack_error(ERROR_OBJECT_WRONG_TYPE);
+
+    uint32_t protection = read_metadata(path).protection;
+
+    int fd = -1;
+    if (mode == MODE_OLDFILE)
+        fd = open(path.c_str(), O_RDWR);
+    else if (mode == MODE_READWRITE)
+    {
+        fd = open(path.c_str(), O_RDWR);
+        if (fd < 0)
+            fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    }
+    else if (mode == MODE_NEWFILE)
+    {
+        if (protection & 0x1)
+            return pack_error(ERROR_DELETE_PROTECTED);
+        else if (protection & 0x4)
+            return pack_error(ERROR_WRITE_PROTECTED);
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    }
+
+    if (fd < 0)
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    // Opening for write clears the archived bit.
+    if (mode != MODE_OLDFILE && (protection & 16))
+    {
+        protection &= ~16u;
+        write_metadata(path, &protection, nullptr);
+    }
+
+    invalidate_entry(path);
+    if (!exists)
+        dir_cache.erase(join_path(std::vector<std::string>(cp.begin(), cp.end() - 1)));
+
+    uint32_t fp = get_file_ptr();
+    OpenFileHandle &ofh = open_file_handles[fp];
+    ofh.fd = fd;
+    ofh.protection = protection;
+    ofh.path = path;
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    put_u32(res, fp);
+    return res;
+}
+
+static std::vector<uint8_t> process_read(uint32_t arg1, uint32_t address, uint32_t length)
+{
+    logger_debug("ACTION_READ, arg1: %u, address: %u, length: %u\n", arg1, address, length);
+
+    auto it = open_file_handles.find(arg1);
+    if (it == open_file_handles.end())
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    if (it->second.protection & 0x8)
+        return pack_error(ERROR_READ_PROTECTED);
+
+    std::vector<uint8_t> data(length);
+    ssize_t r = read(it->second.fd, &data[0], length);
+    if (r < 0)
+        r = 0;
+
+    if (r != 0)
+        write_mem(address, &data[0], r);
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    put_u32(res, (uint32_t)r);
+    return res;
+}
+
+static std::vector<uint8_t> process_write(uint32_t arg1, uint32_t address, uint32_t length)
+{
+    logger_debug("ACTION_WRITE, arg1: %u, address: %u, length: %u\n", arg1, address, length);
+
+    auto it = open_file_handles.find(arg1);
+    if (it == open_file_handles.end())
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    if (it->second.protection & 0x4)
+        return pack_error(ERROR_WRITE_PROTECTED);
+
+    std::vector<uint8_t> data;
+    read_mem(address, length, data);
+
+    if (write(it->second.fd, &data[0], length) != (ssize_t)length)
+        return pack_error(ERROR_DISK_FULL);
+
+    invalidate_entry(it->second.path);
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    put_u32(res, length);
+    return res;
+}
+
+static std::vector<uint8_t> process_seek(uint32_t arg1, int32_t new_pos, int32_t mode)
+{
+    logger_debug("ACTION_SEEK, arg1: %u, new_pos: %d, mode: %d\n", arg1, new_pos, mode);
+
+    auto it = open_file_handles.find(arg1);
+    if (it == open_file_handles.end())
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    off_t old_pos = lseek(it->second.fd, 0, SEEK_CUR);
+
+    int whence = SEEK_SET;
+    if (mode == OFFSET_CURRENT)
+        whence = SEEK_CUR;
+    else if (mode == OFFSET_END)
+        whence = SEEK_END;
+
+    if (lseek(it->second.fd, new_pos, whence) == (off_t)-1)
+        return pack_error(ERROR_SEEK_ERROR);
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    put_u32(res, (uint32_t)old_pos);
+    return res;
+}
+
+static std::vector<uint8_t> process_end(uint32_t arg1)
+{
+    logger_debug("ACTION_END, arg1: %u\n", arg1);
+
+    auto it = open_file_handles.find(arg1);
+    if (it != open_file_handles.end())
+    {
+        close(it->second.fd);
+        invalidate_entry(it->second.path);
+        open_file_handles.erase(it);
+    }
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    return res;
+}
+
+static std::vector<uint8_t> process_delete_object(uint32_t key, const std::string &name)
+{
+    logger_debug("ACTION_DELETE_OBJECT, key: %u, name: %s\n", key, name.c_str());
+
+    std::vector<std::string> cp;
+    if (!find_path(key, name, cp) || cp.empty())
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    std::string path = join_path(cp);
+
+    struct stat st;
+    if (!cached_stat(path, &st))
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    bool is_dir = S_ISDIR(st.st_mode);
+
+    if (read_metadata(path).protection & 0x1)
+        return pack_error(ERROR_DELETE_PROTECTED);
+
+    int result = is_dir ? rmdir(path.c_str()) : unlink(path.c_str());
+    if (result != 0)
+        return pack_error(is_dir ? ERROR_DIRECTORY_NOT_EMPTY : ERROR_OBJECT_NOT_FOUND);
+
+    unlink((path + METAFILE_EXTENSION).c_str());
+
+    if (is_dir)
+        invalidate_dir(path);
+    else
+        invalidate_entry(path);
+    dir_cache.erase(join_path(std::vector<std::string>(cp.begin(), cp.end() - 1)));
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    return res;
+}
+
+static std::vector<uint8_t> process_rename_object(uint32_t key, const std::string &name,
+    uint32_t target_dir, const std::string &new_name)
+{
+    logger_debug("ACTION_RENAME_OBJECT, key: %u, name: %s, target_dir: %u, new_name: %s\n",
+        key, name.c_str(), target_dir, new_name.c_str());
+
+    std::vector<std::string> cp1;
+    if (!find_path(key, name, cp1) || cp1.empty())
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    std::string from_path = join_path(cp1);
+
+    struct stat st;
+    if (!cached_stat(from_path, &st))
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    std::vector<std::string> cp2;
+    if (!find_path(target_dir, new_name, cp2) || cp2.empty())
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    std::string to_path = join_path(cp2);
+
+    std::vector<uint8_t> ok;
+    put_u16(ok, 1);
+    put_u16(ok, 0);
+
+    if (from_path == to_path)
+        return ok;
+
+    if (cached_stat(to_path, &st))
+        return pack_error(ERROR_OBJECT_EXISTS);
+
+    if (rename(from_path.c_str(), to_path.c_str()) != 0)
+        return pack_error(ERROR_OBJECT_IN_USE);
+
+    rename((from_path + METAFILE_EXTENSION).c_str(), (to_path + METAFILE_EXTENSION).c_str());
+
+    invalidate_dir(from_path);
+    invalidate_entry(to_path);
+    dir_cache.erase(join_path(std::vector<std::string>(cp1.begin(), cp1.end() - 1)));
+    dir_cache.erase(join_path(std::vector<std::string>(cp2.begin(), cp2.end() - 1)));
+
+    return ok;
+}
+
+static std::vector<uint8_t> process_create_dir(uint32_t key, const std::string &name)
+{
+    logger_debug("ACTION_CREATE_DIR, key: %u, name: %s\n", key, name.c_str());
+
+    std::vector<std::string> cp;
+    if (!find_path(key, name, cp) || cp.empty())
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    std::string path = join_path(cp);
+    if (mkdir(path.c_str(), 0777) != 0)
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    dir_cache.erase(join_path(std::vector<std::string>(cp.begin(), cp.end() - 1)));
+
+    key = get_key();
+    ObjectLock &ol = locks[key];
+    ol.mode = SHARED_LOCK;
+    ol.path = std::move(cp);
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    put_u32(res, key);
+    return res;
+}
+
+static std::vector<uint8_t> process_set_protect(uint32_t key, const std::string &name, uint32_t mask)
+{
+    logger_debug("ACTION_SET_PROTECT, key: %u, name: %s, mask: %u\n", key, name.c_str(), mask);
+
+    std::vector<std::string> cp;
+    if (!find_path(key, name, cp) || cp.empty())
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    if (!write_metadata(join_path(cp), &mask, nullptr))
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    return res;
+}
+
+static std::vector<uint8_t> process_set_comment(uint32_t key, const std::string &name, const std::string &comment)
+{
+    logger_debug("ACTION_SET_COMMENT, key: %u, name: %s, comment: %s\n", key, name.c_str(), comment.c_str());
+
+    if (comment.size() > 79)
+        return pack_error(ERROR_COMMENT_TOO_BIG);
+
+    std::vector<std::string> cp;
+    if (!find_path(key, name, cp) || cp.empty())
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    if (!write_metadata(join_path(cp), nullptr, &comment))
+        return pack_error(ERROR_OBJECT_NOT_FOUND);
+
+    std::vector<uint8_t> res;
+    put_u16(res, 1);
+    put_u16(res, 0);
+    return res;
+}
+
+static std::vector<uint8_t> process_same_lock(uint32_t key1, uint32_t key2)
+{
+    logger_debug("ACTION_SAME_LOCK, key1: %u, key2: %u\n", key1, key2);
+
+    auto it1 = locks.find(key1);
+    auto it2 = locks.find(key2);
+
+    std::vector<uint8_t> res;
+    if (it1 == locks.end() || it2 == locks.end())
+    {
+        put_u16(res, 0);
+        put_u16(res, (uint16_t)LOCK_DIFFERENT);
+    }
+    else if (it1->second.path == it2->second.path)
+    {
+        put_u16(res, 1);
+        put_u16(res, LOCK_SAME);
+    }
+    else
+    {
+        put_u16(res, 0);
+        put_u16(res, LOCK_SAME_VOLUME);
+    }
+    return res;
+}
+
+static std::vector<uint8_t> process_request(const std::vector<uint8_t> &req)
+{
+    if (req.size() < 2)
+        return pack_error(ERROR_ACTION_NOT_KNOWN);
+
+    const uint8_t *p = &req[0];
+    uint16_t rtype = get_u16(p);
+
+    switch (rtype)
+    {
+    case ACTION_LOCATE_OBJECT:
+    {
+        uint32_t key = get_u32(&p[2]);
+        int16_t mode = (int16_t)get_u16(&p[6]);
+        uint8_t nlen = p[8];
+        return process_locate_object(key, mode, std::string((const char *)&p[9], nlen));
+    }
+    case ACTION_FREE_LOCK:
+        return process_free_lock(get_u32(&p[2]));
+    case ACTION_COPY_DIR:
+        return process_copy_dir(get_u32(&p[2]));
+    case ACTION_PARENT:
+        return process_parent(get_u32(&p[2]));
+    case ACTION_EXAMINE_OBJECT:
+        return process_examine_object(get_u32(&p[2]));
+    case ACTION_EXAMINE_NEXT:
+        return process_examine_next(get_u32(&p[2]), get_u16(&p[6]));
+    case ACTION_EXAMINE_FH:
+        return process_examine_fh(get_u32(&p[2]));
+    case ACTION_FINDINPUT:
+    case ACTION_FINDOUTPUT:
+    case ACTION_FINDUPDATE:
+    {
+        uint32_t key = get_u32(&p[2]);
+        uint8_t nlen = p[6];
+        return process_findxxx(rtype, key, std::string((const char *)&p[7], nlen));
+    }
+    case ACTION_READ:
+        return process_read(get_u32(&p[2]), get_u32(&p[6]), get_u32(&p[10]));
+    case ACTION_WRITE:
+        return process_write(get_u32(&p[2]), get_u32(&p[6]), get_u32(&p[10]));
+    case ACTION_SEEK:
+        return process_seek(get_u32(&p[2]), (int32_t)get_u32(&p[6]), (int32_t)get_u32(&p[10]));
+    case ACTION_END:
+        return process_end(get_u32(&p[2]));
+    case ACTION_DELETE_OBJECT:
+    {
+        uint32_t key = get_u32(&p[2]);
+        uint8_t nlen = p[6];
+        return process_delete_object(key, std::string((const char *)&p[7], nlen));
+    }
+    case ACTION_RENAME_OBJECT:
+    {
+        uint32_t key = get_u32(&p[2]);
+        uint32_t target_dir = get_u32(&p[6]);
+        uint8_t nlen = p[10];
+        uint8_t nnlen = p[11];
+        return process_rename_object(key, std::string((const char *)&p[12], nlen),
+            target_dir, std::string((const char *)&p[12 + nlen], nnlen));
+    }
+    case ACTION_CREATE_DIR:
+    {
+        uint32_t key = get_u32(&p[2]);
+        uint8_t nlen = p[6];
+        return process_create_dir(key, std::string((const char *)&p[7], nlen));
+    }
+    case ACTION_SET_PROTECT:
+    {
+        uint32_t key = get_u32(&p[2]);
+        uint32_t mask = get_u32(&p[6]);
+        uint8_t nlen = p[10];
+        return process_set_protect(key, std::string((const char *)&p[11], nlen), mask);
+    }
+    case ACTION_SET_COMMENT:
+    {
+        uint32_t key = get_u32(&p[2]);
+        uint8_t nlen = p[6];
+        uint8_t clen = p[7];
+        return process_set_comment(key, std::string((const char *)&p[8], nlen),
+            std::string((const char *)&p[8 + nlen], clen));
+    }
+    case ACTION_SAME_LOCK:
+        return process_same_lock(get_u32(&p[2]), get_u32(&p[6]));
+    case ACTION_UNSUPPORTED:
+        logger_warn("Unsupported action %u (Amiga/a314fs)\n", get_u16(&p[2]));
+        return pack_error(ERROR_ACTION_NOT_KNOWN);
+    default:
+        logger_warn("Unsupported action %u (a314d/a314fs)\n", rtype);
+        return pack_error(ERROR_ACTION_NOT_KNOWN);
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    load_config_file();
+
+    if (!a314_init("a314fs", argc, argv, nullptr))
+    {
+        logger_error("Unable to attach to a314d, shutting down\n");
+        return -1;
+    }
+
+    // a314_init() puts the socket in non-blocking mode for the poll-driven
+    // services; this daemon handles one request at a time with blocking
+    // round-trips, so switch it back.
+    drv_fd = a314_fd();
+    fcntl(drv_fd, F_SETFL, fcntl(drv_fd, F_GETFL, 0) & ~O_NONBLOCK);
+
+    if (chdir(shared_directory.c_str()) != 0)
+    {
+        logger_error("Unable to change directory to %s, shutting down\n", shared_directory.c_str());
+        return -1;
+    }
+
+    init_inotify();
+
+    logger_info("a314fsd is running, shared directory: %s\n", shared_directory.c_str());
+
+    bool has_stream = false;
+    uint32_t current_stream_id = 0;
+
+    while (true)
+    {
+        DriverMsg msg;
+        wait_for_msg(msg);
+
+        if (msg.type == MSG_CONNECT)
+        {
+            if (msg.payload.size() == 6 && memcmp(&msg.payload[0], "a314fs", 6) == 0)
+            {
+                if (has_stream)
+                    send_msg(MSG_RESET, current_stream_id, nullptr, 0);
+                has_stream = true;
+                current_stream_id = msg.stream_id;
+                send_connect_response(msg.stream_id, CONNECT_RES_OK);
+            }
+            else
+                send_connect_response(msg.stream_id, CONNECT_RES_UNKNOWN);
+        }
+        else if (msg.type == MSG_DATA)
+        {
+            if (msg.payload.size() < 8)
+                continue;
+
+            uint32_t address = get_u32(&msg.payload[0]);
+            uint32_t length = get_u32(&msg.payload[4]);
+
+            drain_inotify();
+
+            std::vector<uint8_t> req;
+            read_mem(address + 2, length - 2, req);
+
+            std::vector<uint8_t> res = process_request(req);
+            write_mem(address + 2, &res[0], res.size());
+
+            uint8_t done[2] = {0xff, 0xff};
+            send_msg(MSG_DATA, msg.stream_id, done, 2);
+        }
+        else if (msg.type == MSG_EOS)
+        {
+            if (has_stream && msg.stream_id == current_stream_id)
+            {
+                logger_debug("Got EOS, stream closed\n");
+                send_msg(MSG_EOS, msg.stream_id, nullptr, 0);
+                has_stream = false;
+            }
+        }
+        else if (msg.type == MSG_RESET)
+        {
+            if (has_stream && msg.stream_id == current_stream_id)
+            {
+                logger_debug("Got RESET, stream closed\n");
+                has_stream = false;
+            }
+        }
+    }
+
+    return 0;
+}
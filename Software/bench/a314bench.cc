@@ -0,0 +1,309 @@
+/*
+ * a314bench - link benchmark harness.
+ *
+ * Connects to a314d like any service client and times MSG_READ_MEM_REQ /
+ * MSG_WRITE_MEM_REQ round trips against Amiga memory for a series of
+ * payload sizes, reporting latency percentiles, request rate and
+ * throughput. This exercises the full SPI path: client socket, the SPI
+ * worker thread and the chip memory transfer. A second pipelined pass
+ * keeps several requests in flight to show the attainable throughput when
+ * latency is hidden.
+ *
+ * Reads default to chip memory address 0. Writes clobber Amiga memory and
+ * are only run when both -write and -address are given; point the address
+ * at memory reserved for the test.
+ *
+ * Stream round trips cannot be initiated from this side of the link (the
+ * Amiga originates stream connects), so stream latency is measured by the
+ * Amiga bench tool against the echo service instead.
+ *
+ * Usage: a314bench [-address <hex>] [-write] [-secs <n>] [-depth <n>]
+ */
+
+#include <arpa/inet.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#define logger_error(...) fprintf(stderr, __VA_ARGS__)
+
+// Messages that are communicated between driver and client.
+#define MSG_READ_MEM_REQ        5
+#define MSG_READ_MEM_RES        6
+#define MSG_WRITE_MEM_REQ       7
+#define MSG_WRITE_MEM_RES       8
+
+#define UNIX_SOCKET_PATH        "/run/a314/a314d.sock"
+
+static int drv_fd = -1;
+
+static uint32_t mem_address = 0;
+static bool do_writes = false;
+static int secs_per_size = 2;
+static int pipeline_depth = 8;
+
+static const int payload_sizes[] = {16, 256, 1024, 4096, 16384, 65536};
+#define NUM_SIZES ((int)(sizeof(payload_sizes) / sizeof(payload_sizes[0])))
+
+static uint64_t now_monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool send_all(const uint8_t *data, size_t len)
+{
+    size_t pos = 0;
+    while (pos < len)
+    {
+        ssize_t w = send(drv_fd, &data[pos], len - pos, 0);
+        if (w <= 0)
+            return false;
+        pos += w;
+    }
+    return true;
+}
+
+static bool recv_all(uint8_t *data, size_t len)
+{
+    size_t pos = 0;
+    while (pos < len)
+    {
+        ssize_t r = recv(drv_fd, &data[pos], len - pos, 0);
+        if (r <= 0)
+            return false;
+        pos += r;
+    }
+    return true;
+}
+
+static bool send_mem_req(int size)
+{
+    if (do_writes)
+    {
+        static std::vector<uint8_t> msg;
+        msg.resize(9 + 4 + size);
+        uint32_t length = 4 + size;
+        memcpy(&msg[0], &length, 4);
+        memset(&msg[4], 0, 4);
+        msg[8] = MSG_WRITE_MEM_REQ;
+        memcpy(&msg[9], &mem_address, 4);
+        return send_all(&msg[0], msg.size());
+    }
+    else
+    {
+        uint8_t msg[9 + 8];
+        uint32_t length = 8;
+        memcpy(&msg[0], &length, 4);
+        memset(&msg[4], 0, 4);
+        msg[8] = MSG_READ_MEM_REQ;
+        memcpy(&msg[9], &mem_address, 4);
+        uint32_t size32 = size;
+        memcpy(&msg[13], &size32, 4);
+        return send_all(msg, sizeof(msg));
+    }
+}
+
+// Reads one response message, discarding the payload.
+static bool recv_mem_res()
+{
+    uint8_t header[9];
+    if (!recv_all(header, sizeof(header)))
+        return false;
+
+    uint32_t plen;
+    memcpy(&plen, &header[0], 4);
+
+    uint8_t expected = do_writes ? MSG_WRITE_MEM_RES : MSG_READ_MEM_RES;
+    if (header[8] != expected)
+    {
+        logger_error("Expected message type %d but got %d\n", expected, header[8]);
+        return false;
+    }
+
+    static std::vector<uint8_t> payload;
+    payload.resize(plen);
+    return plen == 0 || recv_all(&payload[0], plen);
+}
+
+static uint64_t percentile(std::vector<uint64_t> &sorted, int pct)
+{
+    size_t index = sorted.size() * pct / 100;
+    if (index >= sorted.size())
+        index = sorted.size() - 1;
+    return sorted[index];
+}
+
+static bool bench_size(int size)
+{
+    // Synchronous round trips for the latency distribution.
+    std::vector<uint64_t> latencies;
+    latencies.reserve(100000);
+
+    uint64_t deadline = now_monotonic_ns() + (uint64_t)secs_per_size * 1000000000ULL;
+    while (now_monotonic_ns() < deadline)
+    {
+        uint64_t t0 = now_monotonic_ns();
+        if (!send_mem_req(size) || !recv_mem_res())
+            return false;
+        latencies.push_back(now_monotonic_ns() - t0);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    // Pipelined round trips for attainable throughput.
+    int in_flight = 0;
+    uint64_t completed = 0;
+
+    uint64_t t0 = now_monotonic_ns();
+    deadline = t0 + (uint64_t)secs_per_size * 1000000000ULL;
+
+    while (in_flight < pipeline_depth)
+    {
+        if (!send_mem_req(size))
+            return false;
+        in_flight++;
+    }
+
+    while (now_monotonic_ns() < deadline)
+    {
+        if (!recv_mem_res())
+            return false;
+        completed++;
+        if (!send_mem_req(size))
+            return false;
+    }
+
+    while (in_flight-- > 0)
+    {
+        if (!recv_mem_res())
+            return false;
+        completed++;
+    }
+
+    uint64_t elapsed = now_monotonic_ns() - t0;
+    double mbps = (double)completed * size / ((double)elapsed / 1e9) / (1024.0 * 1024.0);
+    double rps = (double)completed / ((double)elapsed / 1e9);
+
+    printf("%7d %8d  %8.1f %8.1f %8.1f %8.1f %8.1f  %9.0f %8.2f\n",
+        size, (int)latencies.size(),
+        latencies.front() / 1000.0,
+        percentile(latencies, 50) / 1000.0,
+        percentile(latencies, 90) / 1000.0,
+        percentile(latencies, 99) / 1000.0,
+        latencies.back() / 1000.0,
+        rps, mbps);
+
+    return true;
+}
+
+static bool connect_a314d()
+{
+    drv_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (drv_fd >= 0)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, UNIX_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+        if (connect(drv_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return true;
+
+        close(drv_fd);
+    }
+
+    drv_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (drv_fd < 0)
+        return false;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(7110);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(drv_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(drv_fd);
+        return false;
+    }
+
+    int flag = 1;
+    setsockopt(drv_fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool have_address = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-address") == 0 && i + 1 < argc)
+        {
+            mem_address = strtoul(argv[++i], nullptr, 16);
+            have_address = true;
+        }
+        else if (strcmp(argv[i], "-write") == 0)
+            do_writes = true;
+        else if (strcmp(argv[i], "-secs") == 0 && i + 1 < argc)
+            secs_per_size = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-depth") == 0 && i + 1 < argc)
+            pipeline_depth = atoi(argv[++i]);
+        else
+        {
+            logger_error("Usage: a314bench [-address <hex>] [-write] [-secs <n>] [-depth <n>]\n");
+            return -1;
+        }
+    }
+
+    if (do_writes && !have_address)
+    {
+        logger_error("Writes clobber Amiga memory; -write requires an explicit -address\n");
+        return -1;
+    }
+
+    if (secs_per_size < 1 || pipeline_depth < 1)
+    {
+        logger_error("Invalid -secs or -depth\n");
+        return -1;
+    }
+
+    if (!connect_a314d())
+    {
+        logger_error("Unable to connect to a314d\n");
+        return -1;
+    }
+
+    printf("%s benchmark at address %08x, %d s per size, pipeline depth %d\n",
+        do_writes ? "write_mem" : "read_mem", mem_address, secs_per_size, pipeline_depth);
+    printf("   size     reqs    min_us   p50_us   p90_us   p99_us   max_us      req/s     MB/s\n");
+
+    for (int i = 0; i < NUM_SIZES; i++)
+    {
+        if (!bench_size(payload_sizes[i]))
+        {
+            logger_error("Connection to a314d was closed\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * a314echod - echo service for link benchmarking.
+ *
+ * Registers the "echo" service and sends every MSG_DATA payload straight
+ * back on the stream it arrived on. The Amiga-side bench tool drives it to
+ * measure stream round-trip latency and throughput end to end: through
+ * a314.device, the rings, a314d and the client socket, and back.
+ *
+ * Built on a314client.h, and doubles as the reference consumer for it.
+ */
+
+#include <stdio.h>
+
+#include "../a314client/a314client.h"
+
+#define LOGGER_DEBUG 0
+#define logger_debug(...) do { if (LOGGER_DEBUG) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_INFO 1
+#define logger_info(...) do { if (LOGGER_INFO) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_ERROR 1
+#define logger_error(...) do { if (LOGGER_ERROR) fprintf(stderr, __VA_ARGS__); } while (0)
+
+#define SERVICE_NAME "echo"
+
+static void process_drv_msg(uint32_t stream_id, uint8_t type, const uint8_t *payload, size_t len)
+{
+    if (type == MSG_CONNECT)
+    {
+        a314_connect_response(stream_id, CONNECT_RES_OK);
+        logger_debug("Stream %u connected\n", stream_id);
+    }
+    else if (type == MSG_DATA)
+        a314_send_data(stream_id, payload, len);
+    else if (type == MSG_EOS)
+        a314_send_eos(stream_id);
+}
+
+int main(int argc, char **argv)
+{
+    if (!a314_init(SERVICE_NAME, argc, argv, process_drv_msg))
+    {
+        logger_error("Unable to attach to a314d, shutting down\n");
+        return -1;
+    }
+
+    logger_info("echo service is running\n");
+
+    int res = a314_run();
+    logger_info("Connection to a314d was closed, terminating.\n");
+    return res;
+}
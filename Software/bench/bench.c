@@ -0,0 +1,213 @@
+/*
+ * bench - measures stream round-trip latency and throughput against the
+ * echo service on the Pi.
+ *
+ * For each payload size a number of synchronous write/read round trips are
+ * made on an a314 stream and timed with the E clock, which gives the end to
+ * end latency through a314.device, the rings, a314d and the echo service.
+ */
+
+#include <exec/types.h>
+#include <exec/memory.h>
+
+#include <devices/timer.h>
+
+#include <proto/exec.h>
+#include <proto/timer.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../a314device/a314.h"
+#include "../a314device/proto_a314.h"
+
+#define SERVICE_NAME "echo"
+
+#define ROUND_TRIPS 200
+
+struct MsgPort *sync_mp = NULL;
+
+struct A314_IORequest *sync_a314_req = NULL;
+struct timerequest *timer_req = NULL;
+
+struct Library *A314Base;
+struct Device *TimerBase;
+
+BOOL a314_device_open = FALSE;
+BOOL timer_device_open = FALSE;
+BOOL stream_open = FALSE;
+
+ULONG socket;
+UBYTE buffer[256];
+
+int payload_sizes[] = {4, 16, 64, 252};
+#define NUM_SIZES (sizeof(payload_sizes) / sizeof(payload_sizes[0]))
+
+void start_a314_cmd(struct MsgPort *reply_port, struct A314_IORequest *ior, UWORD cmd, char *buffer, int length)
+{
+	ior->a314_Request.io_Message.mn_ReplyPort = reply_port;
+	ior->a314_Request.io_Command = cmd;
+	ior->a314_Request.io_Error = 0;
+	ior->a314_Socket = socket;
+	ior->a314_Buffer = buffer;
+	ior->a314_Length = length;
+	SendIO((struct IORequest *)ior);
+}
+
+BYTE a314_connect(char *name)
+{
+	socket = time(NULL);
+	start_a314_cmd(sync_mp, sync_a314_req, A314_CONNECT, name, strlen(name));
+	Wait(1L << sync_mp->mp_SigBit);
+	GetMsg(sync_mp);
+	return sync_a314_req->a314_Request.io_Error;
+}
+
+BYTE a314_write(char *buffer, int length)
+{
+	start_a314_cmd(sync_mp, sync_a314_req, A314_WRITE, buffer, length);
+	Wait(1L << sync_mp->mp_SigBit);
+	GetMsg(sync_mp);
+	return sync_a314_req->a314_Request.io_Error;
+}
+
+BYTE a314_read(char *buffer, int length)
+{
+	start_a314_cmd(sync_mp, sync_a314_req, A314_READ, buffer, length);
+	Wait(1L << sync_mp->mp_SigBit);
+	GetMsg(sync_mp);
+	return sync_a314_req->a314_Request.io_Error;
+}
+
+BYTE a314_reset()
+{
+	start_a314_cmd(sync_mp, sync_a314_req, A314_RESET, NULL, 0);
+	Wait(1L << sync_mp->mp_SigBit);
+	GetMsg(sync_mp);
+	return sync_a314_req->a314_Request.io_Error;
+}
+
+ULONG eclock_diff_micros(struct EClockVal *t0, struct EClockVal *t1, ULONG eclock_freq)
+{
+	ULONG ticks = t1->ev_lo - t0->ev_lo;
+	return (ULONG)(((unsigned long long)ticks * 1000000) / eclock_freq);
+}
+
+int bench_size(int size, ULONG eclock_freq)
+{
+	struct EClockVal t0, t1;
+	ULONG total_micros;
+	int i;
+
+	ReadEClock(&t0);
+
+	for (i = 0; i < ROUND_TRIPS; i++)
+	{
+		if (a314_write(buffer, size) != A314_WRITE_OK)
+		{
+			printf("Write failed\n");
+			return -1;
+		}
+
+		if (a314_read(buffer, 255) != A314_READ_OK)
+		{
+			printf("Read failed\n");
+			return -1;
+		}
+
+		if (sync_a314_req->a314_Length != size)
+		{
+			printf("Echoed %ld bytes, expected %d\n", sync_a314_req->a314_Length, size);
+			return -1;
+		}
+	}
+
+	ReadEClock(&t1);
+
+	total_micros = eclock_diff_micros(&t0, &t1, eclock_freq);
+
+	printf("%4d bytes: %5ld us/rt, %6ld rt/s, %7ld bytes/s\n",
+		size,
+		total_micros / ROUND_TRIPS,
+		(ULONG)(((unsigned long long)ROUND_TRIPS * 1000000) / total_micros),
+		(ULONG)(((unsigned long long)ROUND_TRIPS * size * 2 * 1000000) / total_micros));
+
+	return 0;
+}
+
+int main()
+{
+	ULONG eclock_freq;
+	struct EClockVal ev;
+	int i;
+
+	sync_mp = CreatePort(NULL, 0);
+	if (!sync_mp)
+	{
+		printf("Unable to create sync reply message port\n");
+		goto cleanup;
+	}
+
+	sync_a314_req = (struct A314_IORequest *)CreateExtIO(sync_mp, sizeof(struct A314_IORequest));
+	timer_req = (struct timerequest *)CreateExtIO(sync_mp, sizeof(struct timerequest));
+	if (!sync_a314_req || !timer_req)
+	{
+		printf("Unable to create IO requests\n");
+		goto cleanup;
+	}
+
+	if (OpenDevice(A314_NAME, 0, (struct IORequest *)sync_a314_req, 0))
+	{
+		printf("Unable to open a314.device\n");
+		goto cleanup;
+	}
+
+	a314_device_open = TRUE;
+
+	A314Base = &(sync_a314_req->a314_Request.io_Device->dd_Library);
+
+	if (OpenDevice(TIMERNAME, UNIT_ECLOCK, (struct IORequest *)timer_req, 0))
+	{
+		printf("Unable to open timer.device\n");
+		goto cleanup;
+	}
+
+	timer_device_open = TRUE;
+
+	TimerBase = timer_req->tr_node.io_Device;
+
+	eclock_freq = ReadEClock(&ev);
+
+	if (a314_connect(SERVICE_NAME) != A314_CONNECT_OK)
+	{
+		printf("Unable to connect to echo service\n");
+		goto cleanup;
+	}
+
+	stream_open = TRUE;
+
+	printf("Benchmarking stream round trips, %d per payload size...\n", ROUND_TRIPS);
+
+	for (i = 0; i < NUM_SIZES; i++)
+	{
+		if (bench_size(payload_sizes[i], eclock_freq) != 0)
+			break;
+	}
+
+cleanup:
+	if (stream_open)
+		a314_reset();
+	if (timer_device_open)
+		CloseDevice((struct IORequest *)timer_req);
+	if (a314_device_open)
+		CloseDevice((struct IORequest *)sync_a314_req);
+	if (timer_req)
+		DeleteExtIO((struct IORequest *)timer_req);
+	if (sync_a314_req)
+		DeleteExtIO((struct IORequest *)sync_a314_req);
+	if (sync_mp)
+		DeletePort(sync_mp);
+
+	return 0;
+}
@@ -0,0 +1,724 @@
+/*
+ * a314diskd - native Pi-side service for the a314disk.device.
+ *
+ * Speaks the same wire protocol as disk.py, but memory-maps the disk image
+ * files: a READ_TRACK_REQ is served with a memcpy straight out of the
+ * mapping, and a WRITE_TRACK_REQ is a memcpy into it. Dirty ranges are
+ * write-combined and flushed with a periodic msync instead of per-request
+ * seek/write syscalls. The driver socket handling is a314client.h; the
+ * sockets included here are for the control port.
+ */
+
+#include <netinet/in.h>
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "../a314client/a314client.h"
+
+#define LOGGER_TRACE 0
+#define logger_trace(...) do { if (LOGGER_TRACE) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_DEBUG 0
+#define logger_debug(...) do { if (LOGGER_DEBUG) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_INFO 1
+#define logger_info(...) do { if (LOGGER_INFO) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_WARN 1
+#define logger_warn(...) do { if (LOGGER_WARN) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_ERROR 1
+#define logger_error(...) do { if (LOGGER_ERROR) fprintf(stderr, __VA_ARGS__); } while (0)
+
+#define SERVICE_NAME            "disk"
+#define CONF_FILE               "/etc/opt/a314/disk.conf"
+#define CONTROL_PORT            23890
+
+// Kinds in the records exchanged with Software/disk/device.c.
+#define READ_TRACK_REQ          1
+#define WRITE_TRACK_REQ         2
+#define READ_TRACK_RES          3
+#define WRITE_TRACK_RES         4
+#define INSERT_NOTIFY           5
+#define EJECT_NOTIFY            6
+#define SET_GEOMETRY            7
+
+#define OP_RES_OK               0
+#define OP_RES_NOT_PRESENT      1
+#define OP_RES_WRITE_PROTECTED  2
+
+#define NUM_DRIVES              4
+
+// Seconds between flushes of write-combined dirty ranges.
+#define SYNC_INTERVAL_SECS      5
+
+static bool have_stream = false;
+static uint32_t current_stream_id = 0;
+
+// ---------------------------------------------------------------------------
+// Service messages on top of a314client.h.
+
+// Appends a write-mem request and returns a pointer to its data area, so
+// track data is copied from the mapping straight into the outgoing message.
+static uint8_t *append_write_mem_req(uint32_t address, uint32_t length)
+{
+    uint8_t *p = a314_append(MSG_WRITE_MEM_REQ, 0, 4 + length);
+    memcpy(&p[0], &address, 4);
+    return &p[4];
+}
+
+static void send_track_res(uint32_t stream_id, uint8_t kind, uint8_t unit, uint8_t result)
+{
+    uint8_t *p = a314_append(MSG_DATA, stream_id, 3);
+    p[0] = kind;
+    p[1] = unit;
+    p[2] = result;
+}
+
+// ---------------------------------------------------------------------------
+// Drives.
+
+struct Drive
+{
+    int fd;
+    uint8_t *map;
+    size_t size;
+    bool writable;
+
+    uint8_t heads;
+    uint8_t sectors;
+    uint32_t cylinders;
+    bool geometry_sent;
+
+    // Write-combined dirty range, flushed by sync_dirty_ranges().
+    bool dirty;
+    size_t dirty_lo;
+    size_t dirty_hi;
+
+    Drive() : fd(-1), map(nullptr), size(0), writable(false),
+        heads(0), sectors(0), cylinders(0), geometry_sent(false),
+        dirty(false), dirty_lo(0), dirty_hi(0) {}
+
+    bool present() const { return map != nullptr; }
+};
+
+static Drive drives[NUM_DRIVES];
+
+static void mark_dirty(Drive &drive, size_t offset, size_t length)
+{
+    if (!drive.dirty)
+    {
+        drive.dirty = true;
+        drive.dirty_lo = offset;
+        drive.dirty_hi = offset + length;
+    }
+    else
+    {
+        if (offset < drive.dirty_lo)
+            drive.dirty_lo = offset;
+        if (offset + length > drive.dirty_hi)
+            drive.dirty_hi = offset + length;
+    }
+}
+
+static void sync_drive(Drive &drive, int flags)
+{
+    if (!drive.dirty)
+        return;
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t lo = drive.dirty_lo & ~((size_t)page - 1);
+    size_t hi = drive.dirty_hi;
+
+    if (msync(drive.map + lo, hi - lo, flags) != 0)
+        logger_warn("msync failed with errno = %d\n", errno);
+
+    drive.dirty = false;
+}
+
+static void sync_dirty_ranges()
+{
+    for (int i = 0; i < NUM_DRIVES; i++)
+        sync_drive(drives[i], MS_ASYNC);
+}
+
+static std::string eject_adf(int unit)
+{
+    Drive &drive = drives[unit];
+    if (!drive.present())
+        return "No disk in unit " + std::to_string(unit) + " to eject";
+
+    sync_drive(drive, MS_SYNC);
+    munmap(drive.map, drive.size);
+    close(drive.fd);
+    drive.map = nullptr;
+    drive.fd = -1;
+    drive.size = 0;
+
+    if (have_stream)
+    {
+        uint8_t *p = a314_append(MSG_DATA, current_stream_id, 2);
+        p[0] = EJECT_NOTIFY;
+        p[1] = (uint8_t)unit;
+    }
+
+    return "Ejected disk from unit " + std::to_string(unit);
+}
+
+static std::string insert_adf(int unit, const std::string &filename, bool writable)
+{
+    eject_adf(unit);
+
+    int fd = open(filename.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        return "Failed to open disk file '" + filename + "'";
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return "Failed to open disk file '" + filename + "'";
+    }
+
+    size_t size = st.st_size;
+
+    uint8_t heads, sectors;
+    uint32_t cylinders;
+
+    if (size == 80 * 2 * 11 * 512)
+    {
+        heads = 2;
+        sectors = 11;
+        cylinders = 80;
+    }
+    else if (size < (1 << 20))
+    {
+        close(fd);
+        return "Failed: HDF must be at least 1 MB";
+    }
+    else if ((size & ((1 << 14) - 1)) != 0)
+    {
+        close(fd);
+        return "Failed: HDF size must be a multiple of 16 kB";
+    }
+    else
+    {
+        heads = 1;
+        sectors = 32;
+        cylinders = size >> 14;
+    }
+
+    Drive &drive = drives[unit];
+
+    if (drive.geometry_sent &&
+        (drive.heads != heads || drive.sectors != sectors || drive.cylinders != cylinders))
+    {
+        close(fd);
+        return "Failed: A disk with a different geometry was previously inserted";
+    }
+
+    int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+    void *map = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        return "Failed to mmap disk file '" + filename + "'";
+    }
+
+    drive.fd = fd;
+    drive.map = (uint8_t *)map;
+    drive.size = size;
+    drive.writable = writable;
+    drive.heads = heads;
+    drive.sectors = sectors;
+    drive.cylinders = cylinders;
+
+    if (have_stream)
+    {
+        if (!drive.geometry_sent)
+        {
+            uint8_t *p = a314_append(MSG_DATA, current_stream_id, 8);
+            p[0] = SET_GEOMETRY;
+            p[1] = (uint8_t)unit;
+            p[2] = heads;
+            p[3] = sectors;
+            p[4] = (uint8_t)(cylinders >> 24);
+            p[5] = (uint8_t)(cylinders >> 16);
+            p[6] = (uint8_t)(cylinders >> 8);
+            p[7] = (uint8_t)cylinders;
+            drive.geometry_sent = true;
+        }
+
+        uint8_t *p = a314_append(MSG_DATA, current_stream_id, 3);
+        p[0] = INSERT_NOTIFY;
+        p[1] = (uint8_t)unit;
+        p[2] = writable ? 1 : 0;
+    }
+
+    return "Inserted disk file '" + filename + "' in unit " + std::to_string(unit);
+}
+
+// ---------------------------------------------------------------------------
+// Boot block fixup; patches in a boot block that silently mounts the drive,
+// same as disk.py.
+
+static const uint8_t boot_code_silent[] = {
+    0x43, 0xFA, 0x00, 0x3E, 0x70, 0x25, 0x4E, 0xAE,
+    0xFD, 0xD8, 0x4A, 0x80, 0x67, 0x0C, 0x22, 0x40,
+    0x08, 0xE9, 0x00, 0x06, 0x00, 0x22, 0x4E, 0xAE,
+    0xFE, 0x62, 0x43, 0xFA, 0x00, 0x18, 0x4E, 0xAE,
+    0xFF, 0xA0, 0x4A, 0x80, 0x67, 0x0A, 0x20, 0x40,
+    0x20, 0x68, 0x00, 0x16, 0x70, 0x00, 0x4E, 0x75,
+    0x70, 0xFF, 0x4E, 0x75, 0x64, 0x6F, 0x73, 0x2E,
+    0x6C, 0x69, 0x62, 0x72, 0x61, 0x72, 0x79, 0x00,
+    0x65, 0x78, 0x70, 0x61, 0x6E, 0x73, 0x69, 0x6F,
+    0x6E, 0x2E, 0x6C, 0x69, 0x62, 0x72, 0x61, 0x72,
+    0x79};
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t x)
+{
+    p[0] = (uint8_t)(x >> 24);
+    p[1] = (uint8_t)(x >> 16);
+    p[2] = (uint8_t)(x >> 8);
+    p[3] = (uint8_t)x;
+}
+
+// Fixes up the boot block in dst (a copy of the start of the image, at least
+// 1024 bytes valid) if the image has a DOS signature and no boot checksum.
+static void fixup_boot_block(uint8_t *dst, const Drive &drive)
+{
+    if (memcmp(dst, "DOS", 3) != 0 || get_be32(&dst[4]) != 0)
+        return;
+
+    memcpy(&dst[12], boot_code_silent, sizeof(boot_code_silent));
+
+    uint32_t sector_count = (uint32_t)drive.heads * drive.sectors * drive.cylinders;
+    put_be32(&dst[8], sector_count / 2);
+
+    uint64_t checksum = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        checksum += get_be32(&dst[i * 4]);
+        if (checksum >= 0x100000000ULL)
+            checksum = checksum - 0x100000000ULL + 1;
+    }
+    put_be32(&dst[4], (uint32_t)checksum ^ 0xffffffff);
+}
+
+// ---------------------------------------------------------------------------
+// Request processing.
+
+struct MemOp
+{
+    uint32_t stream_id;
+    uint8_t unit;
+    uint32_t offset;
+    uint32_t length;
+};
+
+static std::deque<MemOp> mem_read_queue;
+static std::deque<MemOp> mem_write_queue;
+
+static void process_stream_data(uint32_t stream_id, const uint8_t *payload, size_t len)
+{
+    if (len < 12)
+        return;
+
+    uint8_t kind = payload[0];
+    uint8_t unit = payload[1];
+    uint16_t length = ((uint16_t)payload[2] << 8) | payload[3];
+    uint32_t offset = get_be32(&payload[4]);
+    uint32_t address = get_be32(&payload[8]);
+
+    if (unit >= NUM_DRIVES)
+        return;
+
+    Drive &drive = drives[unit];
+
+    if (kind == READ_TRACK_REQ)
+    {
+        if (!drive.present())
+        {
+            send_track_res(stream_id, READ_TRACK_RES, unit, OP_RES_NOT_PRESENT);
+            return;
+        }
+
+        if ((uint64_t)offset + length > drive.size)
+        {
+            send_track_res(stream_id, READ_TRACK_RES, unit, OP_RES_NOT_PRESENT);
+            return;
+        }
+
+        // The track data is copied from the mapping directly into the
+        // outgoing write-mem message.
+        uint8_t *dst = append_write_mem_req(address, length);
+        memcpy(dst, drive.map + offset, length);
+
+        if (offset == 0)
+        {
+            if (length >= 1024)
+                fixup_boot_block(dst, drive);
+            else if (drive.size >= 1024)
+            {
+                uint8_t block[1024];
+                memcpy(block, drive.map, 1024);
+                fixup_boot_block(block, drive);
+                memcpy(dst, block, length);
+            }
+        }
+
+        MemOp op = {stream_id, unit, offset, length};
+        mem_write_queue.push_back(op);
+    }
+    else if (kind == WRITE_TRACK_REQ)
+    {
+        if (!drive.present())
+        {
+            send_track_res(stream_id, WRITE_TRACK_RES, unit, OP_RES_NOT_PRESENT);
+            return;
+        }
+        if (!drive.writable)
+        {
+            send_track_res(stream_id, WRITE_TRACK_RES, unit, OP_RES_WRITE_PROTECTED);
+            return;
+        }
+        if ((uint64_t)offset + length > drive.size)
+        {
+            send_track_res(stream_id, WRITE_TRACK_RES, unit, OP_RES_NOT_PRESENT);
+            return;
+        }
+
+        MemOp op = {stream_id, unit, offset, length};
+        mem_read_queue.push_back(op);
+        a314_read_mem(address, length);
+    }
+}
+
+static void process_write_mem_res()
+{
+    MemOp op = mem_write_queue.front();
+    mem_write_queue.pop_front();
+    if (have_stream && op.stream_id == current_stream_id)
+        send_track_res(op.stream_id, READ_TRACK_RES, op.unit, OP_RES_OK);
+}
+
+static void process_read_mem_res(const uint8_t *data, size_t len)
+{
+    MemOp op = mem_read_queue.front();
+    mem_read_queue.pop_front();
+
+    if (!have_stream || op.stream_id != current_stream_id)
+        return;
+
+    Drive &drive = drives[op.unit];
+
+    // The image may have been swapped for a smaller one through the control
+    // port while the read_mem was in flight, so the bounds are re-checked
+    // without forming a sum (or difference) that can wrap.
+    if (!drive.present() || op.offset >= drive.size)
+    {
+        send_track_res(op.stream_id, WRITE_TRACK_RES, op.unit, OP_RES_NOT_PRESENT);
+        return;
+    }
+
+    if (len > drive.size - op.offset)
+        len = drive.size - op.offset;
+
+    memcpy(drive.map + op.offset, data, len);
+    mark_dirty(drive, op.offset, len);
+
+    send_track_res(op.stream_id, WRITE_TRACK_RES, op.unit, OP_RES_OK);
+}
+
+// ---------------------------------------------------------------------------
+// Configuration; disk.conf is a small JSON file and the auto-insert entries
+// are scanned for directly rather than pulling in a JSON library.
+
+struct AutoInsert
+{
+    int unit;
+    std::string filename;
+    bool rw;
+};
+
+static std::vector<AutoInsert> auto_insert;
+
+static void load_config_file()
+{
+    FILE *f = fopen(CONF_FILE, "rb");
+    if (f == nullptr)
+        return;
+
+    std::string text;
+    char buf[512];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) != 0)
+        text.append(buf, n);
+    fclose(f);
+
+    size_t pos = text.find("\"auto-insert\"");
+    if (pos == std::string::npos)
+        return;
+
+    while (true)
+    {
+        size_t obj = text.find('{', pos);
+        if (obj == std::string::npos)
+            break;
+        size_t end = text.find('}', obj);
+        if (end == std::string::npos)
+            break;
+
+        std::string entry = text.substr(obj, end - obj);
+
+        AutoInsert ai;
+        ai.unit = -1;
+        ai.rw = false;
+
+        size_t p = entry.find("\"unit\"");
+        if (p != std::string::npos)
+        {
+            p = entry.find(':', p);
+            if (p != std::string::npos)
+                ai.unit = atoi(&entry[p + 1]);
+        }
+
+        p = entry.find("\"filename\"");
+        if (p != std::string::npos)
+        {
+            p = entry.find(':', p);
+            if (p != std::string::npos)
+            {
+                size_t q1 = entry.find('"', p);
+                size_t q2 = q1 == std::string::npos ? q1 : entry.find('"', q1 + 1);
+                if (q2 != std::string::npos)
+                    ai.filename = entry.substr(q1 + 1, q2 - q1 - 1);
+            }
+        }
+
+        p = entry.find("\"rw\"");
+        if (p != std::string::npos)
+        {
+            p = entry.find(':', p);
+            if (p != std::string::npos)
+            {
+                size_t v = entry.find_first_not_of(" \t", p + 1);
+                ai.rw = v != std::string::npos && entry.compare(v, 4, "true") == 0;
+            }
+        }
+
+        if (ai.unit >= 0 && ai.unit < NUM_DRIVES && !ai.filename.empty())
+            auto_insert.push_back(ai);
+
+        pos = end + 1;
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+static void process_drv_msg(uint32_t stream_id, uint8_t type, const uint8_t *payload, size_t len)
+{
+    if (type == MSG_CONNECT)
+    {
+        if (len == strlen(SERVICE_NAME) && memcmp(payload, SERVICE_NAME, len) == 0 && !have_stream)
+        {
+            logger_info("Amiga connected\n");
+            have_stream = true;
+            current_stream_id = stream_id;
+            a314_connect_response(stream_id, CONNECT_RES_OK);
+
+            for (auto &ai : auto_insert)
+                logger_info("%s\n", insert_adf(ai.unit, ai.filename, ai.rw).c_str());
+        }
+        else
+            a314_connect_response(stream_id, CONNECT_RES_UNKNOWN);
+    }
+    else if (type == MSG_READ_MEM_RES)
+        process_read_mem_res(payload, len);
+    else if (type == MSG_WRITE_MEM_RES)
+        process_write_mem_res();
+    else if (have_stream && stream_id == current_stream_id)
+    {
+        if (type == MSG_DATA)
+            process_stream_data(stream_id, payload, len);
+        else if (type == MSG_RESET)
+        {
+            have_stream = false;
+            for (int i = 0; i < NUM_DRIVES; i++)
+            {
+                eject_adf(i);
+                drives[i].geometry_sent = false;
+            }
+            logger_info("Amiga disconnected\n");
+        }
+    }
+}
+
+static void handle_control_command(int fd)
+{
+    char buf[512];
+    ssize_t r = recv(fd, buf, sizeof(buf) - 1, 0);
+    if (r <= 0)
+    {
+        close(fd);
+        return;
+    }
+    buf[r] = 0;
+
+    std::vector<std::string> arr;
+    char *save = nullptr;
+    for (char *tok = strtok_r(buf, " \t\r\n", &save); tok != nullptr;
+         tok = strtok_r(nullptr, " \t\r\n", &save))
+        arr.push_back(tok);
+
+    std::string res;
+    if (arr.empty())
+        res = "Unknown command ''";
+    else if (arr[0] == "eject" && arr.size() >= 2)
+        res = eject_adf(atoi(arr[1].c_str()));
+    else if (arr[0] == "insert" && arr.size() >= 3)
+    {
+        bool rw = arr[2] == "-rw";
+        size_t idx = rw ? 3 : 2;
+
+        std::string fn;
+        for (size_t i = idx; i < arr.size(); i++)
+        {
+            if (i != idx)
+                fn += " ";
+            fn += arr[i];
+        }
+
+        if (fn.empty())
+            res = "Unknown command '" + arr[0] + "'";
+        else
+            res = insert_adf(atoi(arr[1].c_str()), fn, rw);
+    }
+    else
+        res = "Unknown command '" + arr[0] + "'";
+
+    res += "\n";
+    send(fd, res.c_str(), res.size(), 0);
+    shutdown(fd, SHUT_WR);
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    load_config_file();
+
+    if (!a314_init(SERVICE_NAME, argc, argv, process_drv_msg))
+    {
+        logger_error("Unable to attach to a314d, shutting down\n");
+        return -1;
+    }
+
+    int control_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (control_socket >= 0)
+    {
+        int flag = 1;
+        setsockopt(control_socket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(CONTROL_PORT);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (bind(control_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(control_socket, 10) != 0)
+        {
+            logger_warn("Unable to listen on control port %d\n", CONTROL_PORT);
+            close(control_socket);
+            control_socket = -1;
+        }
+    }
+
+    logger_info("Disk service is running\n");
+
+    time_t last_sync = time(nullptr);
+
+    while (true)
+    {
+        struct pollfd fds[2];
+        fds[0].fd = a314_fd();
+        fds[0].events = POLLIN | (a314_want_write() ? POLLOUT : 0);
+        fds[1].fd = control_socket;
+        fds[1].events = POLLIN;
+
+        int n = poll(fds, control_socket >= 0 ? 2 : 1, 1000);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                if (have_stream)
+                {
+                    a314_send_reset(current_stream_id);
+                    a314_flush();
+                }
+                break;
+            }
+            logger_error("poll failed with unexpected errno = %d\n", errno);
+            return -1;
+        }
+
+        if (n > 0 && (fds[0].revents & (POLLIN | POLLERR | POLLHUP)))
+        {
+            if (!a314_handle_readable())
+            {
+                logger_error("Connection to a314d was closed, terminating.\n");
+                break;
+            }
+        }
+
+        if (n > 0 && control_socket >= 0 && (fds[1].revents & POLLIN))
+        {
+            int cs = accept(control_socket, nullptr, nullptr);
+            if (cs >= 0)
+                handle_control_command(cs);
+        }
+
+        if (!a314_flush())
+        {
+            logger_error("Connection to a314d was closed, terminating.\n");
+            break;
+        }
+
+        time_t now = time(nullptr);
+        if (now - last_sync >= SYNC_INTERVAL_SECS)
+        {
+            sync_dirty_ranges();
+            last_sync = now;
+        }
+    }
+
+    for (int i = 0; i < NUM_DRIVES; i++)
+        eject_adf(i);
+
+    if (control_socket >= 0)
+        close(control_socket);
+
+    logger_info("Disk service stopped\n");
+    return 0;
+}
@@ -0,0 +1,356 @@
+/*
+ * a314ethd - native Pi-side bridge for the a314 SANA-II ethernet device.
+ *
+ * Speaks the same wire protocol as ethernet.py, but reads TAP frames into a
+ * pre-allocated buffer pool and batches all driver messages produced during
+ * one wakeup into a single send() to a314d, so there are no per-frame
+ * allocations and small-packet workloads do not pay one syscall per frame.
+ * The driver socket handling is a314client.h; this file only implements the
+ * TAP bridging.
+ */
+
+#include <linux/if.h>
+#include <linux/if_tun.h>
+
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <vector>
+
+#include "../a314client/a314client.h"
+
+#define LOGGER_TRACE 0
+#define logger_trace(...) do { if (LOGGER_TRACE) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_DEBUG 0
+#define logger_debug(...) do { if (LOGGER_DEBUG) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_INFO 1
+#define logger_info(...) do { if (LOGGER_INFO) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_WARN 1
+#define logger_warn(...) do { if (LOGGER_WARN) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_ERROR 1
+#define logger_error(...) do { if (LOGGER_ERROR) fprintf(stderr, __VA_ARGS__); } while (0)
+
+#define SERVICE_NAME            "ethernet"
+#define TAP_DEV_NAME            "tap0"
+
+// Kinds in the ServiceMsg records exchanged with Software/ethernet/device.c.
+#define READ_FRAME_REQ          1
+#define WRITE_FRAME_REQ         2
+#define READ_FRAME_RES          3
+#define WRITE_FRAME_RES         4
+
+#define FRAME_BUF_SIZE          1600
+#define FRAME_BUF_COUNT         64
+
+// Frames read from TAP during the first seconds after startup are dropped,
+// to not flood the Amiga with packets while the network comes up.
+#define DROP_START_SECS         15
+
+static int tap_fd = -1;
+
+static bool have_stream = false;
+static uint32_t current_stream_id = 0;
+
+// ---------------------------------------------------------------------------
+// Pre-allocated TAP frame buffers. Frames that arrive while the Amiga has no
+// outstanding READ_FRAME_REQ are parked here; if the pool runs dry further
+// frames are dropped, which is what an ethernet is allowed to do.
+
+struct FrameBuffer
+{
+    uint8_t data[FRAME_BUF_SIZE];
+    int length;
+};
+
+static FrameBuffer frame_pool[FRAME_BUF_COUNT];
+static std::vector<int> free_buffers;
+static std::deque<int> buffered_frames;
+
+static unsigned long long dropped_frames = 0;
+
+// ---------------------------------------------------------------------------
+// Sends the big-endian (address, length, kind) record that device.c expects
+// in each stream data message.
+
+static void send_service_msg(uint32_t stream_id, uint32_t address, uint16_t length, uint16_t kind)
+{
+    uint8_t *p = a314_append(MSG_DATA, stream_id, 8);
+    p[0] = (uint8_t)(address >> 24);
+    p[1] = (uint8_t)(address >> 16);
+    p[2] = (uint8_t)(address >> 8);
+    p[3] = (uint8_t)address;
+    p[4] = (uint8_t)(length >> 8);
+    p[5] = (uint8_t)length;
+    p[6] = (uint8_t)(kind >> 8);
+    p[7] = (uint8_t)kind;
+}
+
+// ---------------------------------------------------------------------------
+// Outstanding memory operations; responses from a314d arrive in the same
+// order as the requests were sent.
+
+struct MemOp
+{
+    uint32_t stream_id;
+    uint32_t address;
+    uint32_t length;
+};
+
+static std::deque<MemOp> mem_read_queue;
+static std::deque<MemOp> mem_write_queue;
+static std::deque<MemOp> waiting_read_reqs;
+
+static bool drop_start = true;
+static time_t start_time;
+
+static void forward_frame(uint32_t stream_id, uint32_t address, uint32_t length,
+    const uint8_t *frame, int frame_length)
+{
+    if ((int)length < frame_length)
+        logger_error("Fatal error, read frame from TAP larger than buffer\n");
+
+    MemOp op = {stream_id, address, (uint32_t)frame_length};
+    mem_write_queue.push_back(op);
+    a314_write_mem(address, frame, frame_length);
+}
+
+static void process_tap_frame(const uint8_t *frame, int length)
+{
+    if (!have_stream)
+        return;
+
+    if (drop_start)
+    {
+        if (time(nullptr) < start_time + DROP_START_SECS)
+            return;
+        drop_start = false;
+    }
+
+    if (!waiting_read_reqs.empty())
+    {
+        MemOp req = waiting_read_reqs.front();
+        waiting_read_reqs.pop_front();
+        forward_frame(req.stream_id, req.address, req.length, frame, length);
+    }
+    else if (!free_buffers.empty())
+    {
+        int index = free_buffers.back();
+        free_buffers.pop_back();
+
+        memcpy(frame_pool[index].data, frame, length);
+        frame_pool[index].length = length;
+        buffered_frames.push_back(index);
+    }
+    else
+        dropped_frames++;
+}
+
+static void process_stream_data(uint32_t stream_id, const uint8_t *payload, size_t len)
+{
+    if (len < 8)
+        return;
+
+    uint32_t address = ((uint32_t)payload[0] << 24) | ((uint32_t)payload[1] << 16) |
+        ((uint32_t)payload[2] << 8) | payload[3];
+    uint16_t length = ((uint16_t)payload[4] << 8) | payload[5];
+    uint16_t kind = ((uint16_t)payload[6] << 8) | payload[7];
+
+    if (kind == WRITE_FRAME_REQ)
+    {
+        MemOp op = {stream_id, address, length};
+        mem_read_queue.push_back(op);
+        a314_read_mem(address, length);
+    }
+    else if (kind == READ_FRAME_REQ)
+    {
+        if (!buffered_frames.empty())
+        {
+            int index = buffered_frames.front();
+            buffered_frames.pop_front();
+
+            forward_frame(stream_id, address, length,
+                frame_pool[index].data, frame_pool[index].length);
+
+            free_buffers.push_back(index);
+        }
+        else
+        {
+            MemOp op = {stream_id, address, length};
+            waiting_read_reqs.push_back(op);
+        }
+    }
+}
+
+static void process_read_mem_res(const uint8_t *frame, size_t length)
+{
+    if (write(tap_fd, frame, length) != (ssize_t)length)
+        logger_warn("Short write to TAP device\n");
+
+    MemOp op = mem_read_queue.front();
+    mem_read_queue.pop_front();
+    if (have_stream && op.stream_id == current_stream_id)
+        send_service_msg(op.stream_id, op.address, op.length, WRITE_FRAME_RES);
+}
+
+static void process_write_mem_res()
+{
+    MemOp op = mem_write_queue.front();
+    mem_write_queue.pop_front();
+    if (have_stream && op.stream_id == current_stream_id)
+        send_service_msg(op.stream_id, op.address, op.length, READ_FRAME_RES);
+}
+
+static void process_drv_msg(uint32_t stream_id, uint8_t type, const uint8_t *payload, size_t len)
+{
+    if (type == MSG_CONNECT)
+    {
+        if (len == strlen(SERVICE_NAME) && memcmp(payload, SERVICE_NAME, len) == 0 && !have_stream)
+        {
+            logger_info("Amiga connected\n");
+            have_stream = true;
+            current_stream_id = stream_id;
+            a314_connect_response(stream_id, CONNECT_RES_OK);
+        }
+        else
+            a314_connect_response(stream_id, CONNECT_RES_UNKNOWN);
+    }
+    else if (type == MSG_READ_MEM_RES)
+        process_read_mem_res(payload, len);
+    else if (type == MSG_WRITE_MEM_RES)
+        process_write_mem_res();
+    else if (have_stream && stream_id == current_stream_id)
+    {
+        if (type == MSG_DATA)
+            process_stream_data(stream_id, payload, len);
+        else if (type == MSG_RESET)
+        {
+            have_stream = false;
+            waiting_read_reqs.clear();
+
+            while (!buffered_frames.empty())
+            {
+                free_buffers.push_back(buffered_frames.front());
+                buffered_frames.pop_front();
+            }
+
+            logger_info("Amiga disconnected\n");
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+static int open_tap_device()
+{
+    int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+        return -1;
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strncpy(ifr.ifr_name, TAP_DEV_NAME, IFNAMSIZ - 1);
+
+    if (ioctl(fd, TUNSETIFF, &ifr) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    if (!a314_init(SERVICE_NAME, argc, argv, process_drv_msg))
+    {
+        logger_error("Unable to attach to a314d, shutting down\n");
+        return -1;
+    }
+
+    tap_fd = open_tap_device();
+    if (tap_fd < 0)
+    {
+        logger_error("Unable to open tap device at %s\n", TAP_DEV_NAME);
+        return -1;
+    }
+
+    for (int i = 0; i < FRAME_BUF_COUNT; i++)
+        free_buffers.push_back(i);
+
+    start_time = time(nullptr);
+
+    logger_info("Ethernet service is running\n");
+
+    uint8_t frame[FRAME_BUF_SIZE];
+
+    while (true)
+    {
+        struct pollfd fds[2];
+        fds[0].fd = a314_fd();
+        fds[0].events = POLLIN | (a314_want_write() ? POLLOUT : 0);
+        fds[1].fd = tap_fd;
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                if (have_stream)
+                {
+                    a314_send_reset(current_stream_id);
+                    a314_flush();
+                }
+                break;
+            }
+            logger_error("poll failed with unexpected errno = %d\n", errno);
+            return -1;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+        {
+            if (!a314_handle_readable())
+            {
+                logger_error("Connection to a314d was closed, terminating.\n");
+                return -1;
+            }
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            // Drain the TAP queue completely so that all frames that arrived
+            // since the last wakeup are batched into the same flush.
+            while (true)
+            {
+                ssize_t r = read(tap_fd, frame, sizeof(frame));
+                if (r <= 0)
+                    break;
+                process_tap_frame(frame, r);
+            }
+        }
+
+        if (!a314_flush())
+        {
+            logger_error("Connection to a314d was closed, terminating.\n");
+            return -1;
+        }
+    }
+
+    close(tap_fd);
+    logger_info("Ethernet service stopped\n");
+    return 0;
+}
@@ -0,0 +1,455 @@
+/*
+ * a314audiod - native PiAudio service.
+ *
+ * Replaces piaudio.py. Samples are read from the named pipe
+ * /tmp/piaudio_pipe as signed 16-bit little-endian interleaved stereo at
+ * -rate Hz (default 44100), resampled to the 18 kHz 8-bit format that
+ * piaudio.c plays, and written into the Amiga-side double buffer.
+ *
+ * The Amiga flips buffers every 50 ms and reports the new back buffer
+ * index; the corresponding chip memory write must land before that buffer
+ * starts playing. The service runs with SCHED_FIFO and locked memory when
+ * permitted, and submits blocks against an explicit deadline: if the input
+ * pipe has not delivered a full block when the deadline margin is reached,
+ * whatever has arrived is padded with silence and submitted anyway, so a
+ * stalled producer degrades to silence instead of repeating stale chip
+ * memory contents. The volume/format-conversion stage is NEON-vectorized
+ * on ARM.
+ *
+ * Run with "priority piaudio high" in a314d.conf so audio blocks overtake
+ * queued bulk transfers from a314fs on the SPI link.
+ *
+ * The driver socket handling is a314client.h; this file only implements the
+ * audio pipeline and deadline logic.
+ */
+
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "../a314client/a314client.h"
+
+#define LOGGER_TRACE 0
+#define logger_trace(...) do { if (LOGGER_TRACE) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_DEBUG 0
+#define logger_debug(...) do { if (LOGGER_DEBUG) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_INFO 1
+#define logger_info(...) do { if (LOGGER_INFO) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_WARN 1
+#define logger_warn(...) do { if (LOGGER_WARN) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_ERROR 1
+#define logger_error(...) do { if (LOGGER_ERROR) fprintf(stderr, __VA_ARGS__); } while (0)
+
+#define SERVICE_NAME            "piaudio"
+#define PIPE_NAME               "/tmp/piaudio_pipe"
+
+// Playback format, fixed by piaudio.c.
+#define OUT_FREQ                18000
+#define BUFFER_LEN_MS           50
+#define BLOCK_FRAMES            (OUT_FREQ * BUFFER_LEN_MS / 1000)
+
+// Give up waiting for input this long before the back buffer starts playing.
+#define DEADLINE_MARGIN_NS      8000000ULL
+
+static int in_rate = 44100;
+static int volume = 100;
+
+// Returns a pointer to the payload area of the write request, so each block
+// is built directly in the outgoing message without an intermediate copy.
+static uint8_t *send_write_mem_req(uint32_t address, uint32_t length)
+{
+    uint8_t *p = a314_append(MSG_WRITE_MEM_REQ, 0, 4 + length);
+    memcpy(&p[0], &address, 4);
+    return &p[4];
+}
+
+static uint64_t now_monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ---------------------------------------------------------------------------
+// Resampler and volume stage.
+//
+// Input frames accumulate in in_samples (interleaved stereo s16). The
+// resampler linearly interpolates them to 18 kHz with a 32.32 fixed-point
+// phase accumulator, and the volume scale plus narrowing to signed 8-bit is
+// done sixteen samples at a time with NEON where available.
+
+static std::vector<int16_t> in_samples;
+static uint64_t resample_phase = 0;
+static uint64_t resample_step;
+static int16_t volume_q15;
+
+static std::deque<int8_t> out_fifo; // Interleaved stereo s8 at 18 kHz.
+
+static void convert_volume(const int16_t *src, int8_t *dst, int n)
+{
+    int i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    int16x8_t vol = vdupq_n_s16(volume_q15);
+    for (; i + 16 <= n; i += 16)
+    {
+        int16x8_t a = vqdmulhq_s16(vld1q_s16(&src[i]), vol);
+        int16x8_t b = vqdmulhq_s16(vld1q_s16(&src[i + 8]), vol);
+        int8x16_t v = vcombine_s8(vshrn_n_s16(a, 8), vshrn_n_s16(b, 8));
+        vst1q_s8(dst + i, v);
+    }
+#endif
+
+    for (; i < n; i++)
+        dst[i] = (int8_t)((((int32_t)src[i] * volume_q15) >> 15) >> 8);
+}
+
+static void resample_input()
+{
+    size_t in_frames = in_samples.size() / 2;
+    if (in_frames < 2)
+        return;
+
+    int16_t staging[1024];
+    int staged = 0;
+
+    while ((resample_phase >> 32) + 1 < in_frames)
+    {
+        size_t idx = resample_phase >> 32;
+        int64_t frac = (uint32_t)resample_phase;
+
+        for (int c = 0; c < 2; c++)
+        {
+            int32_t a = in_samples[idx * 2 + c];
+            int32_t b = in_samples[(idx + 1) * 2 + c];
+            staging[staged++] = (int16_t)(a + (((b - a) * frac) >> 32));
+        }
+
+        resample_phase += resample_step;
+
+        if (staged == 1024)
+        {
+            int8_t conv[1024];
+            convert_volume(staging, conv, staged);
+            out_fifo.insert(out_fifo.end(), conv, conv + staged);
+            staged = 0;
+        }
+    }
+
+    if (staged != 0)
+    {
+        int8_t conv[1024];
+        convert_volume(staging, conv, staged);
+        out_fifo.insert(out_fifo.end(), conv, conv + staged);
+    }
+
+    // Drop consumed input frames, keeping the frame the phase points into
+    // for interpolation against the next arrival.
+    size_t consumed = resample_phase >> 32;
+    in_samples.erase(in_samples.begin(), in_samples.begin() + consumed * 2);
+    resample_phase &= 0xffffffffULL;
+}
+
+// ---------------------------------------------------------------------------
+// Stream state and block submission.
+
+static bool have_stream = false;
+static uint32_t active_stream_id = 0;
+static bool first_msg = true;
+
+static uint32_t buf_ptrs[2];
+static bool is_empty[2] = {true, true};
+
+static bool block_pending = false;
+static int pending_buf_index = 0;
+static uint64_t block_deadline_ns = 0;
+
+static size_t fifo_frames()
+{
+    return out_fifo.size() / 2;
+}
+
+// Writes one 50 ms block to the requested chip memory buffer: 900 left
+// samples followed by 900 right samples. Missing frames become silence.
+static void submit_block(bool at_deadline)
+{
+    size_t avail = fifo_frames();
+    if (avail > BLOCK_FRAMES)
+        avail = BLOCK_FRAMES;
+
+    if (avail == 0)
+    {
+        // Nothing arrived; clear the buffer once so stale samples are not
+        // repeated, then skip writes while the source stays silent.
+        if (!is_empty[pending_buf_index])
+        {
+            uint8_t *p = send_write_mem_req(buf_ptrs[pending_buf_index], BLOCK_FRAMES * 2);
+            memset(p, 0, BLOCK_FRAMES * 2);
+            is_empty[pending_buf_index] = true;
+        }
+        block_pending = false;
+        return;
+    }
+
+    if (avail < BLOCK_FRAMES && !at_deadline)
+        return; // Keep waiting for input until the deadline margin.
+
+    uint8_t *p = send_write_mem_req(buf_ptrs[pending_buf_index], BLOCK_FRAMES * 2);
+    memset(p, 0, BLOCK_FRAMES * 2);
+
+    for (size_t i = 0; i < avail; i++)
+    {
+        p[i] = (uint8_t)out_fifo[i * 2];
+        p[BLOCK_FRAMES + i] = (uint8_t)out_fifo[i * 2 + 1];
+    }
+    out_fifo.erase(out_fifo.begin(), out_fifo.begin() + avail * 2);
+
+    if (avail < BLOCK_FRAMES)
+        logger_debug("Submitted short block, %d of %d frames\n", (int)avail, BLOCK_FRAMES);
+
+    is_empty[pending_buf_index] = false;
+    block_pending = false;
+}
+
+static void process_msg_data(const uint8_t *payload, size_t len)
+{
+    if (first_msg)
+    {
+        if (len < 8)
+            return;
+
+        buf_ptrs[0] = ((uint32_t)payload[0] << 24) | ((uint32_t)payload[1] << 16) |
+            ((uint32_t)payload[2] << 8) | payload[3];
+        buf_ptrs[1] = ((uint32_t)payload[4] << 24) | ((uint32_t)payload[5] << 16) |
+            ((uint32_t)payload[6] << 8) | payload[7];
+        first_msg = false;
+        logger_debug("Received buffer pointers %08x, %08x\n", buf_ptrs[0], buf_ptrs[1]);
+        return;
+    }
+
+    if (len < 1 || payload[0] > 1)
+        return;
+
+    pending_buf_index = payload[0];
+    block_pending = true;
+    block_deadline_ns = now_monotonic_ns() +
+        (uint64_t)BUFFER_LEN_MS * 1000000ULL - DEADLINE_MARGIN_NS;
+    submit_block(false);
+}
+
+static void process_drv_msg(uint32_t stream_id, uint8_t type, const uint8_t *payload, size_t len)
+{
+    if (type == MSG_CONNECT)
+    {
+        if (len == strlen(SERVICE_NAME) &&
+            memcmp(payload, SERVICE_NAME, len) == 0 && !have_stream)
+        {
+            logger_info("Amiga connected\n");
+            have_stream = true;
+            active_stream_id = stream_id;
+            first_msg = true;
+            is_empty[0] = is_empty[1] = true;
+            block_pending = false;
+            a314_connect_response(stream_id, CONNECT_RES_OK);
+        }
+        else
+            a314_connect_response(stream_id, CONNECT_RES_UNKNOWN);
+    }
+    else if (have_stream && stream_id == active_stream_id)
+    {
+        if (type == MSG_DATA)
+            process_msg_data(payload, len);
+        else if (type == MSG_RESET)
+        {
+            have_stream = false;
+            block_pending = false;
+            logger_info("Amiga disconnected\n");
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+static int pipe_fd = -1;
+
+static bool open_input_pipe()
+{
+    struct stat st;
+    if (stat(PIPE_NAME, &st) == 0)
+    {
+        if (!S_ISFIFO(st.st_mode))
+        {
+            logger_error("A file that is not a named pipe exists at %s\n", PIPE_NAME);
+            return false;
+        }
+    }
+    else if (mkfifo(PIPE_NAME, 0666) != 0)
+    {
+        logger_error("Unable to create named pipe at %s\n", PIPE_NAME);
+        return false;
+    }
+
+    pipe_fd = open(PIPE_NAME, O_RDONLY | O_NONBLOCK);
+    if (pipe_fd < 0)
+    {
+        logger_error("Unable to open named pipe at %s\n", PIPE_NAME);
+        return false;
+    }
+    return true;
+}
+
+static void handle_pipe_readable()
+{
+    uint8_t chunk[4096];
+
+    while (true)
+    {
+        ssize_t r = read(pipe_fd, chunk, sizeof(chunk));
+        if (r > 0)
+        {
+            size_t old = in_samples.size();
+            in_samples.resize(old + r / 2);
+            memcpy(&in_samples[old], chunk, (r / 2) * 2);
+        }
+        else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+        {
+            // Writer closed the pipe; reopen and wait for the next one.
+            close(pipe_fd);
+            pipe_fd = open(PIPE_NAME, O_RDONLY | O_NONBLOCK);
+            break;
+        }
+    }
+
+    resample_input();
+}
+
+static void setup_realtime()
+{
+    struct sched_param sp;
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority = 30;
+    if (sched_setscheduler(0, SCHED_FIFO, &sp) != 0)
+        logger_warn("Unable to set SCHED_FIFO scheduling, continuing without\n");
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        logger_warn("Unable to lock memory, continuing without\n");
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], "-rate") == 0)
+            in_rate = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-volume") == 0)
+            volume = atoi(argv[i + 1]);
+    }
+
+    if (in_rate < 4000 || in_rate > 192000)
+    {
+        logger_error("Invalid input sample rate %d\n", in_rate);
+        return -1;
+    }
+    if (volume < 0 || volume > 100)
+    {
+        logger_error("Invalid volume %d, must be 0-100\n", volume);
+        return -1;
+    }
+
+    resample_step = ((uint64_t)in_rate << 32) / OUT_FREQ;
+    volume_q15 = (int16_t)(volume * 32767 / 100);
+
+    if (!a314_init(SERVICE_NAME, argc, argv, process_drv_msg))
+    {
+        logger_error("Unable to attach to a314d, shutting down\n");
+        return -1;
+    }
+
+    if (!open_input_pipe())
+        return -1;
+
+    setup_realtime();
+
+    logger_info("piaudio service is running, input %d Hz s16le stereo\n", in_rate);
+
+    bool done = false;
+
+    while (!done)
+    {
+        struct pollfd fds[2];
+        fds[0].fd = a314_fd();
+        fds[0].events = POLLIN | (a314_want_write() ? POLLOUT : 0);
+        fds[0].revents = 0;
+
+        // Apply input pipe backpressure once two blocks are buffered; this
+        // bounds end-to-end latency the same way piaudio.py did.
+        bool want_input = fifo_frames() < 2 * BLOCK_FRAMES;
+        fds[1].fd = want_input ? pipe_fd : -1;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+
+        int timeout = -1;
+        if (block_pending)
+        {
+            uint64_t now = now_monotonic_ns();
+            timeout = now < block_deadline_ns ?
+                (int)((block_deadline_ns - now) / 1000000ULL) + 1 : 0;
+        }
+
+        if (poll(fds, 2, timeout) < 0)
+        {
+            if (errno == EINTR)
+                break;
+            logger_error("poll failed with unexpected errno = %d\n", errno);
+            break;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+        {
+            if (!a314_handle_readable())
+            {
+                logger_error("Connection to a314d was closed, terminating.\n");
+                done = true;
+            }
+        }
+
+        if (fds[1].revents & POLLIN)
+            handle_pipe_readable();
+
+        if (block_pending)
+            submit_block(now_monotonic_ns() >= block_deadline_ns);
+
+        if (!done && !a314_flush())
+        {
+            logger_error("Connection to a314d was closed, terminating.\n");
+            done = true;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,996 @@
+/*
+ * a314wbd - native RemoteWB capture service.
+ *
+ * Replaces remotewb.py. The Workbench screen is still read over the SPI link
+ * when the Amiga signals an update, but instead of re-encoding the whole
+ * screen as a GIF for every frame, the framebuffer is converted to chunky
+ * pixels, tiled, and the tiles are hashed against the previous frame. Only
+ * the dirty rectangles are sent to the browser, XOR'd against the previous
+ * frame and deflate-compressed, which cuts steady-state websocket bandwidth
+ * by an order of magnitude when little on screen changes.
+ *
+ * The websocket server (RFC 6455, port 6789) is implemented here directly;
+ * remotewb_client.html composes the dirty rectangles into a canvas.
+ *
+ * The driver socket handling is a314client.h; the sockets included here are
+ * for the websocket server.
+ */
+
+#include <arpa/inet.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "../a314client/a314client.h"
+
+#define LOGGER_TRACE 0
+#define logger_trace(...) do { if (LOGGER_TRACE) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_DEBUG 0
+#define logger_debug(...) do { if (LOGGER_DEBUG) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_INFO 1
+#define logger_info(...) do { if (LOGGER_INFO) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_WARN 1
+#define logger_warn(...) do { if (LOGGER_WARN) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_ERROR 1
+#define logger_error(...) do { if (LOGGER_ERROR) fprintf(stderr, __VA_ARGS__); } while (0)
+
+#define SERVICE_NAME            "remotewb"
+#define WEBSOCKET_PORT          6789
+
+#define MAX_SCREEN_WIDTH        640
+#define MAX_SCREEN_HEIGHT       256
+#define MAX_SCREEN_DEPTH        3
+
+#define TILE_SIZE               16
+
+// ---------------------------------------------------------------------------
+// SHA-1 and base64, needed for the websocket handshake.
+
+static void sha1(const uint8_t *data, size_t len, uint8_t out[20])
+{
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+
+    uint64_t total_bits = (uint64_t)len * 8;
+    size_t padded_len = ((len + 8) / 64 + 1) * 64;
+
+    std::vector<uint8_t> msg(padded_len, 0);
+    memcpy(&msg[0], data, len);
+    msg[len] = 0x80;
+    for (int i = 0; i < 8; i++)
+        msg[padded_len - 1 - i] = (uint8_t)(total_bits >> (i * 8));
+
+    for (size_t chunk = 0; chunk < padded_len; chunk += 64)
+    {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+            w[i] = ((uint32_t)msg[chunk + i * 4] << 24) | ((uint32_t)msg[chunk + i * 4 + 1] << 16) |
+                ((uint32_t)msg[chunk + i * 4 + 2] << 8) | msg[chunk + i * 4 + 3];
+        for (int i = 16; i < 80; i++)
+        {
+            uint32_t v = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = (v << 1) | (v >> 31);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+        for (int i = 0; i < 80; i++)
+        {
+            uint32_t f, k;
+            if (i < 20) { f = (b & c) | (~b & d); k = 0x5a827999; }
+            else if (i < 40) { f = b ^ c ^ d; k = 0x6ed9eba1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8f1bbcdc; }
+            else { f = b ^ c ^ d; k = 0xca62c1d6; }
+
+            uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for (int i = 0; i < 5; i++)
+    {
+        out[i * 4] = (uint8_t)(h[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(h[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(h[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)h[i];
+    }
+}
+
+static std::string base64_encode(const uint8_t *data, size_t len)
+{
+    static const char tab[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string out;
+    for (size_t i = 0; i < len; i += 3)
+    {
+        uint32_t v = (uint32_t)data[i] << 16;
+        if (i + 1 < len) v |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < len) v |= data[i + 2];
+
+        out += tab[(v >> 18) & 63];
+        out += tab[(v >> 12) & 63];
+        out += i + 1 < len ? tab[(v >> 6) & 63] : '=';
+        out += i + 2 < len ? tab[v & 63] : '=';
+    }
+    return out;
+}
+
+// ---------------------------------------------------------------------------
+// Websocket server.
+
+struct WsClient
+{
+    int fd;
+    bool handshaken;
+    std::vector<uint8_t> rbuf;
+    std::vector<uint8_t> wbuf;
+    size_t wpos;
+
+    WsClient() : fd(-1), handshaken(false), wpos(0) {}
+};
+
+static int ws_listen_fd = -1;
+static std::list<WsClient> ws_clients;
+static WsClient *active_browser = nullptr;
+
+static void ws_queue(WsClient *client, const uint8_t *data, size_t len)
+{
+    client->wbuf.insert(client->wbuf.end(), data, data + len);
+}
+
+// Queues a binary frame (opcode 2) with the given payload.
+static void ws_queue_frame(WsClient *client, const uint8_t *payload, size_t len)
+{
+    uint8_t header[10];
+    size_t header_len;
+
+    header[0] = 0x82;
+    if (len < 126)
+    {
+        header[1] = (uint8_t)len;
+        header_len = 2;
+    }
+    else if (len < 65536)
+    {
+        header[1] = 126;
+        header[2] = (uint8_t)(len >> 8);
+        header[3] = (uint8_t)len;
+        header_len = 4;
+    }
+    else
+    {
+        header[1] = 127;
+        uint64_t l = len;
+        for (int i = 0; i < 8; i++)
+            header[2 + i] = (uint8_t)(l >> ((7 - i) * 8));
+        header_len = 10;
+    }
+
+    ws_queue(client, header, header_len);
+    ws_queue(client, payload, len);
+}
+
+// Builds and queues the standard message format: a 4-byte big-endian JSON
+// length, the JSON part, and an optional binary part.
+static void ws_send_message(WsClient *client, const std::string &json,
+    const uint8_t *binary, size_t binary_len)
+{
+    std::vector<uint8_t> msg(4 + json.size() + binary_len);
+    uint32_t jlen = json.size();
+    msg[0] = (uint8_t)(jlen >> 24);
+    msg[1] = (uint8_t)(jlen >> 16);
+    msg[2] = (uint8_t)(jlen >> 8);
+    msg[3] = (uint8_t)jlen;
+    memcpy(&msg[4], json.data(), json.size());
+    if (binary_len != 0)
+        memcpy(&msg[4 + json.size()], binary, binary_len);
+
+    ws_queue_frame(client, &msg[0], msg.size());
+}
+
+// ---------------------------------------------------------------------------
+// Screen state and capture.
+
+static bool have_stream = false;
+static uint32_t active_stream_id = 0;
+static bool first_msg = true;
+
+static int screen_w, screen_h, screen_d, screen_bpr;
+static uint32_t screen_ptr;
+static std::vector<uint16_t> screen_cmap;
+
+static bool is_reading_screen = false;
+
+// Chunky pixel buffers for the current and the previously sent frame, and
+// per-tile hashes of the previous frame.
+static uint8_t cur_pixels[MAX_SCREEN_WIDTH * MAX_SCREEN_HEIGHT];
+static uint8_t prev_pixels[MAX_SCREEN_WIDTH * MAX_SCREEN_HEIGHT];
+static uint64_t tile_hashes[(MAX_SCREEN_WIDTH / TILE_SIZE) * (MAX_SCREEN_HEIGHT / TILE_SIZE)];
+static bool force_full_frame = true;
+
+static int tiles_x()
+{
+    return (screen_w + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+static int tiles_y()
+{
+    return (screen_h + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+static void reset_frame_state()
+{
+    memset(prev_pixels, 0, sizeof(prev_pixels));
+    memset(tile_hashes, 0, sizeof(tile_hashes));
+    force_full_frame = true;
+}
+
+// Converts the bitplane data read from chip memory into one byte per pixel.
+// A bytes-per-row of d*(w/8) means the planes are interleaved row by row;
+// otherwise they are stored sequentially.
+static void planar_to_chunky(const uint8_t *bpls)
+{
+    int row_bytes = screen_w / 8;
+    bool interleaved = screen_bpr == screen_d * row_bytes;
+
+    memset(cur_pixels, 0, screen_w * screen_h);
+
+    for (int p = 0; p < screen_d; p++)
+    {
+        uint8_t bit = 1 << p;
+        for (int y = 0; y < screen_h; y++)
+        {
+            const uint8_t *src = interleaved ?
+                &bpls[(y * screen_d + p) * row_bytes] :
+                &bpls[(p * screen_h + y) * row_bytes];
+            uint8_t *dst = &cur_pixels[y * screen_w];
+
+            for (int b = 0; b < row_bytes; b++)
+            {
+                uint8_t v = src[b];
+                if (v == 0)
+                    continue;
+                for (int j = 0; j < 8; j++)
+                {
+                    if (v & (0x80 >> j))
+                        dst[b * 8 + j] |= bit;
+                }
+            }
+        }
+    }
+}
+
+static uint64_t hash_tile(int tx, int ty)
+{
+    int x0 = tx * TILE_SIZE;
+    int y0 = ty * TILE_SIZE;
+    int w = screen_w - x0 < TILE_SIZE ? screen_w - x0 : TILE_SIZE;
+    int h = screen_h - y0 < TILE_SIZE ? screen_h - y0 : TILE_SIZE;
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (int y = 0; y < h; y++)
+    {
+        const uint8_t *row = &cur_pixels[(y0 + y) * screen_w + x0];
+        for (int x = 0; x < w; x++)
+        {
+            hash ^= row[x];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+static std::string palette_json()
+{
+    std::string json = "{\"width\":" + std::to_string(screen_w) +
+        ",\"height\":" + std::to_string(screen_h) + ",\"palette\":[";
+    for (size_t i = 0; i < screen_cmap.size(); i++)
+    {
+        if (i != 0)
+            json += ",";
+        json += std::to_string(screen_cmap[i]);
+    }
+    json += "]}";
+    return json;
+}
+
+// Finds the dirty tiles, merges horizontal runs into rectangles, XORs the
+// rectangles against the previously sent frame and sends the result as one
+// deflate-compressed update message to the active browser.
+static void send_frame_update()
+{
+    if (active_browser == nullptr)
+        return;
+
+    int nx = tiles_x();
+    int ny = tiles_y();
+
+    std::vector<uint8_t> rect_data;
+    int rect_count = 0;
+
+    for (int ty = 0; ty < ny; ty++)
+    {
+        int run_start = -1;
+
+        for (int tx = 0; tx <= nx; tx++)
+        {
+            bool dirty = false;
+            if (tx < nx)
+            {
+                uint64_t hash = hash_tile(tx, ty);
+                int index = ty * nx + tx;
+                dirty = force_full_frame || hash != tile_hashes[index];
+                tile_hashes[index] = hash;
+            }
+
+            if (dirty)
+            {
+                if (run_start == -1)
+                    run_start = tx;
+                continue;
+            }
+
+            if (run_start == -1)
+                continue;
+
+            // Emit the rectangle covering tiles [run_start, tx).
+            int x0 = run_start * TILE_SIZE;
+            int y0 = ty * TILE_SIZE;
+            int w = tx * TILE_SIZE - x0;
+            int h = TILE_SIZE;
+            if (x0 + w > screen_w)
+                w = screen_w - x0;
+            if (y0 + h > screen_h)
+                h = screen_h - y0;
+
+            size_t pos = rect_data.size();
+            rect_data.resize(pos + 8 + (size_t)w * h);
+            uint8_t *p = &rect_data[pos];
+            p[0] = (uint8_t)(x0 >> 8); p[1] = (uint8_t)x0;
+            p[2] = (uint8_t)(y0 >> 8); p[3] = (uint8_t)y0;
+            p[4] = (uint8_t)(w >> 8); p[5] = (uint8_t)w;
+            p[6] = (uint8_t)(h >> 8); p[7] = (uint8_t)h;
+            p += 8;
+
+            for (int y = 0; y < h; y++)
+            {
+                uint8_t *cur = &cur_pixels[(y0 + y) * screen_w + x0];
+                uint8_t *prev = &prev_pixels[(y0 + y) * screen_w + x0];
+                for (int x = 0; x < w; x++)
+                {
+                    *p++ = cur[x] ^ prev[x];
+                    prev[x] = cur[x];
+                }
+            }
+
+            rect_count++;
+            run_start = -1;
+        }
+    }
+
+    force_full_frame = false;
+
+    if (rect_count == 0)
+        return;
+
+    uLongf compressed_len = compressBound(rect_data.size());
+    std::vector<uint8_t> compressed(compressed_len);
+    if (compress2(&compressed[0], &compressed_len, &rect_data[0], rect_data.size(),
+            Z_DEFAULT_COMPRESSION) != Z_OK)
+    {
+        logger_warn("deflate of frame update failed\n");
+        return;
+    }
+
+    std::string json = "{\"update\":1,\"amiga_present\":1,\"rects\":" +
+        std::to_string(rect_count) + ",\"raw_size\":" + std::to_string(rect_data.size()) + "}";
+    ws_send_message(active_browser, json, &compressed[0], compressed_len);
+}
+
+static void start_read_screenshot()
+{
+    if (active_browser == nullptr || !have_stream || is_reading_screen)
+        return;
+
+    is_reading_screen = true;
+    a314_read_mem(screen_ptr, screen_d * screen_h * (screen_w / 8));
+}
+
+// ---------------------------------------------------------------------------
+// Browser input events, forwarded to the Amiga with the same encoding as
+// remotewb.py used.
+
+struct InputEvent
+{
+    bool is_key;
+    int key_code;
+    bool key_up;
+    int x, y, b;
+};
+
+static std::deque<InputEvent> event_q;
+static int current_mouse[3] = {0, 0, 0};
+static int last_sent[3] = {-1, -1, -1};
+
+struct KeyMapEntry
+{
+    uint16_t pc;
+    uint16_t ami;
+};
+
+static const KeyMapEntry pc_to_ami[] = {
+    {8, 65}, {9, 66}, {13, 68}, {20, 98}, {27, 69}, {32, 64}, {37, 79}, {38, 76},
+    {39, 78}, {40, 77}, {46, 70}, {47, 95}, {48, 10}, {49, 1}, {50, 2}, {51, 3},
+    {52, 4}, {53, 5}, {54, 6}, {55, 7}, {56, 8}, {57, 9}, {65, 32}, {66, 53},
+    {67, 51}, {68, 34}, {69, 18}, {70, 35}, {71, 36}, {72, 37}, {73, 23}, {74, 38},
+    {75, 39}, {76, 40}, {77, 55}, {78, 54}, {79, 24}, {80, 25}, {81, 16}, {82, 19},
+    {83, 33}, {84, 20}, {85, 22}, {86, 52}, {87, 17}, {88, 50}, {89, 21}, {90, 49},
+    {91, 102}, {92, 103}, {96, 15}, {97, 29}, {98, 30}, {99, 31}, {100, 45},
+    {101, 46}, {102, 47}, {103, 61}, {104, 62}, {105, 63}, {106, 93}, {107, 94},
+    {109, 74}, {110, 60}, {111, 92}, {112, 80}, {113, 81}, {114, 82}, {115, 83},
+    {116, 84}, {117, 85}, {118, 86}, {119, 87}, {120, 88}, {121, 89}, {160, 96},
+    {161, 97}, {162, 99}, {164, 100}, {165, 101}, {186, 27}, {187, 11}, {188, 56},
+    {189, 58}, {190, 57}, {191, 43}, {192, 41}, {219, 12}, {221, 26}, {222, 42},
+    {226, 48},
+};
+
+static uint16_t map_key_code(int pc)
+{
+    for (auto &e : pc_to_ami)
+    {
+        if (e.pc == pc)
+            return e.ami;
+    }
+    return 0x40;
+}
+
+static void send_buffered_events()
+{
+    if (!have_stream)
+        return;
+
+    if (event_q.empty() &&
+        last_sent[0] == current_mouse[0] && last_sent[1] == current_mouse[1] &&
+        last_sent[2] == current_mouse[2])
+        return;
+
+    std::vector<uint8_t> lst;
+
+    while (!event_q.empty() && lst.size() < 240)
+    {
+        InputEvent e = event_q.front();
+        event_q.pop_front();
+
+        if (e.is_key)
+        {
+            uint16_t n = 0x4000 | map_key_code(e.key_code);
+            if (e.key_up)
+                n |= 0x2000;
+            lst.push_back((uint8_t)(n >> 8));
+            lst.push_back((uint8_t)n);
+        }
+        else
+        {
+            lst.push_back((uint8_t)(e.x >> 8)); lst.push_back((uint8_t)e.x);
+            lst.push_back((uint8_t)(e.y >> 8)); lst.push_back((uint8_t)e.y);
+            lst.push_back((uint8_t)(e.b >> 8)); lst.push_back((uint8_t)e.b);
+            last_sent[0] = e.x; last_sent[1] = e.y; last_sent[2] = e.b;
+        }
+    }
+
+    if (event_q.empty() &&
+        (last_sent[0] != current_mouse[0] || last_sent[1] != current_mouse[1] ||
+         last_sent[2] != current_mouse[2]))
+    {
+        lst.push_back((uint8_t)(current_mouse[0] >> 8)); lst.push_back((uint8_t)current_mouse[0]);
+        lst.push_back((uint8_t)(current_mouse[1] >> 8)); lst.push_back((uint8_t)current_mouse[1]);
+        lst.push_back((uint8_t)(current_mouse[2] >> 8)); lst.push_back((uint8_t)current_mouse[2]);
+        memcpy(last_sent, current_mouse, sizeof(last_sent));
+    }
+
+    if (lst.empty())
+        return;
+
+    a314_send_data(active_stream_id, &lst[0], lst.size());
+}
+
+// Minimal extraction of the integer value of "key": from a small JSON event.
+static bool json_find_int(const std::string &text, const char *key, int *value)
+{
+    size_t pos = text.find("\"" + std::string(key) + "\"");
+    if (pos == std::string::npos)
+        return false;
+
+    pos = text.find(':', pos);
+    if (pos == std::string::npos)
+        return false;
+
+    *value = atoi(&text[pos + 1]);
+    return true;
+}
+
+static void got_browser_event(const std::string &text)
+{
+    int kc, x, y, b;
+
+    if (json_find_int(text, "kc", &kc))
+    {
+        InputEvent e;
+        e.is_key = true;
+        e.key_code = kc;
+        e.key_up = text.find("\"d\":\"u\"") != std::string::npos ||
+            text.find("\"d\": \"u\"") != std::string::npos;
+        event_q.push_back(e);
+    }
+    else if (json_find_int(text, "x", &x) && json_find_int(text, "y", &y) &&
+        json_find_int(text, "b", &b))
+    {
+        // Button transitions become separate events, same as remotewb.py.
+        int cb = current_mouse[2];
+
+        if ((b ^ cb) & 1)
+        {
+            cb ^= 1;
+            InputEvent e = {false, 0, false, x, y, cb};
+            event_q.push_back(e);
+        }
+        if ((b ^ cb) & 2)
+        {
+            cb ^= 2;
+            InputEvent e = {false, 0, false, x, y, cb};
+            event_q.push_back(e);
+        }
+
+        current_mouse[0] = x;
+        current_mouse[1] = y;
+        current_mouse[2] = b;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Websocket client handling.
+
+static void ws_send_status(WsClient *client, bool is_active)
+{
+    std::string json = "{\"is_active\":" + std::to_string(is_active ? 1 : 0) +
+        ",\"amiga_present\":" + std::to_string(have_stream ? 1 : 0) + "}";
+    ws_send_message(client, json, nullptr, 0);
+}
+
+static void ws_on_open(WsClient *client)
+{
+    bool is_active = active_browser == nullptr;
+    if (is_active)
+    {
+        active_browser = client;
+        reset_frame_state();
+    }
+
+    ws_send_status(client, is_active);
+
+    if (is_active && have_stream && !first_msg)
+    {
+        ws_send_message(client, palette_json(), nullptr, 0);
+        start_read_screenshot();
+    }
+}
+
+static bool ws_try_handshake(WsClient *client)
+{
+    std::string req((char *)&client->rbuf[0], client->rbuf.size());
+    size_t end = req.find("\r\n\r\n");
+    if (end == std::string::npos)
+        return true; // Wait for more data.
+
+    size_t key_pos = req.find("Sec-WebSocket-Key:");
+    if (key_pos == std::string::npos || key_pos > end)
+        return false;
+
+    key_pos += strlen("Sec-WebSocket-Key:");
+    while (key_pos < req.size() && req[key_pos] == ' ')
+        key_pos++;
+    size_t key_end = req.find("\r\n", key_pos);
+    if (key_end == std::string::npos)
+        return false;
+
+    std::string accept_src = req.substr(key_pos, key_end - key_pos) +
+        "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+    uint8_t digest[20];
+    sha1((const uint8_t *)accept_src.data(), accept_src.size(), digest);
+
+    std::string response =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: " + base64_encode(digest, 20) + "\r\n"
+        "\r\n";
+
+    ws_queue(client, (const uint8_t *)response.data(), response.size());
+
+    client->rbuf.erase(client->rbuf.begin(), client->rbuf.begin() + end + 4);
+    client->handshaken = true;
+
+    ws_on_open(client);
+    return true;
+}
+
+// Parses complete frames out of the client's receive buffer. Returns false
+// if the connection should be closed.
+static bool ws_process_frames(WsClient *client)
+{
+    while (true)
+    {
+        std::vector<uint8_t> &rb = client->rbuf;
+        if (rb.size() < 2)
+            return true;
+
+        uint8_t opcode = rb[0] & 0x0f;
+        bool masked = (rb[1] & 0x80) != 0;
+        uint64_t len = rb[1] & 0x7f;
+        size_t pos = 2;
+
+        if (len == 126)
+        {
+            if (rb.size() < 4)
+                return true;
+            len = ((uint64_t)rb[2] << 8) | rb[3];
+            pos = 4;
+        }
+        else if (len == 127)
+        {
+            if (rb.size() < 10)
+                return true;
+            len = 0;
+            for (int i = 0; i < 8; i++)
+                len = (len << 8) | rb[2 + i];
+            pos = 10;
+        }
+
+        uint8_t mask[4] = {0, 0, 0, 0};
+        if (masked)
+        {
+            if (rb.size() < pos + 4)
+                return true;
+            memcpy(mask, &rb[pos], 4);
+            pos += 4;
+        }
+
+        if (len > 65536)
+            return false;
+        if (rb.size() < pos + len)
+            return true;
+
+        std::vector<uint8_t> payload(len);
+        for (uint64_t i = 0; i < len; i++)
+            payload[i] = rb[pos + i] ^ mask[i & 3];
+
+        rb.erase(rb.begin(), rb.begin() + pos + len);
+
+        if (opcode == 8)
+            return false;
+        else if (opcode == 9)
+        {
+            // Ping; answer with pong carrying the same payload.
+            uint8_t header[2] = {0x8a, (uint8_t)len};
+            if (len < 126)
+            {
+                ws_queue(client, header, 2);
+                if (len != 0)
+                    ws_queue(client, &payload[0], len);
+            }
+        }
+        else if (opcode == 1)
+        {
+            if (client == active_browser && have_stream)
+                got_browser_event(std::string((char *)payload.data(), payload.size()));
+        }
+    }
+}
+
+static void ws_close_client(std::list<WsClient>::iterator it)
+{
+    if (&*it == active_browser)
+        active_browser = nullptr;
+
+    close(it->fd);
+    ws_clients.erase(it);
+
+    // Promote another connected browser to active, if any.
+    if (active_browser == nullptr)
+    {
+        for (auto &client : ws_clients)
+        {
+            if (client.handshaken)
+            {
+                reset_frame_state();
+                active_browser = &client;
+                ws_send_status(&client, true);
+                if (have_stream && !first_msg)
+                {
+                    ws_send_message(&client, palette_json(), nullptr, 0);
+                    start_read_screenshot();
+                }
+                break;
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Driver message handling.
+
+static void read_screenshot_completed(const uint8_t *bpls, size_t len)
+{
+    is_reading_screen = false;
+
+    if (active_browser == nullptr || !have_stream)
+        return;
+
+    if (len < (size_t)(screen_d * screen_h * (screen_w / 8)))
+        return;
+
+    planar_to_chunky(bpls);
+    send_frame_update();
+    send_buffered_events();
+}
+
+static void process_drv_msg(uint32_t stream_id, uint8_t type, const uint8_t *payload, size_t len)
+{
+    if (type == MSG_CONNECT)
+    {
+        if (have_stream)
+            a314_send_reset(active_stream_id);
+
+        have_stream = true;
+        active_stream_id = stream_id;
+        first_msg = true;
+        a314_connect_response(stream_id, CONNECT_RES_OK);
+        logger_info("Amiga connected\n");
+
+        for (auto &client : ws_clients)
+        {
+            if (client.handshaken)
+                ws_send_status(&client, &client == active_browser);
+        }
+    }
+    else if (type == MSG_READ_MEM_RES)
+        read_screenshot_completed(payload, len);
+    else if (have_stream && stream_id == active_stream_id)
+    {
+        if (type == MSG_DATA)
+        {
+            if (first_msg)
+            {
+                if (len < 14)
+                    return;
+
+                screen_w = ((int)payload[0] << 8) | payload[1];
+                screen_h = ((int)payload[2] << 8) | payload[3];
+                screen_d = ((int)payload[4] << 8) | payload[5];
+                screen_bpr = ((int)payload[6] << 8) | payload[7];
+                screen_ptr = ((uint32_t)payload[8] << 24) | ((uint32_t)payload[9] << 16) |
+                    ((uint32_t)payload[10] << 8) | payload[11];
+                int count = ((int)payload[12] << 8) | payload[13];
+
+                if (screen_w > MAX_SCREEN_WIDTH || screen_h > MAX_SCREEN_HEIGHT ||
+                    screen_d > MAX_SCREEN_DEPTH)
+                {
+                    logger_error("Unsupported screen geometry %dx%dx%d\n",
+                        screen_w, screen_h, screen_d);
+                    return;
+                }
+
+                screen_cmap.clear();
+                for (int i = 0; i < count && 14 + 2 * i + 1 < (int)len; i++)
+                    screen_cmap.push_back(((uint16_t)payload[14 + 2 * i] << 8) |
+                        payload[14 + 2 * i + 1]);
+
+                first_msg = false;
+                reset_frame_state();
+                logger_info("Received data from app %dx%dx%d, ptr %08x\n",
+                    screen_w, screen_h, screen_d, screen_ptr);
+
+                if (active_browser != nullptr)
+                {
+                    ws_send_message(active_browser, palette_json(), nullptr, 0);
+                    start_read_screenshot();
+                }
+            }
+            else
+                start_read_screenshot();
+        }
+        else if (type == MSG_EOS)
+        {
+            a314_send_eos(active_stream_id);
+            have_stream = false;
+        }
+        else if (type == MSG_RESET)
+            have_stream = false;
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    if (!a314_init(SERVICE_NAME, argc, argv, process_drv_msg))
+    {
+        logger_error("Unable to attach to a314d, shutting down\n");
+        return -1;
+    }
+
+    ws_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (ws_listen_fd < 0)
+    {
+        logger_error("Unable to create websocket listen socket\n");
+        return -1;
+    }
+
+    int flag = 1;
+    setsockopt(ws_listen_fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(WEBSOCKET_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(ws_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(ws_listen_fd, 10) != 0)
+    {
+        logger_error("Unable to listen on websocket port %d\n", WEBSOCKET_PORT);
+        return -1;
+    }
+
+    logger_info("RemoteWB service is running, websocket port %d\n", WEBSOCKET_PORT);
+
+    bool done = false;
+
+    while (!done)
+    {
+        std::vector<struct pollfd> fds;
+
+        struct pollfd pfd;
+        pfd.fd = a314_fd();
+        pfd.events = POLLIN | (a314_want_write() ? POLLOUT : 0);
+        pfd.revents = 0;
+        fds.push_back(pfd);
+
+        pfd.fd = ws_listen_fd;
+        pfd.events = POLLIN;
+        fds.push_back(pfd);
+
+        std::vector<std::list<WsClient>::iterator> client_its;
+        for (auto it = ws_clients.begin(); it != ws_clients.end(); ++it)
+        {
+            pfd.fd = it->fd;
+            pfd.events = POLLIN | (it->wpos < it->wbuf.size() ? POLLOUT : 0);
+            fds.push_back(pfd);
+            client_its.push_back(it);
+        }
+
+        if (poll(&fds[0], fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                break;
+            logger_error("poll failed with unexpected errno = %d\n", errno);
+            break;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+        {
+            if (!a314_handle_readable())
+            {
+                logger_error("Connection to a314d was closed, terminating.\n");
+                done = true;
+            }
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            int fd = accept(ws_listen_fd, nullptr, nullptr);
+            if (fd >= 0)
+            {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                ws_clients.emplace_back();
+                ws_clients.back().fd = fd;
+            }
+        }
+
+        for (size_t i = 0; i < client_its.size(); i++)
+        {
+            auto it = client_its[i];
+            struct pollfd &cfd = fds[2 + i];
+            bool close_client = false;
+
+            if (cfd.revents & (POLLIN | POLLERR | POLLHUP))
+            {
+                uint8_t chunk[4096];
+                while (true)
+                {
+                    ssize_t r = recv(it->fd, chunk, sizeof(chunk), 0);
+                    if (r > 0)
+                        it->rbuf.insert(it->rbuf.end(), chunk, chunk + r);
+                    else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+                    else
+                    {
+                        close_client = true;
+                        break;
+                    }
+                }
+
+                if (!close_client && !it->handshaken)
+                    close_client = !ws_try_handshake(&*it);
+                if (!close_client && it->handshaken)
+                    close_client = !ws_process_frames(&*it);
+            }
+
+            if (!close_client && it->wpos < it->wbuf.size())
+            {
+                while (it->wpos < it->wbuf.size())
+                {
+                    ssize_t w = send(it->fd, &it->wbuf[it->wpos], it->wbuf.size() - it->wpos, 0);
+                    if (w > 0)
+                        it->wpos += w;
+                    else if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        break;
+                    else
+                    {
+                        close_client = true;
+                        break;
+                    }
+                }
+
+                if (it->wpos == it->wbuf.size())
+                {
+                    it->wbuf.clear();
+                    it->wpos = 0;
+                }
+            }
+
+            if (close_client)
+                ws_close_client(it);
+        }
+
+        if (!done && !a314_flush())
+        {
+            logger_error("Connection to a314d was closed, terminating.\n");
+            done = true;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,428 @@
+/*
+ * a314vpd - native video streaming pipeline for videoplayer.c.
+ *
+ * Speaks the same wire protocol as videoplayer.py, but takes chunky frames
+ * (one byte per pixel) as input and performs the chunky-to-planar conversion
+ * on the Pi, with NEON intrinsics where available. Conversion runs on its
+ * own thread, so frame N+1 is converted while frame N is in flight over the
+ * SPI link, and the Amiga's two bitplane pointers double-buffer the display.
+ *
+ * The input is a stream of frames read from a file or FIFO (-input <path>),
+ * each frame being 32 bytes of palette (16 big-endian color words) followed
+ * by 320x256 chunky pixels with values 0-15. Such a stream is easy to
+ * produce with e.g. ffmpeg plus a small quantizer.
+ *
+ * The driver socket handling is a314client.h; this file only implements the
+ * conversion pipeline and the player session.
+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../a314client/a314client.h"
+
+#define LOGGER_TRACE 0
+#define logger_trace(...) do { if (LOGGER_TRACE) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_DEBUG 0
+#define logger_debug(...) do { if (LOGGER_DEBUG) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_INFO 1
+#define logger_info(...) do { if (LOGGER_INFO) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_WARN 1
+#define logger_warn(...) do { if (LOGGER_WARN) fprintf(stdout, __VA_ARGS__); } while (0)
+
+#define LOGGER_ERROR 1
+#define logger_error(...) do { if (LOGGER_ERROR) fprintf(stderr, __VA_ARGS__); } while (0)
+
+#define SERVICE_NAME            "videoplayer"
+
+// Frame geometry; matches what videoplayer.c allocates in chip RAM.
+#define FRAME_WIDTH             320
+#define FRAME_HEIGHT            256
+#define FRAME_PLANES            4
+#define CHUNKY_SIZE             (FRAME_WIDTH * FRAME_HEIGHT)
+#define PLANE_SIZE              (FRAME_WIDTH / 8 * FRAME_HEIGHT)
+#define PLANAR_SIZE             (PLANE_SIZE * FRAME_PLANES)
+#define PAL_SIZE                32
+#define INPUT_FRAME_SIZE        (PAL_SIZE + CHUNKY_SIZE)
+
+#define DEFAULT_INPUT_PATH      "/home/pi/player/video.chunky"
+
+// ---------------------------------------------------------------------------
+// Chunky-to-planar conversion. The planar frame is laid out with the planes
+// sequentially, PLANE_SIZE bytes each, same as the pre-converted .ami frames
+// that videoplayer.py played.
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+static void chunky_to_planar(const uint8_t *chunky, uint8_t *planar)
+{
+    static const uint8_t weights_arr[16] = {
+        128, 64, 32, 16, 8, 4, 2, 1,
+        128, 64, 32, 16, 8, 4, 2, 1,
+    };
+    uint8x16_t weights = vld1q_u8(weights_arr);
+
+    for (int i = 0; i < CHUNKY_SIZE; i += 16)
+    {
+        uint8x16_t pix = vld1q_u8(&chunky[i]);
+
+        for (int p = 0; p < FRAME_PLANES; p++)
+        {
+            uint8x16_t mask = vtstq_u8(pix, vdupq_n_u8(1 << p));
+            uint8x16_t bits = vandq_u8(mask, weights);
+
+            // Horizontal add of each 8-lane half packs the bits of 8 pixels
+            // into one plane byte.
+            uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(bits)));
+
+            uint8_t *dst = &planar[p * PLANE_SIZE + i / 8];
+            dst[0] = (uint8_t)vgetq_lane_u64(sum, 0);
+            dst[1] = (uint8_t)vgetq_lane_u64(sum, 1);
+        }
+    }
+}
+
+#else
+
+static void chunky_to_planar(const uint8_t *chunky, uint8_t *planar)
+{
+    for (int i = 0; i < CHUNKY_SIZE; i += 8)
+    {
+        for (int p = 0; p < FRAME_PLANES; p++)
+        {
+            uint8_t b = 0;
+            for (int k = 0; k < 8; k++)
+                b = (b << 1) | ((chunky[i + k] >> p) & 1);
+            planar[p * PLANE_SIZE + i / 8] = b;
+        }
+    }
+}
+
+#endif
+
+// ---------------------------------------------------------------------------
+// Converter thread. Reads and converts frames into two staging slots, one
+// ahead of the frame that is currently being transmitted. The main thread is
+// woken through an eventfd when a slot becomes ready.
+
+struct FrameSlot
+{
+    uint8_t pal[PAL_SIZE];
+    uint8_t planar[PLANAR_SIZE];
+};
+
+static FrameSlot frame_slots[2];
+
+static std::mutex convert_mutex;
+static std::condition_variable convert_cv;
+static int slots_ready = 0;
+static bool input_eof = false;
+static bool converter_stop = false;
+
+static int convert_efd = -1;
+
+static int input_fd = -1;
+
+static bool read_input_frame(uint8_t *pal, uint8_t *chunky)
+{
+    uint8_t *dst[2] = {pal, chunky};
+    size_t want[2] = {PAL_SIZE, CHUNKY_SIZE};
+
+    for (int part = 0; part < 2; part++)
+    {
+        size_t got = 0;
+        while (got < want[part])
+        {
+            ssize_t r = read(input_fd, dst[part] + got, want[part] - got);
+            if (r <= 0)
+                return false;
+            got += r;
+        }
+    }
+    return true;
+}
+
+static void converter_thread_main()
+{
+    static uint8_t chunky[CHUNKY_SIZE];
+    int write_index = 0;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(convert_mutex);
+            convert_cv.wait(lock, [] { return slots_ready < 2 || converter_stop; });
+            if (converter_stop)
+                return;
+        }
+
+        FrameSlot &slot = frame_slots[write_index];
+
+        if (!read_input_frame(slot.pal, chunky))
+        {
+            std::lock_guard<std::mutex> lock(convert_mutex);
+            input_eof = true;
+
+            uint64_t one = 1;
+            write(convert_efd, &one, sizeof(one));
+            return;
+        }
+
+        chunky_to_planar(chunky, slot.planar);
+        write_index ^= 1;
+
+        {
+            std::lock_guard<std::mutex> lock(convert_mutex);
+            slots_ready++;
+        }
+
+        uint64_t one = 1;
+        write(convert_efd, &one, sizeof(one));
+    }
+}
+
+// ---------------------------------------------------------------------------
+// The player session; the protocol to videoplayer.c is unchanged. The Amiga
+// first sends its two bitplane buffer addresses, then requests frames one at
+// a time by sending the index of the buffer to fill.
+
+static bool have_session = false;
+static uint32_t session_stream_id = 0;
+static bool received_bpl_ptrs = false;
+static uint32_t bpl_addresses[2];
+static bool frame_requested = false;
+static int requested_bpl = 0;
+static bool write_in_flight = false;
+static uint8_t pending_pal[PAL_SIZE];
+static int read_index = 0;
+
+static void send_frame_done()
+{
+    uint8_t *p = a314_append(MSG_DATA, session_stream_id, 2 + PAL_SIZE);
+    p[0] = 0;
+    p[1] = 1;
+    memcpy(&p[2], pending_pal, PAL_SIZE);
+}
+
+static void send_end_of_video()
+{
+    uint8_t *p = a314_append(MSG_DATA, session_stream_id, 2);
+    p[0] = 0;
+    p[1] = 0;
+}
+
+// Serves a pending frame request if a converted frame is available; returns
+// without doing anything if the converter has not caught up yet.
+static void maybe_serve_frame_request()
+{
+    if (!have_session || !frame_requested || write_in_flight)
+        return;
+
+    bool ready, eof;
+    {
+        std::lock_guard<std::mutex> lock(convert_mutex);
+        ready = slots_ready > 0;
+        eof = input_eof;
+    }
+
+    if (!ready)
+    {
+        if (eof)
+        {
+            send_end_of_video();
+            frame_requested = false;
+        }
+        return;
+    }
+
+    FrameSlot &slot = frame_slots[read_index];
+
+    uint32_t address = bpl_addresses[requested_bpl];
+    uint8_t *p = a314_append(MSG_WRITE_MEM_STREAM, 0, 4 + PLANAR_SIZE);
+    memcpy(&p[0], &address, 4);
+    memcpy(&p[4], slot.planar, PLANAR_SIZE);
+    memcpy(pending_pal, slot.pal, PAL_SIZE);
+
+    read_index ^= 1;
+    frame_requested = false;
+    write_in_flight = true;
+
+    // The slot is free as soon as its contents have been copied into the
+    // outgoing message; wake the converter to refill it.
+    {
+        std::lock_guard<std::mutex> lock(convert_mutex);
+        slots_ready--;
+    }
+    convert_cv.notify_one();
+}
+
+static void close_session()
+{
+    have_session = false;
+    received_bpl_ptrs = false;
+    frame_requested = false;
+    write_in_flight = false;
+}
+
+static void process_drv_msg(uint32_t stream_id, uint8_t type, const uint8_t *payload, size_t len)
+{
+    if (type == MSG_CONNECT)
+    {
+        if (len == strlen(SERVICE_NAME) && memcmp(payload, SERVICE_NAME, len) == 0 && !have_session)
+        {
+            have_session = true;
+            session_stream_id = stream_id;
+            a314_connect_response(stream_id, CONNECT_RES_OK);
+        }
+        else
+            a314_connect_response(stream_id, CONNECT_RES_UNKNOWN);
+    }
+    else if (type == MSG_WRITE_MEM_RES)
+    {
+        write_in_flight = false;
+        if (have_session)
+        {
+            send_frame_done();
+            maybe_serve_frame_request();
+        }
+    }
+    else if (have_session && stream_id == session_stream_id)
+    {
+        if (type == MSG_DATA)
+        {
+            if (!received_bpl_ptrs)
+            {
+                if (len < 8)
+                    return;
+                bpl_addresses[0] = ((uint32_t)payload[0] << 24) | ((uint32_t)payload[1] << 16) |
+                    ((uint32_t)payload[2] << 8) | payload[3];
+                bpl_addresses[1] = ((uint32_t)payload[4] << 24) | ((uint32_t)payload[5] << 16) |
+                    ((uint32_t)payload[6] << 8) | payload[7];
+                received_bpl_ptrs = true;
+            }
+            else if (len >= 1)
+            {
+                requested_bpl = payload[0] & 1;
+                frame_requested = true;
+                maybe_serve_frame_request();
+            }
+        }
+        else if (type == MSG_EOS)
+        {
+            a314_send_eos(stream_id);
+            close_session();
+        }
+        else if (type == MSG_RESET)
+            close_session();
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    std::string input_path = DEFAULT_INPUT_PATH;
+
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (strcmp(argv[i], "-input") == 0)
+            input_path = argv[i + 1];
+    }
+
+    if (!a314_init(SERVICE_NAME, argc, argv, process_drv_msg))
+    {
+        logger_error("Unable to attach to a314d, shutting down\n");
+        return -1;
+    }
+
+    input_fd = open(input_path.c_str(), O_RDONLY);
+    if (input_fd < 0)
+    {
+        logger_error("Unable to open input %s\n", input_path.c_str());
+        return -1;
+    }
+
+    convert_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (convert_efd < 0)
+    {
+        logger_error("Unable to create eventfd\n");
+        return -1;
+    }
+
+    std::thread converter(converter_thread_main);
+
+    logger_info("Video player server is running, input: %s\n", input_path.c_str());
+
+    bool done = false;
+
+    while (!done)
+    {
+        struct pollfd fds[2];
+        fds[0].fd = a314_fd();
+        fds[0].events = POLLIN | (a314_want_write() ? POLLOUT : 0);
+        fds[1].fd = convert_efd;
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                break;
+            logger_error("poll failed with unexpected errno = %d\n", errno);
+            break;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+        {
+            if (!a314_handle_readable())
+            {
+                logger_error("Connection to a314d was closed, terminating.\n");
+                done = true;
+            }
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            uint64_t v;
+            read(convert_efd, &v, sizeof(v));
+            maybe_serve_frame_request();
+        }
+
+        if (!done && !a314_flush())
+        {
+            logger_error("Connection to a314d was closed, terminating.\n");
+            done = true;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(convert_mutex);
+        converter_stop = true;
+    }
+    convert_cv.notify_one();
+    converter.join();
+
+    close(input_fd);
+    return 0;
+}